@@ -1,29 +1,61 @@
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <linux/magic.h>
+#include <linux/openat2.h>
+#include <linux/sched.h>
+
+#include <net/if.h>
+
 #include <sys/epoll.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/pidfd.h>
+#include <sys/quota.h>
+#include <sys/random.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
+#include <sys/xattr.h>
 
+#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <grp.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <search.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
 #define length(arr) \
   (sizeof (arr) / sizeof (arr[0]))
 
@@ -59,19 +91,89 @@ enum {
   OPTION_UNKOWN = 0,
   OPTION_BIND,
   OPTION_BIND_RO,
+  OPTION_COMMIT,
   OPTION_DOMAIN,
   OPTION_HELP,
   OPTION_HOME,
   OPTION_HOST,
+  OPTION_IDMAP,
   OPTION_IMAGE,
+  OPTION_IMAGE_MODE,
+  OPTION_NET,
+  OPTION_NSS,
+  OPTION_POOL,
+  OPTION_POOL_SIZE,
+  OPTION_PROFILE,
+  OPTION_READY_FD,
   OPTION_ROOT,
+  OPTION_TEMPLATE,
   OPTION_USER,
   OPTION_VERSION,
+  OPTION_WARMUP,
   OPTION_WORK,
+  OPTION_WRITABLE,
   OPTION_CGROUP,
   OPTION_RLIMIT,
 };
 
+enum {
+  MODE_COPY = 0,
+  MODE_OVERLAY,
+  MODE_STORE,
+  MODE_SYNC,
+};
+
+enum {
+  NET_HOST = 0,
+  NET_NONE,
+  NET_LOOPBACK,
+};
+
+enum {
+  WARMUP_IMAGE = 1 << 0,
+  WARMUP_EXEC  = 1 << 1,
+};
+
+#define INDEX_MAGIC "boxerid2"
+
+#define WRITABLE_SIZE "size=25%"
+
+/**
+ * NSS loads shared libraries at runtime, which static builds can't do.
+ */
+#ifndef WITH_NSS
+#define WITH_NSS 1
+#endif
+
+#define PROFILE_PATH "/etc/boxer/profiles"
+#define PROFILE_DEPTH 8
+
+#define NET_POOL "/run/boxer/netns"
+
+#define POOL_LATENCIES 1024
+#define POOL_REQUEST_MAX (1024 * 1024)
+
+enum {
+  POOL_CLAIM = 1,
+  POOL_EXITED,
+  POOL_PARKED,
+  POOL_STARTED,
+  POOL_STAT,
+};
+
+enum {
+  POOL_WORKER_STARTING = 0,
+  POOL_WORKER_PARKED,
+  POOL_WORKER_RUNNING,
+};
+
+enum {
+  IMAGE_DIRECTORY = 0,
+  IMAGE_EROFS,
+  IMAGE_SQUASHFS,
+  IMAGE_TAR,
+};
+
 enum {
   USLEEP_MILLISECONDS = 1000,
   USLEEP_SECONDS      = 1000 * 1000,
@@ -92,17 +194,55 @@ struct device {
   unsigned int min;
   dev_t dev;
   mode_t mode;
+  bool bind;
 };
 
 static struct boxer {
   char *id;
   struct boxer_fd {
+    int child;
     int epoll;
     int signal;
   } fd;
   bool tty;
+  bool mounted;
+  uint64_t start;
 } boxer;
 
+struct index_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime;
+  int64_t mtime_nsec;
+};
+
+struct index_entry {
+  uint64_t path;
+  uint64_t target;
+  uint64_t size;
+  uint64_t blocks;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t rdev;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+};
+
+struct index {
+  const char *data;
+  size_t size;
+  size_t count;
+  const struct index_entry *entry;
+};
+
 static struct container {
   struct container_user {
     uid_t uid;
@@ -110,14 +250,27 @@ static struct container {
     char *name;
     char *home;
     char *shell;
+    gid_t *group;
+    size_t groups;
   } user;
   struct container_path {
+    char *cgroup;
+    char *commit;
     char *console;
     char *home;
-    char *image;
     char *root;
+    char *template;
     char *work;
   } path;
+  struct container_image {
+    char *source;
+    char *path;
+    char *filter;
+    int type;
+    int fd;
+    int lock;
+    struct index index;
+  } *image;
   struct container_uts {
     const char *host;
     const char *domain;
@@ -131,6 +284,7 @@ static struct container {
     char *subsystem;
     char *parameter;
     char *value;
+    bool unified;
     struct {
       char *subsystem;
       char *hierarchy;
@@ -140,6 +294,8 @@ static struct container {
   } *cgroup;
   struct mount *bind;
   char **cmd;
+  int mode;
+  int warmup;
 } container;
 
 static struct console {
@@ -148,6 +304,12 @@ static struct console {
   int stdin;
   int stdout;
   struct console_buffer {
+    int pipe[2];
+    size_t size;
+    size_t pending;
+    bool spliced;
+    bool copy;
+    bool waiting;
     size_t len;
     char data[LINE_MAX];
   } inp, out;
@@ -161,13 +323,379 @@ static struct console {
   } attr;
 } console;
 
+struct hash {
+  uint32_t state[8];
+  uint64_t size;
+  unsigned char block[64];
+  size_t fill;
+};
+
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+struct tar_entry {
+  char *name;
+  char *target;
+  off_t size;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  dev_t dev;
+  char type;
+  bool uid_set;
+  bool gid_set;
+};
+
+struct copy_job {
+  char *src;
+  char *dst;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+};
+
+static struct copy {
+  struct copy_queue {
+    pthread_mutex_t lock;
+    struct copy_job *job;
+    size_t head;
+    size_t tail;
+    size_t size;
+  } *queue;
+  pthread_t *thread;
+  size_t threads;
+  size_t next;
+  size_t files;
+  off_t holes;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  size_t pending;
+  bool done;
+  struct copy_unsupported {
+    bool clone;
+    bool range;
+    bool sendfile;
+  } unsupported;
+} copy;
+
+struct path_sync_inode {
+  dev_t dev;
+  ino_t ino;
+  char *dst;
+};
+
 static struct path {
   struct path_sync {
     const char *src;
     const char *dst;
+    bool merge;
+    bool hardlink;
+    void *inodes;
+    struct path_sync_link {
+      char *target;
+      char *dst;
+    } *link;
+    size_t links;
+    off_t saved;
   } sync;
 } path;
 
+static struct store {
+  const char *src;
+  const char *dst;
+  struct hash key;
+  size_t objects;
+  size_t refs;
+  off_t size;
+  off_t referenced;
+} store;
+
+struct delta_entry {
+  char *path;
+  char *src;
+  size_t layer;
+  nlink_t nlink;
+  bool opaque;
+  struct delta_stat {
+    dev_t dev;
+    ino_t ino;
+    dev_t rdev;
+    off_t size;
+    blkcnt_t blocks;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    struct timespec ctime;
+  } st;
+};
+
+static struct delta {
+  const char *src;
+  size_t layer;
+  struct delta_entry *entry;
+  size_t entries;
+  size_t changed;
+  size_t removed;
+} delta;
+
+static struct indexer {
+  const char *src;
+  struct index_build {
+    char *path;
+    char *target;
+    struct index_entry entry;
+  } *entry;
+  size_t entries;
+} indexer;
+
+static struct warmup {
+  off_t budget;
+  off_t pinned;
+  size_t files;
+  size_t pages;
+  size_t before;
+  size_t after;
+  void *seen;
+} warmup;
+
+static struct template {
+  bool dev;
+} template;
+
+static struct user {
+  bool nss;
+  bool nss_found;
+} user;
+
+static struct profile {
+  char *name;
+  struct mount *mount;
+  size_t mounts;
+  struct device *device;
+  size_t devices;
+} profile;
+
+enum {
+  SETUP_ROOT = 0,
+  SETUP_IMAGE,
+  SETUP_UTS,
+  SETUP_MOUNTS,
+  SETUP_MOUNTS_IMAGE,
+  SETUP_DEVICES,
+  SETUP_BINDS,
+  SETUP_CONSOLE,
+  SETUP_STEPS,
+};
+
+/**
+ * The setup of a container is a graph of steps. A step starts in a thread
+ * of its own once all steps in its deps mask finished.
+ */
+static struct setup {
+  pthread_mutex_t lock;
+  pthread_cond_t change;
+  unsigned int finished;
+  uint64_t start;
+  struct setup_step {
+    const char *name;
+    void (*run) (void);
+    unsigned int deps;
+    bool started;
+    bool threaded;
+    pthread_t thread;
+    uint64_t begin;
+    uint64_t end;
+  } step[SETUP_STEPS];
+} setup = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .change = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * A pool message is sent between pool clients, the pool daemon, its workers
+ * and their containers. Claims carry argc command and envc environment
+ * strings of size bytes in total after the message, plus the standard file
+ * descriptors of the client.
+ */
+struct pool_message {
+  uint32_t type;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t size;
+  uint32_t uid;
+  int32_t value;
+  uint64_t time;
+};
+
+static struct pool {
+  char *name;
+  char *path;
+  size_t size;
+  size_t parked;
+  size_t starting;
+  size_t claims;
+  bool started;
+  int listen;
+  struct pool_worker {
+    pid_t pid;
+    int fd;
+    int state;
+  } *worker;
+  size_t workers;
+  struct pool_claim {
+    int fd;
+    uint64_t time;
+  } *waiting;
+  size_t waits;
+  struct pool_claim *pending;
+  size_t pendings;
+  uint32_t latency[POOL_LATENCIES];
+  size_t latencies;
+} pool;
+
+/**
+ * The registry file of a running container tells boxer exec how to join it:
+ * the container process, its user, working directory and shell, and the
+ * cgroups which get a sub-cgroup for each command.
+ */
+static struct exec {
+  char *id;
+  char *path;
+  char *work;
+  char *shell;
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+  struct exec_cgroup {
+    char *path;
+    char *sub;
+    bool unified;
+  } *cgroup;
+  size_t cgroups;
+  bool client;
+} exec;
+
+static struct notify {
+  int fd;
+  int setup[2];
+  int app[2];
+  char line[256];
+  size_t len;
+  bool set_up;
+  bool failed;
+} notify;
+
+/**
+ * The network namespace claimed from the pool, if any. Its file stays open
+ * and locked while the container runs.
+ */
+static struct net {
+  int mode;
+  int fd;
+  char *path;
+} net;
+
+/**
+ * The setup steps mount from several threads at once.
+ */
+static struct mounter {
+  _Atomic size_t mounts;
+  _Atomic size_t calls;
+  _Atomic size_t configs;
+  _Atomic bool legacy;
+} mounter;
+
+static struct commit {
+  const char *src;
+  const char *dst;
+  struct timespec *start;
+  bool scan;
+  bool untracked;
+  size_t files;
+  size_t whiteouts;
+} commit;
+
+static struct idmap {
+  unsigned int from;
+  unsigned int to;
+  unsigned int count;
+  int fd;
+} idmap;
+
+static struct writable {
+  char *dir;
+  char *path;
+  char *data;
+  off_t size;
+  off_t nr_inodes;
+  off_t used_bytes;
+  off_t used_inodes;
+  unsigned int project;
+  struct {
+    unsigned int first;
+    unsigned int last;
+  } projects;
+  int lock;
+  int fd;
+} writable;
+
+/**
+ * A batch job keeps the state of its container while other containers are
+ * started, and gets it back to clean up after its container exited.
+ */
+struct batch_job {
+  char *text;
+  char **argv;
+  size_t line;
+  char *id;
+  int pidfd;
+  int mnt;
+  int timing;
+  int status;
+  uint64_t start;
+  uint64_t setup;
+  uint64_t end;
+  struct container container;
+  struct writable writable;
+  struct exec exec;
+  struct commit commit;
+  struct idmap idmap;
+  struct net net;
+};
+
+static struct batch {
+  char *id;
+  struct batch_job *job;
+  size_t jobs;
+  size_t next;
+  size_t running;
+  size_t limit;
+  size_t failed;
+  uint64_t start;
+  char *results;
+  FILE *out;
+  int base;
+  int cwd;
+} batch;
+
 static const struct mount mounts[] = {
   {"/bin", NULL, NULL, NULL, MS_BIND | MS_RDONLY | MS_NOSUID},
   {"/dev", "tmpfs", NULL, "mode=755", MS_NOSUID},
@@ -186,14 +714,65 @@ static const struct mount mounts[] = {
   {"/usr/share", NULL, NULL, NULL, MS_BIND | MS_RDONLY | MS_NOSUID},
 };
 
+/**
+ *  - /dev/ptmx -> pts/ptmx
+ *  - /dev/fd -> /proc/self/fd
+ *  - /dev/stdin -> /proc/self/fd/0
+ *  - /dev/stdout -> /proc/self/fd/1
+ *  - /dev/stderr -> /proc/self/fd/2
+ */
+static const struct link {
+  char *target;
+  char *name;
+} links[] = {
+  {"pts/ptmx", "/dev/ptmx"},
+  {"/proc/self/fd", "/dev/fd"},
+  {"/proc/self/fd/0", "/dev/stdin"},
+  {"/proc/self/fd/1", "/dev/stdout"},
+  {"/proc/self/fd/2", "/dev/stderr"},
+};
+
 static const struct device devices[] = {
-  {"/dev/null", NULL, 0x1, 0x3, 0, 0},
-  {"/dev/console", NULL, 0x1, 0x3, 0, 0666},
-  {"/dev/zero", NULL, 0x1, 0x5, 0, 0},
-  {"/dev/full", NULL, 0x1, 0x7, 0, 0},
-  {"/dev/tty", NULL, 0x5, 0x0, 0, 0},
-  {"/dev/random", NULL, 0x1, 0x8, 0, 0},
-  {"/dev/urandom", NULL, 0x1, 0x9, 0, 0},
+  {"/dev/null", NULL, 0x1, 0x3, 0, 0, false},
+  {"/dev/console", NULL, 0x1, 0x3, 0, 0666, false},
+  {"/dev/zero", NULL, 0x1, 0x5, 0, 0, false},
+  {"/dev/full", NULL, 0x1, 0x7, 0, 0, false},
+  {"/dev/tty", NULL, 0x5, 0x0, 0, 0, false},
+  {"/dev/random", NULL, 0x1, 0x8, 0, 0, false},
+  {"/dev/urandom", NULL, 0x1, 0x9, 0, 0, false},
+};
+
+/**
+ * The built-in profiles are written like the sections of PROFILE_PATH. The
+ * default profile has all mounts and devices above.
+ */
+static const struct {
+  char *name;
+  char *text;
+} profiles[] = {
+  {"minimal",
+   "mount /bin\n"
+   "mount /dev\n"
+   "mount /dev/pts\n"
+   "mount /lib\n"
+   "mount /lib64\n"
+   "mount /proc\n"
+   "mount /usr/bin\n"
+   "mount /usr/lib\n"
+   "device /dev/null\n"
+   "device /dev/console\n"
+   "device /dev/zero\n"
+   "device /dev/urandom\n"},
+  {"default", NULL},
+  {"full",
+   "include default\n"
+   "mount /sbin\n"
+   "mount /usr/include\n"
+   "mount /usr/libexec\n"
+   "mount /usr/local\n"
+   "mount /usr/sbin\n"
+   "device /dev/fuse bind\n"
+   "device /dev/net/tun bind\n"},
 };
 
 static void print_message (int, const char *, ...);
@@ -202,17 +781,36 @@ static void print_version (void);
 
 static void fd_block (int, bool);
 
+static off_t copy_data (int, int, off_t);
+static void copy_data_sparse (int, int, off_t);
+static void copy_fd (int, int, off_t, bool);
+static void copy_file (const char *, const char *, const struct stat *);
+static void copy_finish (void);
+static void copy_run (struct copy_job *);
+static void copy_start (void);
+static void *copy_worker (void *);
+
+static void hash_block (struct hash *, const unsigned char *);
+static void hash_digest (struct hash *, unsigned char *);
+static void hash_fd (struct hash *, int);
+static void hash_final (struct hash *, char *);
+static void hash_init (struct hash *);
+static void hash_update (struct hash *, const void *, size_t);
+
 static char *path_clean (const char *);
 static void path_create (const char *);
 static bool path_exists (const char *);
 static void path_iterate (const char *, void (*)(const char *));
 static char *path_join (const char *, ...);
-static int path_sync (const char *, const char *);
+static void path_remove (const char *);
+static int path_sync (const char *, const char *, bool, const struct index *);
 static void path_write (const char *, const char *, ...);
 
 static bool str_equals (const char *, const char *);
 static char *str_random (const char *, size_t);
 static void str_split_at (const char *, int, char **, char **);
+static char **str_split_words (const char *);
+static bool str_ends_with (const char *, const char *);
 static bool str_starts_with (const char *, const char *);
 static long int str_to_long (const char *);
 
@@ -220,12 +818,193 @@ static void options_parse (int, char *const[]);
 static void options_set (int, const char *, char *);
 static void options_set_bind_mount (const char *, bool);
 static void options_set_cgroup (const char *, char *);
+static void options_set_idmap (const char *);
+static void options_set_image (char *);
+static void options_set_mode (const char *);
+static void options_set_net (const char *);
 static void options_set_rlimit (const char *, char *);
+static void options_set_warmup (const char *);
+static void options_set_writable (const char *);
 
+static int device_loop (const char *, char **);
+static void device_links (const char *);
 static void device_setup (const struct device *);
+static uint64_t mount_attr (unsigned long);
+static bool mount_bind (const struct mount *);
+static int mount_config (int, unsigned int, const char *, const char *);
+static bool mount_fs (const struct mount *);
+static bool mount_new (const struct mount *);
 static void mount_setup (const struct mount *);
 
+static unsigned long tar_checksum (const struct tar_header *);
+static int tar_create (int, const char *, const struct tar_entry *);
+static void tar_data (int, int, off_t);
+static int tar_dir (int, char *, uint64_t);
+static bool tar_escapes (const char *);
+static void tar_extract (const struct container_image *, const char *);
+static off_t tar_extract_entry (int, int, const struct tar_entry *);
+static off_t tar_number (const char *, size_t);
+static int tar_open (const struct container_image *, pid_t *);
+static int tar_parent (int, const char *, uint64_t, const char **);
+static off_t tar_pax (int, off_t, struct tar_entry *);
+static bool tar_read (int, void *, size_t);
+static void tar_skip (int, off_t);
+static char *tar_string (int, off_t);
+
+static void store_command (int, char *const[]);
+static void store_gc (void);
+static int store_gc_callback (const char *, const struct stat *, int, struct FTW *);
+static void store_import (const char *, const char *);
+static int store_import_callback (const char *, const struct stat *, int, struct FTW *);
+static int store_key_callback (const char *, const struct stat *, int, struct FTW *);
+static int store_lock (int);
+static char *store_object (const char *, const struct stat *);
+static void store_prepare (struct container_image *);
+static void store_setup (void);
+static void store_stat (void);
+static int store_stat_callback (const char *, const struct stat *, int, struct FTW *);
+
+static void delta_apply (const struct delta_entry *, const struct delta_entry *);
+static int delta_collect (const char *, const struct stat *, int, struct FTW *);
+static int delta_compare (const void *, const void *);
+static int delta_compare_path (const void *, const void *);
+static bool delta_equals (const struct delta_stat *, const struct delta_stat *);
+static bool delta_hidden (const struct delta_entry *);
+static bool delta_link (const struct delta_entry *, const char *, bool);
+static struct delta_entry *delta_load (const char *, size_t *);
+static void delta_save (const char *);
+static void delta_setup (void);
+
+static int index_callback (const char *, const struct stat *, int, struct FTW *);
+static void index_command (int, char *const[]);
+static int index_compare (const void *, const void *);
+static bool index_current (const struct index *, const char *);
+static const struct index_entry *index_find (const struct index *, const char *);
+static void index_open (struct index *, const char *);
+static const char *index_path (const struct index *, const struct index_entry *);
+static void index_stat (const struct index_entry *, struct stat *);
+static bool index_string (const struct index *, uint64_t);
+static const char *index_target (const struct index *, const struct index_entry *);
+static bool index_valid (const struct index *);
+static void index_write (const char *);
+
+static int warmup_callback (const char *, const struct stat *, int, struct FTW *);
+static void warmup_command (int, char *const[]);
+static void warmup_elf (const char *);
+static void warmup_file (const char *);
+static bool warmup_library (const char *, const char *, const char *);
+static void warmup_report (void);
+static size_t warmup_resident (void *, size_t, unsigned char *, size_t);
+static char *warmup_resolve (const char *);
+static void warmup_setup (void);
+
+static bool template_clone (const struct mount *);
+static bool template_entry (const struct mount *);
+static void template_prepare (void);
+
+static int profile_compare (const void *, const void *);
+static void profile_device (const char *, bool);
+static void profile_init (void);
+static void profile_line (char **, const char *, size_t, unsigned int);
+static void profile_load (const char *, unsigned int);
+static void profile_mount (const char *, bool);
+static void profile_omit (const char *);
+static bool profile_read (FILE *, const char *, const char *, unsigned int);
+
+static int commit_callback (const char *, const struct stat *, int, struct FTW *);
+static void commit_command (int, char *const[]);
+static void commit_deleted (const char *);
+static void commit_entry (const char *, const char *, const struct stat *);
+static void commit_mark (void);
+static void commit_prepare (void);
+static void commit_write (void);
+
+static unsigned int idmap_id (unsigned int);
+static bool idmap_mount (const char *, const char *);
+static int idmap_userns (void);
+
+static int writable_callback (const char *, const struct stat *, int, struct FTW *);
+static unsigned int writable_claim (void);
+static void writable_prepare (void);
+static bool writable_quota (unsigned int, off_t, off_t);
+static void writable_remove (void);
+static void writable_report (void);
+
+static void pool_accept (void);
+static void pool_claim (void);
+static void pool_command (int, char *const[]);
+static int pool_connect (void);
+static char *pool_data (int, size_t);
+static void pool_dispatch (int, uint64_t);
+static uint64_t pool_now (void);
+static void pool_park (int);
+static void pool_reap (void);
+static int pool_recv (int, struct pool_message *, int *, size_t, int);
+static void pool_refill (void);
+static void pool_request (size_t);
+static void pool_run (void);
+static bool pool_send (int, const struct pool_message *, const void *, const int *, size_t);
+static void pool_spawn (void);
+static void pool_stat (int);
+static int pool_stat_compare (const void *, const void *);
+static void pool_stop (void);
+static void pool_update (struct pool_worker *);
+static void pool_worker (int);
+static void pool_worker_stop (bool, int);
+
+static void batch_command (int, char *const[]);
+static int batch_compare (const void *, const void *);
+static void batch_finish (struct batch_job *, bool);
+static void batch_launch (struct batch_job *);
+static void batch_load (const char *);
+static void batch_report (void);
+static void batch_switch (int);
+
+static void setup_binds (void);
+static void setup_console (void);
+static void setup_devices (void);
+static void setup_image (void);
+static void setup_mounts (void);
+static void setup_mounts_image (void);
+static bool setup_overlaps (const char *);
+static void setup_report (void);
+static void setup_root (void);
+static void setup_run (void);
+static void *setup_step (void *);
+static void setup_uts (void);
+
+static void exec_add (char *, bool);
+static void exec_command (int, char *const[]);
+static void exec_idle (void);
+static void exec_load (const char *);
+static bool exec_member (const char *, pid_t);
+static void exec_register (pid_t);
+static void exec_serve (int, char *const[]);
+static void exec_stop (bool, int);
+static void exec_unregister (void);
+
+static void notify_child (void);
+static void notify_exec (void);
+static void notify_init (void);
+static void notify_noexec (void);
+static void notify_parent (void);
+static void notify_read (int);
+static void notify_report (const char *, uint64_t, const char *);
+static void notify_setup (void);
+static void notify_stop (int);
+
+static void net_claim (void);
+static void net_command (int, char *const[]);
+static void net_create (void);
+static void net_release (void);
+static bool net_scan (void);
+static void net_setup (void);
+
+static void console_buffer_copy (struct console_buffer *, int, int);
+static void console_buffer_init (struct console_buffer *);
 static void console_buffer_pipe (struct console_buffer *, int, int);
+static void console_buffer_splice (struct console_buffer *, int, int);
+static void console_buffer_wait (struct console_buffer *, int);
 static void console_forward_size (int, int);
 static void console_init (void);
 static void console_make_raw (int, struct termios *);
@@ -235,19 +1014,40 @@ static void console_setup_master (void);
 static void console_setup_slave (void);
 
 static bool container_image_contains (const char *);
+static void container_enter_cgroup (pid_t, bool);
+static void container_finish (bool, int);
 static void container_init (void);
+static void container_image_probe (struct container_image *);
 static void container_kill (void);
+static int container_prepare_cgroup (void);
 static void container_run (void);
 static void container_setup (void);
 static void container_setup_cgroup (void);
+static void container_setup_overlay (void);
 static void container_setup_rlimit (void);
 
+static void user_group (gid_t);
+static void user_groups (void);
+#if WITH_NSS
+static void user_groups_nss (void);
+#endif
+static void user_init (void);
+static void user_set (const struct passwd *);
+
+static char *boxer_cgroup (const char *, const char *);
+static void boxer_child (void);
+static pid_t boxer_clone (int *);
+static void boxer_command (int, char *const[]);
+static void boxer_fd_events (int, uint32_t);
 static void boxer_fd_poll (int);
 static void boxer_fd_unpoll (int);
 static void boxer_init (void);
+static void boxer_mount_cgroup (const char *, const char *, unsigned long);
 static void boxer_run (void);
 static void boxer_setup (void);
 static void boxer_signal (void);
+static pid_t boxer_start (bool);
+static void boxer_stop (bool, int);
 
 static void
 print_message (int level, const char *format, ...)
@@ -288,13 +1088,35 @@ print_help (void)
           "  -v, --version            Print version information and exit\n"
           "  -b, --bind=SRC[:DST]     Bind SRC to a path DST in container\n"
           "  -B, --bind-ro=SRC[:DST]  Bind SRC read-only to a path DST in container\n"
+          "      --commit=DIR         Write changes to the root as image layer to DIR\n"
           "  -d, --domain=NAME        Domainname in container\n"
           "  -H, --home=DIR           Home directory in container\n"
           "      --host=NAME          Hostname in container\n"
-          "  -i, --image=DIR          Image of the root filesystem\n"
+          "      --idmap=FROM:TO[:COUNT]\n"
+          "                           Swap owners FROM and TO of the image in container\n"
+          "  -i, --image=PATH         Image directory, EROFS/squashfs file or tar archive\n"
+          "                           of the root filesystem, repeat to stack layers\n"
+          "      --image-mode=MODE    Use the image as copy (default), overlay, store\n"
+          "                           or sync it into a persistent root\n"
+          "      --net=MODE           Share the network of the host (default) or use a\n"
+          "                           network namespace with none or loopback\n"
+          "      --nss=on             Look up users missing in /etc/passwd with NSS\n"
+          "      --pool=NAME          Run the command in a prepared container of a pool\n"
+          "      --pool-size=N        Number of prepared containers of a pool\n"
+          "      --profile=NAME       Mounts and devices: minimal, default, full or a\n"
+          "                           profile of " PROFILE_PATH "\n"
+          "      --ready-fd=N         Report setup, exec and readiness of the command\n"
+          "                           on file descriptor N\n"
           "  -r, --root=DIR           Root directory\n"
+          "      --template=DIR       Clone system mounts from a template in DIR\n"
           "  -u, --user=NAME          User in container\n"
+          "      --warmup=LIST        Read image and/or exec into the page cache first\n"
           "  -w, --work=DIR           Working directory in container\n"
+          "      --writable=tmpfs[:OPTIONS]\n"
+          "      --writable=DIR[:OPTIONS]\n"
+          "                           Place the writable root on a tmpfs or a directory,\n"
+          "                           OPTIONS are size=SIZE, nr_inodes=COUNT, noswap,\n"
+          "                           huge=POLICY (tmpfs) or project=ID[-ID] (directory)\n"
           "\n"
           "Cgroup Options:\n"
           "      --cgroup.SUBSYSTEM.PARAMETER=VALUE\n"
@@ -302,6 +1124,22 @@ print_help (void)
           "Rlimit Options:\n"
           "      --rlimit.RESOURCE=HARD\n"
           "      --rlimit.RESOURCE=SOFT/HARD\n"
+          "\n"
+          "Commands:\n"
+          "  batch [--jobs=N] [--results=FILE] JOBS\n"
+          "                           Run the containers listed in JOBS, N at a time\n"
+          "  commit DIR IMAGE...      Flatten image layers into DIR with hard links\n"
+          "  exec ID [COMMAND]...     Run a command in the running container ID\n"
+          "  index IMAGE...           Write an index of each image directory\n"
+          "  netns COUNT              Keep COUNT network namespaces ready for --net\n"
+          "  pool start NAME [OPTION]...\n"
+          "                           Keep prepared containers for --pool=NAME\n"
+          "  pool stat NAME           Print the state and start latencies of a pool\n"
+          "  serve [OPTION]...        Keep a container without a command up for exec\n"
+          "  store gc                 Remove unused images and objects from the image store\n"
+          "  store stat               Print the space saved by the image store\n"
+          "  warmup [--pin=SIZE] PATH...\n"
+          "                           Read files into the page cache, pin up to SIZE\n"
           "",
           program_invocation_short_name);
 }
@@ -334,922 +1172,7996 @@ fd_block (int fd, bool block)
 }
 
 /**
-* path_clean removes consecutive and trailing directory separators.
-* Both do no harm, they just look ugly in the logs.
-* It's a simple alternative to realpath and canonicalize_file_name, which are
-* limited because they require their arguments to be existing paths.
-*/
-static char *
-path_clean (const char *path)
+ * copy_data copies up to len bytes from the current offset of file descriptor
+ * ifd to the current offset of ofd and returns the number of bytes copied. It
+ * prefers methods that keep the data inside the kernel: copy_file_range lets
+ * the file system offload the copy, and sendfile at least avoids the round
+ * trip through user space. Each method that turns out to be unsupported is
+ * skipped for all following files.
+ */
+static off_t
+copy_data (int ifd, int ofd, off_t len)
 {
-  char *result;
-  char *end;
-  char *pos;
+  char buffer[16384];
+  ssize_t ret;
+  off_t done = 0;
+
+  while (done < len && !__atomic_load_n (&copy.unsupported.range, __ATOMIC_RELAXED)) {
+    ret = copy_file_range (ifd, NULL, ofd, NULL, len - done, 0);
+    if (ret == 0)
+      return done;
+    if (ret < 0) {
+      if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        fatal ("copy_file_range");
+      __atomic_store_n (&copy.unsupported.range, true, __ATOMIC_RELAXED);
+    }
+    else
+      done += ret;
+  }
 
-  result = strdup (path);
-  if (result == NULL)
-    fatal ("strdup");
-  pos = end = result;
-  while (*end) {
-    *pos = *end;
-    if (*end == '/')
-      while (*end == '/')
-        end++;
+  while (done < len && !__atomic_load_n (&copy.unsupported.sendfile, __ATOMIC_RELAXED)) {
+    ret = sendfile (ofd, ifd, NULL, len - done);
+    if (ret == 0)
+      return done;
+    if (ret < 0) {
+      if (errno != EINVAL && errno != ENOSYS)
+        fatal ("sendfile");
+      __atomic_store_n (&copy.unsupported.sendfile, true, __ATOMIC_RELAXED);
+    }
     else
-      end++;
-    pos++;
+      done += ret;
   }
-  /**
-   * Remove trailing slash if path is not "/".
-   */
-  if (((pos - result) > 1) && (pos[-1] == '/'))
-    pos--;
-  *pos = '\0';
 
-  return result;
+  errno = 0;
+  while (done < len) {
+    ret = read (ifd, buffer, (len - done < (off_t) sizeof (buffer)) ? (size_t) (len - done) : sizeof (buffer));
+    if (ret < 0)
+      fatal ("read");
+    if (ret == 0)
+      break;
+    if (write (ofd, buffer, ret) != ret)
+      fatal ("write");
+    done += ret;
+  }
+  return done;
 }
 
-static inline void
-path_create_dir (const char *path)
+/**
+ * copy_data_sparse copies only the data regions of file descriptor ifd to
+ * ofd, so holes in the source file stay holes in the target file.
+ */
+static void
+copy_data_sparse (int ifd, int ofd, off_t size)
 {
-  const mode_t mode = 0755;
-
-  if (mkdir (path, mode) != 0)
-    if (errno != EEXIST)
-      fatal ("mkdir %s mode=%#o", path, mode);
-  errno = 0;
+  off_t data;
+  off_t hole;
+  off_t holes;
+
+  holes = size;
+  for (hole = 0; hole < size; ) {
+    data = lseek (ifd, hole, SEEK_DATA);
+    if (data < 0) {
+      if (errno != ENXIO)
+        fatal ("lseek SEEK_DATA");
+      errno = 0;
+      break;
+    }
+    hole = lseek (ifd, data, SEEK_HOLE);
+    if (hole < 0)
+      fatal ("lseek SEEK_HOLE");
+    if (lseek (ifd, data, SEEK_SET) != data || lseek (ofd, data, SEEK_SET) != data)
+      fatal ("lseek");
+    holes -= copy_data (ifd, ofd, hole - data);
+  }
+  if (ftruncate (ofd, size) != 0)
+    fatal ("ftruncate");
+  __atomic_fetch_add (&copy.holes, holes, __ATOMIC_RELAXED);
 }
 
+/**
+ * copy_fd copies the contents of file descriptor ifd to ofd. A reflink shares
+ * the data blocks, which also keeps the holes of sparse files, so it's tried
+ * before copying any data.
+ */
 static void
-path_create (const char *path)
+copy_fd (int ifd, int ofd, off_t size, bool sparse)
 {
-  path_iterate (path, path_create_dir);
+  if (!__atomic_load_n (&copy.unsupported.clone, __ATOMIC_RELAXED)) {
+    if (ioctl (ofd, FICLONE, ifd) == 0)
+      return;
+    __atomic_store_n (&copy.unsupported.clone, true, __ATOMIC_RELAXED);
+    errno = 0;
+  }
+  if (sparse)
+    copy_data_sparse (ifd, ofd, size);
+  else
+    copy_data (ifd, ofd, SSIZE_MAX);
 }
 
-static bool
-path_exists (const char *path)
+/**
+ * copy_file queues the copy of regular file src to dst. The copy happens
+ * asynchronously on one of the copy workers, with mode and ownership of
+ * the file taken from sb. The parent directory of dst must exist.
+ */
+static void
+copy_file (const char *src, const char *dst, const struct stat *sb)
 {
-  struct stat buf;
-  bool found;
+  struct copy_queue *queue;
+  struct copy_job job;
+
+  job = (struct copy_job){
+    .src = strdup (src),
+    .dst = strdup (dst),
+    .mode = sb->st_mode,
+    .uid = sb->st_uid,
+    .gid = sb->st_gid,
+  };
+  if (job.src == NULL || job.dst == NULL)
+    fatal ("strdup");
+  copy.files++;
+  if (copy.threads == 0) {
+    copy_run (&job);
+    return;
+  }
 
-  found = (stat (path, &buf) == 0);
-  errno = 0;
-  return found;
+  queue = copy.queue + (copy.next++ % copy.threads);
+  pthread_mutex_lock (&queue->lock);
+  if (queue->tail == queue->size) {
+    if (queue->head > 0) {
+      memmove (queue->job, queue->job + queue->head, (queue->tail - queue->head) * sizeof (struct copy_job));
+      queue->tail -= queue->head;
+      queue->head = 0;
+    }
+    else {
+      default_value (queue->size, 64);
+      queue->size *= 2;
+      queue->job = realloc (queue->job, queue->size * sizeof (struct copy_job));
+      if (queue->job == NULL)
+        fatal ("realloc");
+    }
+  }
+  queue->job[queue->tail++] = job;
+  pthread_mutex_unlock (&queue->lock);
+  pthread_mutex_lock (&copy.lock);
+  copy.pending++;
+  pthread_cond_signal (&copy.ready);
+  pthread_mutex_unlock (&copy.lock);
 }
 
+/**
+ * copy_finish waits until all queued files are copied and stops the workers.
+ */
 static void
-path_iterate (const char *str, void (*callback) (const char *))
+copy_finish (void)
 {
-  char *var;
-  char *pos;
-
-  var = strdup (str);
-  if (var == NULL)
-    fatal ("strdup");
+  size_t i;
 
-  /**
-   * Replace each path seperator with a null byte.
-   */
-  pos = var;
-  while (*pos) {
-    if (*pos == '/')
-      *pos = '\0';
-    pos++;
-  }
-  /**
-   * Restore each path seperator one by one and call
-   * callback on the results.
-   */
-  if (*var)
-    callback (var);
-  pos = var;
-  while (*str) {
-    if (*pos = *str, *pos == '/')
-      callback (var);
-    pos++;
-    str++;
+  pthread_mutex_lock (&copy.lock);
+  copy.done = true;
+  pthread_cond_broadcast (&copy.ready);
+  pthread_mutex_unlock (&copy.lock);
+  for (i = 0; i < copy.threads; i++)
+    if (pthread_join (copy.thread[i], NULL) != 0)
+      fatal ("pthread_join");
+  for (i = 0; i < copy.threads; i++) {
+    pthread_mutex_destroy (&copy.queue[i].lock);
+    free (copy.queue[i].job);
   }
-  free (var);
+  pthread_mutex_destroy (&copy.lock);
+  pthread_cond_destroy (&copy.ready);
+  free (copy.queue);
+  free (copy.thread);
+  debug ("Copied %zu files on %zu threads", copy.files, copy.threads);
 }
 
-static char *
-path_join (const char *format, ...)
+/**
+ * copy_start starts one copy worker per online processor. Each worker owns a
+ * queue of jobs. Workers take jobs from the back of their own queue and steal
+ * from the front of the other queues once their own queue runs empty, so a
+ * few large files don't leave the remaining workers idle.
+ */
+static void
+copy_start (void)
 {
-  va_list ap;
-  char *str;
+  long n;
+  size_t i;
 
-  va_start (ap, format);
-  if (vasprintf (&str, format, ap) < 0)
-    fatal ("vasprintf");
-  va_end (ap);
-  return path_clean (str);
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+  zero (copy);
+  copy.threads = (n < 1) ? 1 : (n > 16) ? 16 : (size_t) n;
+  copy.queue = calloc (copy.threads, sizeof (struct copy_queue));
+  copy.thread = calloc (copy.threads, sizeof (pthread_t));
+  if (copy.queue == NULL || copy.thread == NULL)
+    fatal ("calloc");
+  pthread_mutex_init (&copy.lock, NULL);
+  pthread_cond_init (&copy.ready, NULL);
+  for (i = 0; i < copy.threads; i++)
+    pthread_mutex_init (&copy.queue[i].lock, NULL);
+  for (i = 0; i < copy.threads; i++) {
+    if ((errno = pthread_create (copy.thread + i, NULL, copy_worker, copy.queue + i)) == 0)
+      continue;
+    /**
+     * A process which unshared its PID namespace can't create threads
+     * anymore. Files are copied right away then.
+     */
+    if (i == 0 && errno == EINVAL) {
+      errno = 0;
+      copy.threads = 0;
+      break;
+    }
+    fatal ("pthread_create");
+  }
 }
 
-static inline void
-path_sync_reg (const char *dst, const char *src, const struct stat *sb)
+/**
+ * copy_run copies the file of a job and gives it the mode and owner of the
+ * source. Size and holes are taken from the opened file, since the job may
+ * come from an index which doesn't know about later writes to the file.
+ */
+static void
+copy_run (struct copy_job *job)
 {
-  char buffer[2048];
-  int ofd;
+  struct stat sb;
   int ifd;
+  int ofd;
 
-  ifd = open (src, O_CLOEXEC | O_RDONLY);
+  ifd = open (job->src, O_CLOEXEC | O_RDONLY | O_NOFOLLOW);
   if (ifd < 0)
-    fatal ("open %s", src);
-
-  ofd = open (dst, O_CLOEXEC | O_CREAT | O_WRONLY | O_TRUNC);
+    fatal ("open %s", job->src);
+  if (fstat (ifd, &sb) != 0)
+    fatal ("fstat %s", job->src);
+  ofd = open (job->dst, O_CLOEXEC | O_CREAT | O_WRONLY | O_TRUNC, job->mode & 0777);
   if (ofd < 0)
-    fatal ("open %s", dst);
-
-  ssize_t ret;
-  for (;;) {
-    ret = read (ifd, buffer, sizeof (buffer));
-    if (ret <= 0)
-      break;
-    if (write (ofd, buffer, ret) != ret)
-      fatal ("write");
-  }
+    fatal ("open %s", job->dst);
+  copy_fd (ifd, ofd, sb.st_size, sb.st_blocks * 512 < sb.st_size);
+  fchown (ofd, job->uid, job->gid);
+  fchmod (ofd, job->mode);
   if (close (ofd) != 0)
-    fatal ("close %s", dst);
+    fatal ("close %s", job->dst);
   close (ifd);
+  free (job->src);
+  free (job->dst);
 }
 
-static inline void
-path_sync_dir (const char *dst, const char *src, const struct stat *sb)
+static void *
+copy_worker (void *arg)
 {
-  if (mkdir (dst, sb->st_mode) != 0)
-    fatal ("mkdir %s, mode=%#o", dst, sb->st_mode);
-}
+  struct copy_queue *own = arg;
+  struct copy_queue *queue;
+  struct copy_job job;
+  bool found;
+  size_t i;
 
-static inline void
-path_sync_sym (const char *dst, const char *src, const struct stat *sb)
-{
-  char *target = NULL;
+  for (;;) {
+    /**
+     * A worker takes one of the pending jobs before it looks for it in the
+     * queues, so there's always a queued job for every worker that took one.
+     */
+    pthread_mutex_lock (&copy.lock);
+    while (copy.pending == 0 && !copy.done)
+      pthread_cond_wait (&copy.ready, &copy.lock);
+    if (copy.pending == 0) {
+      pthread_mutex_unlock (&copy.lock);
+      return NULL;
+    }
+    copy.pending--;
+    pthread_mutex_unlock (&copy.lock);
 
-  target = calloc (sb->st_size + 1, sizeof (char));
-  if (target == NULL)
-    fatal ("calloc");
-  if (readlink (src, target, sb->st_size + 1) != sb->st_size)
-    fatal ("readlink %s", src);
-  if (symlink (target, dst) != 0)
-    fatal ("symlink %s %s", target, dst);
-  free (target);
+    /**
+     * Other workers take jobs from the queues while this one looks at them
+     * one at a time, so it may have to look more than once.
+     */
+    found = false;
+    pthread_mutex_lock (&own->lock);
+    if (own->head < own->tail) {
+      job = own->job[--own->tail];
+      found = true;
+    }
+    pthread_mutex_unlock (&own->lock);
+    for (i = 0; !found; i++) {
+      queue = copy.queue + ((own - copy.queue) + i) % copy.threads;
+      pthread_mutex_lock (&queue->lock);
+      if (queue->head < queue->tail) {
+        job = queue->job[queue->head++];
+        found = true;
+      }
+      pthread_mutex_unlock (&queue->lock);
+    }
+
+    copy_run (&job);
+  }
 }
 
-static inline int
-path_sync_callback (const char *src, const struct stat *sb, int type, struct FTW *buf)
+static void
+hash_block (struct hash *h, const unsigned char *block)
 {
-  const char *rel;
-  char *dst;
-
-  /**
-   * Remove the starting directory from the source path, then join what's left
-   * with the destination directory to obtain the destination path.
-   */
-  rel = src + strlen (path.sync.src);
-  if (*rel == '\0')
-    return 0;
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
 
-  dst = path_join ("%s/%s", path.sync.dst, rel);
-  switch (type) {
-    case FTW_F:
-      path_sync_reg (dst, src, sb);
-      break;
-    case FTW_D:
-      path_sync_dir (dst, src, sb);
-      break;
-    case FTW_SL:
-      path_sync_sym (dst, src, sb);
-      break;
-  }
+#define rotr(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+  uint32_t w[64];
+  uint32_t s[8];
+  uint32_t t1;
+  uint32_t t2;
+  size_t i;
 
-  /**
-   * Preserve mode and ownership. Use lchown for links, because
-   * chown dereferences symbolic links.
-   */
-  if (type == FTW_SL) {
-    lchown (dst, sb->st_uid, sb->st_gid);
-  }
-  else {
-    chown (dst, sb->st_uid, sb->st_gid);
-    chmod (dst, sb->st_mode);
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+  for (i = 16; i < 64; i++)
+    w[i] = w[i - 16] + (rotr (w[i - 15], 7) ^ rotr (w[i - 15], 18) ^ (w[i - 15] >> 3))
+         + w[i - 7] + (rotr (w[i - 2], 17) ^ rotr (w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+  memcpy (s, h->state, sizeof (s));
+  for (i = 0; i < 64; i++) {
+    t1 = s[7] + (rotr (s[4], 6) ^ rotr (s[4], 11) ^ rotr (s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+    t2 = (rotr (s[0], 2) ^ rotr (s[0], 13) ^ rotr (s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+    memmove (s + 1, s, 7 * sizeof (uint32_t));
+    s[4] += t1;
+    s[0] = t1 + t2;
   }
-  free (dst);
-  return 0;
+  for (i = 0; i < 8; i++)
+    h->state[i] += s[i];
+#undef rotr
 }
 
-static int
-path_sync (const char *source, const char *target)
+/**
+ * hash_digest finishes the SHA-256 digest and writes its 32 bytes to digest.
+ */
+static void
+hash_digest (struct hash *h, unsigned char *digest)
 {
-  path.sync.src = source;
-  path.sync.dst = target;
-  return nftw (path.sync.src, path_sync_callback, 32, FTW_PHYS);
+  unsigned char pad[72] = { 0x80 };
+  uint64_t bits;
+  size_t n;
+  size_t i;
+
+  bits = h->size * 8;
+  n = ((h->fill < 56) ? 56 : 120) - h->fill;
+  for (i = 0; i < 8; i++)
+    pad[n + i] = (unsigned char) (bits >> (56 - 8 * i));
+  hash_update (h, pad, n + 8);
+  for (i = 0; i < 32; i++)
+    digest[i] = (h->state[i / 4] >> (24 - 8 * (i % 4))) & 0xff;
 }
 
+/**
+ * hash_final finishes the SHA-256 digest and writes it as hexadecimal string
+ * to hex, which must hold at least 65 characters.
+ */
 static void
-path_write (const char *path, const char *format, ...)
+hash_final (struct hash *h, char *hex)
 {
-  va_list ap;
-  int fd;
+  unsigned char digest[32];
+  size_t i;
 
-  fd = open (path, O_CLOEXEC | O_WRONLY);
-  if (fd < 0)
-    goto error;
-  va_start (ap, format);
-  if (vdprintf (fd, format, ap) <= 0)
-    goto error;
-  va_end (ap);
-  if (close (fd) != 0)
-    goto error;
-  return;
-error:
-  fatal ("failed to write file %s", path);
+  hash_digest (h, digest);
+  for (i = 0; i < 32; i++)
+    sprintf (hex + 2 * i, "%02x", digest[i]);
 }
 
-static bool
-str_equals (const char *str, const char *other)
+static void
+hash_init (struct hash *h)
 {
-  if (str == NULL || other == NULL)
-    return 0;
-  return strcmp (str, other) == 0;
+  static const uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  zero (*h);
+  memcpy (h->state, state, sizeof (state));
 }
 
-static char *
-str_random (const char *set, size_t n)
+static void
+hash_update (struct hash *h, const void *data, size_t len)
 {
-  char *result;
-  int fd;
+  const unsigned char *pos = data;
+  size_t n;
+
+  h->size += len;
+  while (len > 0) {
+    n = sizeof (h->block) - h->fill;
+    if (n > len)
+      n = len;
+    memcpy (h->block + h->fill, pos, n);
+    h->fill += n;
+    pos += n;
+    len -= n;
+    if (h->fill == sizeof (h->block)) {
+      hash_block (h, h->block);
+      h->fill = 0;
+    }
+  }
+}
 
-  size_t i;
-  size_t l;
+/**
+ * hash_fd adds everything that's left to read from file descriptor fd to
+ * the digest.
+ */
+static void
+hash_fd (struct hash *h, int fd)
+{
+  char buffer[65536];
+  ssize_t ret;
 
-  result = calloc (n + 1, sizeof (char));
-  if (result == NULL)
-    fatal ("calloc");
-  fd = open ("/dev/urandom", O_CLOEXEC | O_RDONLY);
-  if (fd < 0)
-    fatal ("open /dev/urandom");
-  if (read (fd, result, n) != (ssize_t) n)
+  while ((ret = read (fd, buffer, sizeof (buffer))) > 0)
+    hash_update (h, buffer, ret);
+  if (ret < 0)
     fatal ("read");
-  close (fd);
-  l = strlen (set);
-  for (i = 0; i < n; i++)
-    result[i] = set[result[i] % l];
-  return result;
 }
 
-static void
-str_split_at (const char *str, int c, char **lo, char **hi)
+/**
+* path_clean removes consecutive and trailing directory separators.
+* Both do no harm, they just look ugly in the logs.
+* It's a simple alternative to realpath and canonicalize_file_name, which are
+* limited because they require their arguments to be existing paths.
+*/
+static char *
+path_clean (const char *path)
 {
-  char *val;
+  char *result;
+  char *end;
   char *pos;
 
-  val = strdup (str);
-  if (val == NULL)
+  result = strdup (path);
+  if (result == NULL)
     fatal ("strdup");
-  pos = strchr (val, c);
-  if (pos) {
-    *pos = '\0';
-    *lo = val;
-    *hi = pos + 1;
-  }
-  else {
-    *lo = val;
-    *hi = NULL;
+  pos = end = result;
+  while (*end) {
+    *pos = *end;
+    if (*end == '/')
+      while (*end == '/')
+        end++;
+    else
+      end++;
+    pos++;
   }
+  /**
+   * Remove trailing slash if path is not "/".
+   */
+  if (((pos - result) > 1) && (pos[-1] == '/'))
+    pos--;
+  *pos = '\0';
+
+  return result;
 }
 
-static bool
-str_starts_with (const char *str, const char *prefix)
+static inline void
+path_create_dir (const char *path)
 {
-  if (str == NULL || prefix == NULL)
-    return 0;
-  return strncasecmp (str, prefix, strlen (prefix)) == 0;
+  const mode_t mode = 0755;
+
+  if (mkdir (path, mode) != 0)
+    if (errno != EEXIST)
+      fatal ("mkdir %s mode=%#o", path, mode);
+  errno = 0;
 }
 
-static long int
-str_to_long (const char *str)
+/**
+ * path_create creates path and all missing parent directories. The parent
+ * usually exists, so the path itself is tried first.
+ */
+static void
+path_create (const char *path)
 {
-  long int value;
-  char *end;
+  if (mkdir (path, 0755) == 0 || errno == EEXIST) {
+    errno = 0;
+    return;
+  }
+  errno = 0;
+  path_iterate (path, path_create_dir);
+}
 
+static bool
+path_exists (const char *path)
+{
+  struct stat buf;
+  bool found;
+
+  found = (stat (path, &buf) == 0);
   errno = 0;
-  value = strtol (str, &end, 10);
-  if (errno != 0)
-    fatal ("strol %s", str);
-  if (end != NULL) {
-    switch (*end) {
-      case 'g':
-      case 'G':
-        return value * 1024 * 1024 * 1024;
-      case 'm':
-      case 'M':
-        return value * 1024 * 1024;
-      case 'k':
-      case 'K':
-        return value * 1024;
-    }
-  }
-  return value;
+  return found;
 }
 
 static void
-options_parse (int argc, char *const argv[])
+path_iterate (const char *str, void (*callback) (const char *))
 {
-  static const struct {
-    int id;
-    char *longname;
-    char *shortname;
-    char *prefix;
-  } options[] = {
-    {OPTION_BIND,    "bind",    "b" ,  NULL},
-    {OPTION_BIND_RO, "bind-ro", "B" ,  NULL},
-    {OPTION_DOMAIN,  "domain",  NULL,  NULL},
-    {OPTION_HELP,    "help",    "h" ,  NULL},
-    {OPTION_HOME,    "home",    "H" ,  NULL},
-    {OPTION_HOST,    "host",    NULL,  NULL},
-    {OPTION_IMAGE,   "image",   "i" ,  NULL},
-    {OPTION_ROOT,    "root",    "r" ,  NULL},
-    {OPTION_USER,    "user",    "u" ,  NULL},
-    {OPTION_VERSION, "version", "v" ,  NULL},
-    {OPTION_WORK,    "work",    "w" ,  NULL},
-    {OPTION_RLIMIT,  NULL,      NULL, "rlimit."},
-    {OPTION_CGROUP,  NULL,      NULL, "cgroup."},
-  };
+  char *var;
+  char *pos;
 
-  size_t i;
-  size_t j;
+  var = strdup (str);
+  if (var == NULL)
+    fatal ("strdup");
 
-  container.cgroup = calloc (argc, sizeof (struct container_cgroup));
-  if (container.cgroup == NULL)
+  /**
+   * Replace each path seperator with a null byte.
+   */
+  pos = var;
+  while (*pos) {
+    if (*pos == '/')
+      *pos = '\0';
+    pos++;
+  }
+  /**
+   * Restore each path seperator one by one and call
+   * callback on the results.
+   */
+  if (*var)
+    callback (var);
+  pos = var;
+  while (*str) {
+    if (*pos = *str, *pos == '/')
+      callback (var);
+    pos++;
+    str++;
+  }
+  free (var);
+}
+
+static char *
+path_join (const char *format, ...)
+{
+  va_list ap;
+  char *str;
+
+  va_start (ap, format);
+  if (vasprintf (&str, format, ap) < 0)
+    fatal ("vasprintf");
+  va_end (ap);
+  return path_clean (str);
+}
+
+static inline int
+path_remove_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  if (remove (path) != 0)
+    fatal ("remove %s", path);
+  return 0;
+}
+
+/**
+ * path_remove removes path and everything below it, without leaving the
+ * file system of path.
+ */
+static void
+path_remove (const char *path)
+{
+  if (nftw (path, path_remove_callback, 32, FTW_DEPTH | FTW_MOUNT | FTW_PHYS) != 0)
+    fatal ("nftw %s", path);
+
+  /**
+   * remove tries unlink first, which fails for directories.
+   */
+  errno = 0;
+}
+
+static int
+path_sync_inode_compare (const void *a, const void *b)
+{
+  const struct path_sync_inode *x = a;
+  const struct path_sync_inode *y = b;
+
+  if (x->dev != y->dev)
+    return (x->dev < y->dev) ? -1 : 1;
+  if (x->ino != y->ino)
+    return (x->ino < y->ino) ? -1 : 1;
+  return 0;
+}
+
+static void
+path_sync_inode_free (void *node)
+{
+  struct path_sync_inode *inode = node;
+
+  free (inode->dst);
+  free (inode);
+}
+
+/**
+ * path_sync_reg queues the copy of a regular file. A file with more than one
+ * link is only copied for the first link that's found, the remaining links
+ * are recreated with link once the copy workers are done. In link mode, the
+ * file is linked to the source instead, if both are on the same file system.
+ */
+static inline void
+path_sync_reg (const char *dst, const char *src, const struct stat *sb)
+{
+  struct path_sync_inode *inode;
+  struct path_sync_link *l;
+  void *node;
+
+  if (path.sync.hardlink) {
+    if (link (src, dst) == 0)
+      return;
+    if (errno != EXDEV)
+      fatal ("link %s %s", src, dst);
+    errno = 0;
+  }
+
+  if (sb->st_nlink > 1) {
+    inode = calloc (1, sizeof (struct path_sync_inode));
+    if (inode == NULL)
+      fatal ("calloc");
+    inode->dev = sb->st_dev;
+    inode->ino = sb->st_ino;
+    node = tsearch (inode, &path.sync.inodes, path_sync_inode_compare);
+    if (node == NULL)
+      fatal ("tsearch");
+    if (*(struct path_sync_inode **) node != inode) {
+      free (inode);
+      inode = *(struct path_sync_inode **) node;
+      if (path.sync.links % 64 == 0) {
+        path.sync.link = realloc (path.sync.link, (path.sync.links + 64) * sizeof (struct path_sync_link));
+        if (path.sync.link == NULL)
+          fatal ("realloc");
+      }
+      l = path.sync.link + path.sync.links++;
+      l->target = inode->dst;
+      l->dst = strdup (dst);
+      if (l->dst == NULL)
+        fatal ("strdup");
+      path.sync.saved += sb->st_blocks * 512;
+      return;
+    }
+    inode->dst = strdup (dst);
+    if (inode->dst == NULL)
+      fatal ("strdup");
+  }
+  copy_file (src, dst, sb);
+}
+
+/**
+ * path_sync_opaque checks if an overlay directory hides the directories of
+ * the same name in lower layers.
+ */
+static inline bool
+path_sync_opaque (const char *src)
+{
+  char c;
+
+  if (lgetxattr (src, "trusted.overlay.opaque", &c, 1) == 1 && c == 'y')
+    return true;
+  errno = 0;
+  return false;
+}
+
+static inline void
+path_sync_dir (const char *dst, const char *src, const struct stat *sb)
+{
+  if (mkdir (dst, sb->st_mode) != 0) {
+    if (errno != EEXIST || !path.sync.merge)
+      fatal ("mkdir %s, mode=%#o", dst, sb->st_mode);
+    errno = 0;
+  }
+}
+
+/**
+ * path_sync_sym recreates a symbolic link. The link target is read from src,
+ * unless it's already known.
+ */
+static inline void
+path_sync_sym (const char *dst, const char *src, const struct stat *sb, const char *known)
+{
+  char *target = NULL;
+
+  if (known) {
+    if (symlink (known, dst) != 0)
+      fatal ("symlink %s %s", known, dst);
+    return;
+  }
+  target = calloc (sb->st_size + 1, sizeof (char));
+  if (target == NULL)
+    fatal ("calloc");
+  if (readlink (src, target, sb->st_size + 1) != sb->st_size)
+    fatal ("readlink %s", src);
+  if (symlink (target, dst) != 0)
+    fatal ("symlink %s %s", target, dst);
+  free (target);
+}
+
+static inline void
+path_sync_entry (const char *src, const struct stat *sb, int type, const char *target)
+{
+  struct stat mapped;
+  const char *rel;
+  char *dst;
+
+  /**
+   * Remove the starting directory from the source path, then join what's left
+   * with the destination directory to obtain the destination path.
+   */
+  rel = src + strlen (path.sync.src);
+  if (*rel == '\0')
+    return;
+
+  dst = path_join ("%s/%s", path.sync.dst, rel);
+
+  if (idmap.count > 0) {
+    mapped = *sb;
+    mapped.st_uid = idmap_id (sb->st_uid);
+    mapped.st_gid = idmap_id (sb->st_gid);
+    sb = &mapped;
+  }
+
+  /**
+   * Layers use the whiteouts of overlayfs, character devices with device
+   * number 0, to delete an entry of the layers below. Opaque directories
+   * replace the directory of the layers below instead of being merged.
+   */
+  if (S_ISCHR (sb->st_mode) && sb->st_rdev == 0) {
+    if (path.sync.merge && access (dst, F_OK) == 0)
+      path_remove (dst);
+    errno = 0;
+    free (dst);
+    return;
+  }
+  if (path.sync.merge && type == FTW_D && path_sync_opaque (src) && access (dst, F_OK) == 0)
+    path_remove (dst);
+  errno = 0;
+
+  /**
+   * When merging an image layer onto the result of previous layers, the
+   * upper layer wins. Directories are merged, everything else is replaced.
+   */
+  if (path.sync.merge && type != FTW_D)
+    if (unlink (dst) != 0 && errno != ENOENT && errno != EISDIR)
+      fatal ("unlink %s", dst);
+  errno = 0;
+
+  switch (type) {
+    case FTW_F:
+      if (!S_ISREG (sb->st_mode)) {
+        if (mknod (dst, sb->st_mode, sb->st_rdev) != 0)
+          fatal ("mknod %s", dst);
+        break;
+      }
+      /**
+       * Regular files are copied by the copy workers, which also take care
+       * of their mode and ownership. The directory of the file already
+       * exists, because directories are visited before their contents.
+       */
+      path_sync_reg (dst, src, sb);
+      free (dst);
+      return;
+    case FTW_D:
+      path_sync_dir (dst, src, sb);
+      break;
+    case FTW_SL:
+      path_sync_sym (dst, src, sb, target);
+      break;
+  }
+
+  /**
+   * Preserve mode and ownership. Use lchown for links, because
+   * chown dereferences symbolic links.
+   */
+  if (type == FTW_SL) {
+    lchown (dst, sb->st_uid, sb->st_gid);
+  }
+  else {
+    chown (dst, sb->st_uid, sb->st_gid);
+    chmod (dst, sb->st_mode);
+  }
+  free (dst);
+}
+
+static int
+path_sync_callback (const char *src, const struct stat *sb, int type, struct FTW *buf)
+{
+  path_sync_entry (src, sb, type, NULL);
+  return 0;
+}
+
+/**
+ * path_sync_links creates the hard links collected while syncing. All files
+ * are in place by then, so it's safe to link to them.
+ */
+static void
+path_sync_links (void)
+{
+  struct path_sync_link *l;
+  size_t i;
+
+  for (i = 0; i < path.sync.links; i++) {
+    l = path.sync.link + i;
+    if (link (l->target, l->dst) != 0)
+      fatal ("link %s %s", l->target, l->dst);
+    free (l->dst);
+  }
+  tdestroy (path.sync.inodes, path_sync_inode_free);
+  free (path.sync.link);
+  path.sync.inodes = NULL;
+  path.sync.link = NULL;
+}
+
+/**
+ * path_sync copies the directory source to target. If the directory has an
+ * index, the entries are taken from the index instead of walking the source
+ * tree, so only the contents of regular files are read from the source.
+ */
+static int
+path_sync (const char *source, const char *target, bool merge, const struct index *index)
+{
+  const struct index_entry *entry;
+  struct stat sb;
+  char *src;
+  size_t i;
+  int type;
+  int ret;
+
+  path.sync.src = source;
+  path.sync.dst = target;
+  path.sync.merge = merge;
+  path.sync.saved = 0;
+  copy_start ();
+  if (index && index->data) {
+    for (i = 0; i < index->count; i++) {
+      entry = index->entry + i;
+      index_stat (entry, &sb);
+      if (S_ISDIR (sb.st_mode))
+        type = FTW_D;
+      else if (S_ISLNK (sb.st_mode))
+        type = FTW_SL;
+      else
+        type = FTW_F;
+      src = path_join ("%s/%s", source, index_path (index, entry));
+      path_sync_entry (src, &sb, type, index_target (index, entry));
+      free (src);
+    }
+    ret = 0;
+  }
+  else
+    ret = nftw (path.sync.src, path_sync_callback, 32, FTW_PHYS);
+  copy_finish ();
+  path_sync_links ();
+
+  path.sync.saved += copy.holes;
+  if (path.sync.saved > 0)
+    info ("Saved %jd bytes with %zu hard links and sparse files", (intmax_t) path.sync.saved, path.sync.links);
+  path.sync.links = 0;
+  return ret;
+}
+
+static void
+path_write (const char *path, const char *format, ...)
+{
+  va_list ap;
+  int fd;
+
+  fd = open (path, O_CLOEXEC | O_WRONLY);
+  if (fd < 0)
+    goto error;
+  va_start (ap, format);
+  if (vdprintf (fd, format, ap) <= 0)
+    goto error;
+  va_end (ap);
+  if (close (fd) != 0)
+    goto error;
+  return;
+error:
+  fatal ("failed to write file %s", path);
+}
+
+static bool
+str_equals (const char *str, const char *other)
+{
+  if (str == NULL || other == NULL)
+    return 0;
+  return strcmp (str, other) == 0;
+}
+
+static char *
+str_random (const char *set, size_t n)
+{
+  char *result;
+
+  size_t i;
+  size_t l;
+
+  result = calloc (n + 1, sizeof (char));
+  if (result == NULL)
+    fatal ("calloc");
+  if (getrandom (result, n, 0) != (ssize_t) n)
+    fatal ("getrandom");
+  l = strlen (set);
+  for (i = 0; i < n; i++)
+    result[i] = set[result[i] % l];
+  return result;
+}
+
+static void
+str_split_at (const char *str, int c, char **lo, char **hi)
+{
+  char *val;
+  char *pos;
+
+  val = strdup (str);
+  if (val == NULL)
+    fatal ("strdup");
+  pos = strchr (val, c);
+  if (pos) {
+    *pos = '\0';
+    *lo = val;
+    *hi = pos + 1;
+  }
+  else {
+    *lo = val;
+    *hi = NULL;
+  }
+}
+
+/**
+ * str_split_words splits str into words at white space like a shell does,
+ * but without any expansions. Quotes group words, and a backslash escapes
+ * the next character outside of single quotes. The returned array is NULL
+ * terminated, NULL is returned for an unterminated quote.
+ */
+static char **
+str_split_words (const char *str)
+{
+  char **words;
+  char *word;
+  char *pos;
+  char quote;
+  size_t n;
+
+  words = calloc (strlen (str) / 2 + 2, sizeof (char *));
+  word = malloc (strlen (str) + 1);
+  if (words == NULL || word == NULL)
+    fatal ("malloc");
+
+  n = 0;
+  for (;;) {
+    str += strspn (str, " \t\n");
+    if (*str == '\0')
+      break;
+    pos = word;
+    quote = '\0';
+    for (; *str != '\0'; str++) {
+      if (quote == '\0' && strchr (" \t\n", *str))
+        break;
+      if (quote != '\'' && *str == '\\' && str[1] != '\0')
+        *pos++ = *++str;
+      else if (quote == '\0' && (*str == '\'' || *str == '"'))
+        quote = *str;
+      else if (quote != '\0' && *str == quote)
+        quote = '\0';
+      else
+        *pos++ = *str;
+    }
+    if (quote != '\0') {
+      free (words);
+      free (word);
+      return NULL;
+    }
+    words[n] = strndup (word, pos - word);
+    if (words[n++] == NULL)
+      fatal ("strndup");
+  }
+  free (word);
+  return words;
+}
+
+static bool
+str_ends_with (const char *str, const char *suffix)
+{
+  size_t n;
+  size_t m;
+
+  if (str == NULL || suffix == NULL)
+    return 0;
+  n = strlen (str);
+  m = strlen (suffix);
+  return (n >= m) && (strcmp (str + n - m, suffix) == 0);
+}
+
+static bool
+str_starts_with (const char *str, const char *prefix)
+{
+  if (str == NULL || prefix == NULL)
+    return 0;
+  return strncasecmp (str, prefix, strlen (prefix)) == 0;
+}
+
+static long int
+str_to_long (const char *str)
+{
+  long int value;
+  char *end;
+
+  errno = 0;
+  value = strtol (str, &end, 10);
+  if (errno != 0)
+    fatal ("strol %s", str);
+  if (end != NULL) {
+    switch (*end) {
+      case 'g':
+      case 'G':
+        return value * 1024 * 1024 * 1024;
+      case 'm':
+      case 'M':
+        return value * 1024 * 1024;
+      case 'k':
+      case 'K':
+        return value * 1024;
+    }
+  }
+  return value;
+}
+
+static void
+options_parse (int argc, char *const argv[])
+{
+  static const struct {
+    int id;
+    char *longname;
+    char *shortname;
+    char *prefix;
+  } options[] = {
+    {OPTION_BIND,    "bind",    "b" ,  NULL},
+    {OPTION_BIND_RO, "bind-ro", "B" ,  NULL},
+    {OPTION_COMMIT,  "commit",  NULL,  NULL},
+    {OPTION_DOMAIN,  "domain",  NULL,  NULL},
+    {OPTION_HELP,    "help",    "h" ,  NULL},
+    {OPTION_HOME,    "home",    "H" ,  NULL},
+    {OPTION_HOST,    "host",    NULL,  NULL},
+    {OPTION_IDMAP,   "idmap",   NULL,  NULL},
+    {OPTION_IMAGE,   "image",   "i" ,  NULL},
+    {OPTION_IMAGE_MODE, "image-mode", NULL, NULL},
+    {OPTION_NET,     "net",     NULL,  NULL},
+    {OPTION_NSS,     "nss",     NULL,  NULL},
+    {OPTION_POOL,    "pool",    NULL,  NULL},
+    {OPTION_POOL_SIZE, "pool-size", NULL, NULL},
+    {OPTION_PROFILE, "profile", NULL,  NULL},
+    {OPTION_READY_FD, "ready-fd", NULL, NULL},
+    {OPTION_ROOT,    "root",    "r" ,  NULL},
+    {OPTION_TEMPLATE, "template", NULL, NULL},
+    {OPTION_USER,    "user",    "u" ,  NULL},
+    {OPTION_VERSION, "version", "v" ,  NULL},
+    {OPTION_WARMUP,  "warmup",  NULL,  NULL},
+    {OPTION_WORK,    "work",    "w" ,  NULL},
+    {OPTION_WRITABLE, "writable", NULL, NULL},
+    {OPTION_RLIMIT,  NULL,      NULL, "rlimit."},
+    {OPTION_CGROUP,  NULL,      NULL, "cgroup."},
+  };
+
+  size_t i;
+  size_t j;
+
+  container.cgroup = calloc (argc, sizeof (struct container_cgroup));
+  if (container.cgroup == NULL)
+    fatal ("calloc");
+
+  container.rlimit = calloc (argc, sizeof (struct container_rlimit));
+  if (container.rlimit == NULL)
+    fatal ("calloc");
+
+  container.bind = calloc (argc, sizeof (struct mount));
+  if (container.bind == NULL)
+    fatal ("calloc");
+
+  container.image = calloc (argc, sizeof (struct container_image));
+  if (container.image == NULL)
+    fatal ("calloc");
+
+  for (i = 1; argv[i] != NULL; i++) {
+    char *name;
+    char *argument;
+
+    name = argv[i];
+    if (name[0] != '-')
+      break;
+
+    /**
+     * Allow --name argument and --name=argument.
+     *
+     * Assume that all options take arguments. Only two options take no
+     * arguments: --help and --version. These two options exit the program
+     * on their options_set() call, so it doesn't matter if we assign them
+     * the next item in the argv array as argument.
+     */
+    str_split_at (name, '=', &name, &argument);
+    if (argument == NULL)
+      argument = argv[++i];
+
+    /**
+     * Skip the "-" or "--" prefixes of the option name.
+     */
+    name++;
+    if (*name == '-') {
+      name++;
+      /**
+       * Just like getopt and getopt_long, allow a single "--" to force
+       * the end of option parsing.
+       */
+      if (*name == '\0')
+        break;
+    }
+
+    for (j = 0; j < length (options); j++) {
+      if (str_equals (name, options[j].shortname) || str_equals (name, options[j].longname))
+        break;
+      if (str_starts_with (name, options[j].prefix)) {
+        name += strlen (options[j].prefix);
+        break;
+      }
+    }
+
+    if (j >= length (options))
+      options_set (OPTION_UNKOWN, name, argument);
+    else
+      options_set (options[j].id, name, argument);
+  }
+
+  /**
+   * What's left should be the command to run inside the container.
+   */
+  if (argv[i] != NULL)
+    container.cmd = (char **) argv + i;
+}
+
+static void
+options_set (int option, const char *name, char *value)
+{
+  switch (option) {
+    case OPTION_HELP:
+      print_help ();
+      exit (0);
+      break;
+    case OPTION_VERSION:
+      print_version ();
+      exit (0);
+      break;
+    case OPTION_USER:
+      container.user.name = value;
+      break;
+    case OPTION_HOST:
+      container.uts.host = value;
+      break;
+    case OPTION_DOMAIN:
+      container.uts.domain = value;
+      break;
+    case OPTION_COMMIT:
+      container.path.commit = path_clean (value);
+      break;
+    case OPTION_IDMAP:
+      options_set_idmap (value);
+      break;
+    case OPTION_IMAGE:
+      options_set_image (value);
+      break;
+    case OPTION_IMAGE_MODE:
+      options_set_mode (value);
+      break;
+    case OPTION_NET:
+      options_set_net (value);
+      break;
+    case OPTION_NSS:
+      if (!str_equals (value, "on") && !str_equals (value, "off"))
+        fatal ("Unknown NSS setting %s, use on or off", value);
+      user.nss = str_equals (value, "on");
+      if (user.nss && !WITH_NSS)
+        fatal ("%s was built without NSS", program_invocation_short_name);
+      break;
+    case OPTION_POOL:
+      pool.name = value;
+      break;
+    case OPTION_POOL_SIZE:
+      pool.size = str_to_long (value);
+      break;
+    case OPTION_PROFILE:
+      profile.name = value;
+      break;
+    case OPTION_READY_FD:
+      notify.fd = (int) str_to_long (value);
+      break;
+    case OPTION_ROOT:
+      container.path.root = value;
+      break;
+    case OPTION_TEMPLATE:
+      container.path.template = path_clean (value);
+      break;
+    case OPTION_WARMUP:
+      options_set_warmup (value);
+      break;
+    case OPTION_WORK:
+      container.path.work = value;
+      break;
+    case OPTION_WRITABLE:
+      options_set_writable (value);
+      break;
+    case OPTION_HOME:
+      container.path.home = value;
+      break;
+    case OPTION_BIND:
+    case OPTION_BIND_RO:
+      options_set_bind_mount (value, option == OPTION_BIND_RO);
+      break;
+    case OPTION_RLIMIT:
+      debug ("rlimit name='%s' value='%s'", name, value);
+      options_set_rlimit (name, value);
+      break;
+    case OPTION_CGROUP:
+      debug ("cgroup name='%s' value='%s'", name, value);
+      options_set_cgroup (name, value);
+      break;
+    case OPTION_UNKOWN:
+      warning ("Unknown option %s", name);
+      break;
+  }
+}
+
+static void
+options_set_bind_mount (const char *value, bool readonly)
+{
+  size_t i;
+
+  for (i = 0; container.bind[i].source != NULL; i++)
+    ;
+
+  str_split_at (value, ':', &container.bind[i].source, &container.bind[i].target);
+  container.bind[i].flags = MS_BIND | MS_REC;
+  if (readonly)
+    container.bind[i].flags |= MS_RDONLY;
+}
+
+static void
+options_set_cgroup (const char *name, char *value)
+{
+  char *subsystem;
+  char *parameter;
+  size_t i;
+
+  if (sscanf (name, "%m[^.].%ms", &subsystem, &parameter) != 2)
+    stop ("sscanf %%m[^.].%%ms %s", name);
+
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++) {
+    if (!str_equals (subsystem, container.cgroup[i].subsystem))
+      continue;
+    if (!str_equals (parameter, container.cgroup[i].parameter))
+      continue;
+    break;
+  }
+
+  container.cgroup[i].subsystem = subsystem;
+  container.cgroup[i].parameter = parameter;
+  container.cgroup[i].value = value;
+}
+
+/**
+ * options_set_idmap parses an ID mapping FROM:TO[:COUNT], which shows the
+ * owners FROM to FROM+COUNT-1 of the image as TO to TO+COUNT-1 inside the
+ * container and the other way round.
+ */
+static void
+options_set_idmap (const char *value)
+{
+  unsigned int *ids[] = {&idmap.from, &idmap.to, &idmap.count};
+  char *copy;
+  char *next;
+  char *id;
+  long int n;
+  size_t i;
+
+  copy = strdup (value);
+  if (copy == NULL)
+    fatal ("strdup");
+  idmap.count = 1;
+  i = 0;
+  for (id = strtok_r (copy, ":", &next); id != NULL; id = strtok_r (NULL, ":", &next)) {
+    if (i == length (ids) || id[strspn (id, "0123456789")] != '\0')
+      fatal ("Invalid ID mapping %s", value);
+    n = str_to_long (id);
+    if (n > UINT_MAX)
+      fatal ("Invalid ID mapping %s", value);
+    *ids[i++] = (unsigned int) n;
+  }
+  free (copy);
+  if (i < 2 || strstr (value, "::") != NULL || value[0] == ':' || value[strlen (value) - 1] == ':')
+    fatal ("Invalid ID mapping %s", value);
+  if (idmap.count == 0 || idmap.from > UINT_MAX - idmap.count || idmap.to > UINT_MAX - idmap.count)
+    fatal ("Invalid ID mapping %s", value);
+  if (idmap.from < idmap.to + idmap.count && idmap.to < idmap.from + idmap.count)
+    fatal ("ID mapping %s must not map a range onto itself", value);
+  idmap.fd = -1;
+}
+
+static void
+options_set_image (char *value)
+{
+  size_t i;
+
+  for (i = 0; container.image[i].source != NULL; i++)
+    ;
+
+  container.image[i].source = value;
+  container.image[i].path = path_clean (value);
+  container.image[i].fd = -1;
+  container.image[i].lock = -1;
+}
+
+static void
+options_set_mode (const char *value)
+{
+  static const char *names[] = {
+    [MODE_COPY] = "copy",
+    [MODE_OVERLAY] = "overlay",
+    [MODE_STORE] = "store",
+    [MODE_SYNC] = "sync",
+  };
+
+  size_t i;
+
+  for (i = 0; i < length (names); i++)
+    if (str_equals (value, names[i]))
+      break;
+  if (i == length (names))
+    fatal ("Unknown image mode %s", value);
+  container.mode = i;
+}
+
+static void
+options_set_net (const char *value)
+{
+  static const char *names[] = {
+    [NET_HOST] = "host",
+    [NET_NONE] = "none",
+    [NET_LOOPBACK] = "loopback",
+  };
+
+  size_t i;
+
+  for (i = 0; i < length (names); i++)
+    if (str_equals (value, names[i]))
+      break;
+  if (i == length (names))
+    fatal ("Unknown network %s, use host, none or loopback", value);
+  net.mode = i;
+}
+
+static void
+options_set_rlimit (const char *name, char *value)
+{
+  char *hard;
+  char *soft;
+  size_t i;
+
+  for (i = 0; container.rlimit[i].name != NULL; i++)
+    if (strcasecmp (name, container.rlimit[i].name) == 0)
+      break;
+
+  str_split_at (value, '/', &soft, &hard);
+  if (hard == NULL)
+    hard = soft;
+  container.rlimit[i] = (struct container_rlimit){
+    .name = (char *) name,
+    .soft = str_to_long (soft),
+    .hard = str_to_long (hard)
+  };
+}
+
+static void
+options_set_warmup (const char *value)
+{
+  char *list;
+  char *name;
+  char *rest;
+
+  str_split_at (value, ',', &name, &rest);
+  list = name;
+  for (;;) {
+    if (str_equals (name, "image"))
+      container.warmup |= WARMUP_IMAGE;
+    else if (str_equals (name, "exec"))
+      container.warmup |= WARMUP_EXEC;
+    else if (str_equals (name, "all"))
+      container.warmup |= WARMUP_IMAGE | WARMUP_EXEC;
+    else
+      fatal ("Unknown warmup %s", name);
+    if (rest == NULL)
+      break;
+    name = rest;
+    rest = strchr (rest, ',');
+    if (rest)
+      *rest++ = '\0';
+  }
+  free (list);
+}
+
+/**
+ * options_set_writable parses the place of the writable container root,
+ * either tmpfs[:OPTIONS] or DIR[:OPTIONS]. OPTIONS is a comma separated list
+ * of size=SIZE and nr_inodes=COUNT, plus noswap and huge=POLICY for a tmpfs
+ * or project=FIRST[-LAST] for a directory. The options of a tmpfs are passed
+ * on to the kernel, the limits of a directory are enforced with a project
+ * quota from the given range of project IDs.
+ */
+static void
+options_set_writable (const char *value)
+{
+  static const char *policies[] = {"never", "always", "within_size", "advise"};
+
+  char *place;
+  char *name;
+  char *rest;
+  char *arg;
+  char *pos;
+  long first;
+  long last;
+  bool sized;
+  size_t i;
+
+  str_split_at (value, ':', &place, &rest);
+  writable.dir = str_equals (place, "tmpfs") ? NULL : path_clean (place);
+  writable.data = NULL;
+  if (rest == NULL)
+    return;
+
+  /**
+   * The options of a tmpfs are checked here and passed on unchanged.
+   */
+  sized = false;
+  if (writable.dir == NULL) {
+    writable.data = strdup (rest);
+    if (writable.data == NULL)
+      fatal ("strdup");
+  }
+
+  while (rest != NULL) {
+    name = rest;
+    rest = strchr (rest, ',');
+    if (rest)
+      *rest++ = '\0';
+    arg = strchr (name, '=');
+    arg = arg ? arg + 1 : "";
+
+    if (writable.dir == NULL) {
+      if (str_starts_with (name, "size="))
+        sized = true;
+      else if (str_starts_with (name, "huge=")) {
+        for (i = 0; i < length (policies); i++)
+          if (str_equals (arg, policies[i]))
+            break;
+        if (i == length (policies))
+          fatal ("Unknown huge page policy %s", arg);
+      }
+      else if (!str_starts_with (name, "nr_inodes=") && !str_equals (name, "noswap"))
+        fatal ("Invalid tmpfs option %s", name);
+    }
+    else {
+      if (str_starts_with (name, "size=") && strchr (arg, '%') == NULL)
+        writable.size = str_to_long (arg);
+      else if (str_starts_with (name, "nr_inodes="))
+        writable.nr_inodes = str_to_long (arg);
+      else if (str_starts_with (name, "project=")) {
+        pos = strchr (arg, '-');
+        first = str_to_long (arg);
+        last = pos ? str_to_long (pos + 1) : first;
+        if (first <= 0 || last < first || last > UINT_MAX)
+          fatal ("Invalid project range %s", arg);
+        writable.projects.first = first;
+        writable.projects.last = last;
+      }
+      else
+        fatal ("Invalid option %s for directory %s", name, writable.dir);
+    }
+  }
+
+  /**
+   * Without a size, a tmpfs may fill half of the memory. Leave the host some
+   * more room than that.
+   */
+  if (writable.dir == NULL && !sized)
+    if (asprintf (&writable.data, "%s,%s", WRITABLE_SIZE, writable.data) < 0)
+      fatal ("asprintf");
+
+  /**
+   * Setting a quota overwrites whatever the project had before, so boxer
+   * only uses project IDs it was given.
+   */
+  if (writable.dir && (writable.size || writable.nr_inodes) && writable.projects.first == 0)
+    fatal ("Limits of %s need project IDs reserved for boxer, e.g. project=10000-19999", writable.dir);
+}
+
+/**
+ * device_loop attaches file to a free loop device in read-only mode, stores
+ * the path of the loop device in path and returns a descriptor of it. The loop
+ * device detaches itself once it's neither open nor mounted anymore, so the
+ * descriptor must stay open until the loop device is mounted.
+ */
+static int
+device_loop (const char *file, char **path)
+{
+  struct loop_config config;
+  int ctl;
+  int dev;
+  int fd;
+  int n;
+
+  fd = open (file, O_CLOEXEC | O_RDONLY);
+  if (fd < 0)
+    fatal ("open %s", file);
+  ctl = open ("/dev/loop-control", O_CLOEXEC | O_RDWR);
+  if (ctl < 0)
+    fatal ("open /dev/loop-control");
+
+  zero (config);
+  config.fd = fd;
+  config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+  strncpy ((char *) config.info.lo_file_name, file, LO_NAME_SIZE - 1);
+
+  for (;;) {
+    n = ioctl (ctl, LOOP_CTL_GET_FREE);
+    if (n < 0)
+      fatal ("ioctl LOOP_CTL_GET_FREE");
+    *path = path_join ("/dev/loop%d", n);
+    dev = open (*path, O_CLOEXEC | O_RDONLY);
+    if (dev < 0)
+      fatal ("open %s", *path);
+    if (ioctl (dev, LOOP_CONFIGURE, &config) == 0)
+      break;
+    /**
+     * Kernels older than 5.8 lack LOOP_CONFIGURE and need two calls.
+     */
+    if (errno == EINVAL || errno == ENOTTY) {
+      if (ioctl (dev, LOOP_SET_FD, fd) == 0) {
+        if (ioctl (dev, LOOP_SET_STATUS64, &config.info) != 0)
+          fatal ("ioctl LOOP_SET_STATUS64 %s", *path);
+        break;
+      }
+    }
+    /**
+     * Another process grabbed the same loop device, try the next one.
+     */
+    if (errno != EBUSY)
+      fatal ("ioctl LOOP_CONFIGURE %s", *path);
+    errno = 0;
+    close (dev);
+    free (*path);
+  }
+
+  close (ctl);
+  close (fd);
+  return dev;
+}
+
+/**
+ * device_links creates the symbolic links of /dev in the given root.
+ */
+static void
+device_links (const char *root)
+{
+  char *path;
+  size_t i;
+
+  for (i = 0; i < length (links); i++) {
+    path = path_join ("%s/%s", root, links[i].name);
+    if (symlink (links[i].target, path) != 0)
+      fatal ("symlink %s %s", links[i].target, path);
+    free (path);
+  }
+}
+
+static void
+device_setup (const struct device *dev)
+{
+  struct device d = *dev;
+  struct stat sb;
+  char *dir;
+  int fd;
+
+  if (stat (d.name, &sb) != 0)
+    fatal ("stat %s", d.name);
+
+  default_value (d.mode, sb.st_mode);
+  default_value (d.path, path_join ("%s/%s", container.path.root, d.name));
+  default_value (d.dev, makedev (d.maj, d.min));
+
+  /**
+   * Nodes below /dev, e.g. /dev/net/tun, need their directory first.
+   */
+  dir = strndup (d.path, strrchr (d.path, '/') - d.path);
+  if (dir == NULL)
+    fatal ("strndup");
+  if (!str_ends_with (dir, "/dev"))
+    path_create (dir);
+  free (dir);
+
+  /**
+   * A bound node is the node of the host, which works without the right
+   * to create device nodes and follows changes of the host node.
+   */
+  if (d.bind) {
+    fd = open (d.path, O_RDONLY | O_CREAT | O_CLOEXEC, 0);
+    if (fd < 0)
+      fatal ("open %s", d.path);
+    close (fd);
+    mount_setup (&(struct mount){
+      .source = d.name,
+      .target = d.path,
+      .flags  = MS_BIND,
+    });
+    return;
+  }
+
+  /**
+   * The mode is set apart from mknod, which applies the umask, because the
+   * umask is shared with steps that run at the same time.
+   */
+  info ("Creating %s", dev->name);
+  if (mknod (d.path, d.mode, d.dev) != 0)
+    fatal ("mknod %s in %s", d.name, d.path);
+  if (chmod (d.path, d.mode & 07777) != 0)
+    fatal ("chmod %s", d.path);
+  if (chown (d.path, sb.st_uid, sb.st_gid) != 0)
+    fatal ("chown %s uid=%sb.st_gid=%d", d.path, sb.st_uid, sb.st_gid);
+}
+
+/**
+ * mount_attr translates the flags of a mount into the mount attributes of the
+ * new mount API.
+ */
+static uint64_t
+mount_attr (unsigned long flags)
+{
+  uint64_t attr = 0;
+
+  if (flags & MS_RDONLY)
+    attr |= MOUNT_ATTR_RDONLY;
+  if (flags & MS_NOSUID)
+    attr |= MOUNT_ATTR_NOSUID;
+  if (flags & MS_NODEV)
+    attr |= MOUNT_ATTR_NODEV;
+  if (flags & MS_NOEXEC)
+    attr |= MOUNT_ATTR_NOEXEC;
+  return attr;
+}
+
+/**
+ * mount_bind clones the source, including all mounts below it for MS_REC,
+ * and sets the attributes of the whole clone with a single mount_setattr
+ * call before attaching it to the target.
+ */
+static bool
+mount_bind (const struct mount *m)
+{
+  struct mount_attr attr;
+  int fd;
+
+  mounter.calls++;
+  fd = open_tree (AT_FDCWD, m->source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | ((m->flags & MS_REC) ? AT_RECURSIVE : 0));
+  if (fd < 0) {
+    if (errno == ENOSYS)
+      return false;
+    if (errno == ENOENT) {
+      warning ("open_tree %s", m->source);
+      return true;
+    }
+    fatal ("open_tree %s", m->source);
+  }
+
+  zero (attr);
+  attr.attr_set = mount_attr (m->flags);
+  if (attr.attr_set != 0) {
+    mounter.calls++;
+    if (mount_setattr (fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof (attr)) != 0)
+      fatal ("mount_setattr %s", m->source);
+  }
+  mounter.calls++;
+  if (move_mount (fd, "", AT_FDCWD, m->target, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    fatal ("move_mount %s %s", m->source, m->target);
+  close (fd);
+  return true;
+}
+
+static int
+mount_config (int fs, unsigned int cmd, const char *key, const char *value)
+{
+  mounter.configs++;
+  return fsconfig (fs, cmd, key, value, 0);
+}
+
+/**
+ * mount_fs creates a new file system instance, configures it option by
+ * option and mounts it with its final attributes. A single option value is
+ * limited to 256 bytes, so the lower directories of an overlay are added one
+ * layer at a time.
+ */
+static bool
+mount_fs (const struct mount *m)
+{
+  char *data;
+  char *key;
+  char *value;
+  char *rest;
+  char *layer;
+  int fs;
+  int fd;
+
+  mounter.calls++;
+  fs = fsopen (m->type, FSOPEN_CLOEXEC);
+  if (fs < 0) {
+    if (errno == ENOSYS)
+      return false;
+    fatal ("fsopen %s", m->type);
+  }
+  if (mount_config (fs, FSCONFIG_SET_STRING, "source", m->source) != 0)
+    fatal ("fsconfig %s source=%s", m->type, m->source);
+  if ((m->flags & MS_RDONLY) && mount_config (fs, FSCONFIG_SET_FLAG, "ro", NULL) != 0)
+    fatal ("fsconfig %s ro", m->type);
+
+  data = strdup (m->data);
+  if (data == NULL)
+    fatal ("strdup");
+  for (rest = data; rest != NULL;) {
+    key = rest;
+    rest = strchr (rest, ',');
+    if (rest)
+      *rest++ = '\0';
+    if (*key == '\0')
+      continue;
+    value = strchr (key, '=');
+    if (value)
+      *value++ = '\0';
+
+    if (value && str_equals (key, "lowerdir") && str_equals (m->type, "overlay")) {
+      for (layer = strtok (value, ":"); layer != NULL; layer = strtok (NULL, ":")) {
+        if (mount_config (fs, FSCONFIG_SET_STRING, "lowerdir+", layer) == 0)
+          continue;
+        /**
+         * Kernels before 6.5 only take all layers at once, use mount instead.
+         */
+        if (errno != EINVAL)
+          fatal ("fsconfig %s lowerdir+=%s", m->type, layer);
+        errno = 0;
+        free (data);
+        close (fs);
+        return false;
+      }
+    }
+    else if (mount_config (fs, value ? FSCONFIG_SET_STRING : FSCONFIG_SET_FLAG, key, value) != 0)
+      fatal ("fsconfig %s %s", m->type, key);
+  }
+  free (data);
+
+  if (mount_config (fs, FSCONFIG_CMD_CREATE, NULL, NULL) != 0)
+    fatal ("fsconfig %s create %s", m->type, m->target);
+  mounter.calls++;
+  fd = fsmount (fs, FSMOUNT_CLOEXEC, mount_attr (m->flags));
+  if (fd < 0)
+    fatal ("fsmount %s", m->target);
+  mounter.calls++;
+  if (move_mount (fd, "", AT_FDCWD, m->target, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    fatal ("move_mount %s %s", m->source, m->target);
+  close (fd);
+  close (fs);
+  return true;
+}
+
+/**
+ * mount_new sets up a mount with the new mount API, which creates it with
+ * its final flags in one go. It returns false if the kernel doesn't support
+ * the API, which is then skipped for all following mounts.
+ */
+static bool
+mount_new (const struct mount *m)
+{
+  struct mount_attr attr;
+  bool done;
+
+  if (mounter.legacy)
+    return false;
+
+  if (m->flags & MS_PRIVATE) {
+    zero (attr);
+    attr.propagation = MS_PRIVATE;
+    mounter.calls++;
+    done = mount_setattr (AT_FDCWD, m->target, (m->flags & MS_REC) ? AT_RECURSIVE : 0, &attr, sizeof (attr)) == 0;
+    if (!done && errno != ENOSYS)
+      fatal ("mount_setattr %s", m->target);
+  }
+  else if (m->flags & MS_BIND)
+    done = mount_bind (m);
+  else
+    done = mount_fs (m);
+
+  if (!done) {
+    mounter.legacy = (errno == ENOSYS);
+    errno = 0;
+  }
+  return done;
+}
+
+static void
+mount_setup (const struct mount *mnt)
+{
+  struct mount m = *mnt;
+
+  default_value (m.target, path_join ("%s/%s", container.path.root, m.source));
+  default_value (m.data, "");
+  default_value (m.type, "");
+
+  /**
+   * If the user provides any of the default mounts with the container image, e.g.
+   * folders like /bin or /etc, do not bind mount the system directories
+   * and leave the contents up to the user. Default mounts are the ones
+   * without an explicit target.
+   */
+  if (mnt->target == NULL && container_image_contains (m.source))
+    stop ("Skipping %s because it's part of the container image", m.source);
+
+  info ("Mounting %s", m.source);
+  path_create (m.target);
+  mounter.mounts++;
+  if (mount_new (&m))
+    return;
+
+  mounter.calls++;
+  if (mount (m.source, m.target, m.type, m.flags, m.data) != 0) {
+    if (errno == ENOENT)
+      stop ("mount %s %s", m.source, m.target);
+    else
+      fatal ("mount %s %s", m.source, m.target);
+  }
+  /**
+   * If mount is a bind mount with additional options, the first mount created a bind
+   * mount with the options of the original mount point. To use the mount options of
+   * the user, a remount needs to be done.
+   */
+  if ((m.flags & MS_BIND) && (m.flags & ~(MS_BIND | MS_REC))) {
+    mounter.calls++;
+    if (mount (NULL, m.target, m.type, m.flags | MS_REMOUNT, m.data) != 0)
+      fatal ("mount %s %s", m.source, m.target);
+  }
+}
+
+/**
+ * container_image_contains checks if any layer of the container image provides
+ * the given path, which is relative to the container root.
+ */
+static bool
+container_image_contains (const char *path)
+{
+  struct container_image *image;
+  struct stat sb;
+  char *image_path;
+  bool result;
+  size_t i;
+
+  result = false;
+  for (i = 0; !result && container.image[i].source != NULL; i++) {
+    image = container.image + i;
+    /**
+     * Layers mounted by boxer itself are hidden by the overlay on the
+     * container root, but stay reachable through their descriptors.
+     */
+    if (image->index.data) {
+      result = (index_find (&image->index, path) != NULL);
+      continue;
+    }
+    if (image->fd >= 0) {
+      result = (fstatat (image->fd, path + strspn (path, "/"), &sb, AT_SYMLINK_NOFOLLOW) == 0);
+      errno = 0;
+      continue;
+    }
+    image_path = path_join ("%s/%s", image->path, path);
+    result = path_exists (image_path);
+    free (image_path);
+  }
+  return result;
+}
+
+/**
+ * container_image_probe finds out whether an image is a directory or a file
+ * system image file, by looking for the magic numbers of the supported file
+ * systems.
+ */
+static void
+container_image_probe (struct container_image *image)
+{
+  static const struct {
+    int type;
+    char *filter;
+    off_t offset;
+    char *magic;
+  } formats[] = {
+    {IMAGE_SQUASHFS, NULL,    0,    "hsqs"},
+    {IMAGE_EROFS,    NULL,    1024, "\xe2\xe1\xf5\xe0"},
+    {IMAGE_TAR,      "gzip",  0,    "\x1f\x8b"},
+    {IMAGE_TAR,      "zstd",  0,    "\x28\xb5\x2f\xfd"},
+    {IMAGE_TAR,      "xz",    0,    "\xfd" "7zXZ"},
+    {IMAGE_TAR,      "bzip2", 0,    "BZh"},
+    {IMAGE_TAR,      NULL,    257,  "ustar"},
+  };
+
+  char magic[8];
+  struct stat sb;
+  size_t i;
+  size_t n;
+  int fd;
+
+  if (stat (image->path, &sb) != 0)
+    fatal ("stat %s", image->path);
+  if (S_ISDIR (sb.st_mode))
+    return;
+
+  fd = open (image->path, O_CLOEXEC | O_RDONLY);
+  if (fd < 0)
+    fatal ("open %s", image->path);
+  for (i = 0; i < length (formats); i++) {
+    n = strlen (formats[i].magic);
+    if (pread (fd, magic, n, formats[i].offset) == (ssize_t) n && memcmp (magic, formats[i].magic, n) == 0)
+      break;
+  }
+  if (i == length (formats))
+    fatal ("Image %s is neither a directory, an EROFS or squashfs image nor a tar archive", image->path);
+  image->type = formats[i].type;
+  image->filter = formats[i].filter;
+  close (fd);
+}
+
+static void
+container_init (void)
+{
+  size_t i;
+
+  user_init ();
+
+  /**
+   * Set the default paths.
+   */
+  default_value (container.path.root, path_join ("/var/boxer/%s/", boxer.id));
+  default_value (container.path.home, container.user.home);
+  default_value (container.path.work, container.path.home);
+  default_value (writable.data, WRITABLE_SIZE);
+  profile_init ();
+
+  if (writable.dir && container.mode == MODE_SYNC)
+    fatal ("The sync mode keeps the root in place, it can't be moved to %s", writable.dir);
+
+  /**
+   * File system images are mounted, so they can't be copied into the
+   * container root like directories. Stack them as overlay instead.
+   */
+  for (i = 0; container.image[i].source != NULL; i++) {
+    container_image_probe (container.image + i);
+    if (container.image[i].type == IMAGE_DIRECTORY)
+      index_open (&container.image[i].index, container.image[i].path);
+    if (container.image[i].type != IMAGE_DIRECTORY && container.image[i].type != IMAGE_TAR && container.mode == MODE_COPY) {
+      info ("Using image mode overlay for image %s", container.image[i].path);
+      container.mode = MODE_OVERLAY;
+    }
+  }
+
+  /**
+   * Now that container.path.root is known, place user-defined mount targets
+   * in the container root directory. A missing target means the source is
+   * mounted to the same path inside the container.
+   */
+  for (i = 0; container.bind[i].source != NULL; i++) {
+    default_value (container.bind[i].target, container.bind[i].source);
+    container.bind[i].target = path_join ("%s/%s", container.path.root, container.bind[i].target);
+  }
+
+  /**
+   * If the user did not provided a command, run the user' shell instead.
+   */
+  if (container.cmd == NULL) {
+    container.cmd = calloc (2, sizeof (char *));
+    if (container.cmd == NULL)
+      fatal ("calloc");
+    container.cmd[0] = container.user.shell;
+  }
+}
+
+/**
+ * container_enter_cgroup adds the container process to its cgroups, unless it
+ * was cloned into its cgroup2 cgroup already.
+ */
+static void
+container_enter_cgroup (pid_t pid, bool cloned)
+{
+  char *path;
+  size_t i;
+
+  if (container.path.cgroup && !cloned) {
+    path = path_join ("%s/cgroup.procs", container.path.cgroup);
+    path_write (path, "%d\n", pid);
+    free (path);
+  }
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++)
+    if (!container.cgroup[i].unified)
+      path_write (container.cgroup[i].path.tasks, "%d\n", pid);
+}
+
+/**
+ * container_finish cleans up after the container process exited and all
+ * other processes of the container were killed. The changes of the container
+ * are committed only if its command exited successfully.
+ */
+static void
+container_finish (bool exited, int status)
+{
+  char *path;
+  size_t i;
+
+  /**
+   * Leave the boxer cgroup of the container, so all its cgroups can be
+   * removed instead of piling up in the shards.
+   */
+  exec_unregister ();
+  path_write ("/sys/fs/cgroup/boxer/tasks", "%d\n", getpid ());
+  path = boxer_cgroup ("/sys/fs/cgroup", boxer.id);
+  rmdir (path);
+  free (path);
+  if (container.path.cgroup)
+    rmdir (container.path.cgroup);
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++)
+    if (!container.cgroup[i].unified)
+      rmdir (container.cgroup[i].path.hierarchy);
+  errno = 0;
+  if (container.mode != MODE_SYNC)
+    writable_report ();
+  if (container.path.commit) {
+    if (exited && status == EXIT_SUCCESS)
+      commit_write ();
+    else
+      warning ("Not committing to %s, the container failed", container.path.commit);
+  }
+  if (writable.dir)
+    writable_remove ();
+
+  /**
+   * Release what only the container needed, which matters to processes
+   * starting more than one container.
+   */
+  for (i = 0; container.image[i].source != NULL; i++)
+    if (container.image[i].lock >= 0)
+      close (container.image[i].lock);
+  if (idmap.count > 0 && idmap.fd >= 0)
+    close (idmap.fd);
+  net_release ();
+}
+
+/**
+ * container_kill reads the cgroups tasks file and kills all processes besides
+ * the calling process.
+ */
+static void
+container_kill (void)
+{
+  const int signum = SIGKILL;
+  unsigned long num;
+  siginfo_t info;
+  char *path;
+  FILE *f;
+
+  pid_t self = getpid ();
+  pid_t child;
+
+  path = path_join ("/sys/fs/cgroup/boxer/%c/%s/tasks", boxer.id[0], boxer.id);
+  for (;;) {
+    int killed;
+
+    f = fopen (path, "re");
+    if (f == NULL)
+      fatal ("fopen %s", path);
+    killed = 0;
+    for (;;) {
+      if (fscanf (f, "%lu", &num) != 1)
+        break;
+      child = (pid_t) num;
+      if (child == self)
+        continue;
+      killed++;
+      if (kill (child, signum) != 0)
+        warning ("kill");
+    }
+    if (!feof (f))
+      fatal ("failed to read all pids");
+    fclose (f);
+    /**
+     * It's safe to exit once the tasks file contained only this process' pid.
+     */
+    if (killed == 0)
+      break;
+    /**
+     * If one or more processes were killed, give the system some time and see
+     * if new processes are still being created.
+     */
+    usleep (100 * USLEEP_MILLISECONDS);
+  }
+  free (path);
+
+  /**
+   * Only the container process is reaped, other children of this process
+   * may belong to other containers.
+   */
+  waitid (P_PIDFD, boxer.fd.child, &info, WEXITED | WNOHANG);
+  errno = 0;
+}
+
+/**
+ * container_prepare_cgroup creates the cgroups of the container before it
+ * starts, so everything it does is charged to them. If there's a cgroup2
+ * hierarchy, the container gets a cgroup of its own there and its descriptor
+ * is returned. Parameters of controllers which can be enabled in that cgroup
+ * are written to it, all others to the cgroup v1 hierarchy of their
+ * subsystem.
+ */
+static int
+container_prepare_cgroup (void)
+{
+  static const char *unified[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+
+  struct container_cgroup *cgroup;
+  struct statfs sf;
+  char *control;
+  char *shard;
+  size_t i;
+  int file;
+  int fd;
+
+  fd = -1;
+  control = NULL;
+  shard = NULL;
+  for (i = 0; i < length (unified); i++)
+    if (statfs (unified[i], &sf) == 0 && sf.f_type == CGROUP2_SUPER_MAGIC)
+      break;
+  errno = 0;
+  /**
+   * The cgroup2 hierarchy may be /sys/fs/cgroup itself, where the boxer
+   * hierarchy is mounted on /sys/fs/cgroup/boxer, so its boxer cgroup has a
+   * name of its own.
+   */
+  if (i < length (unified)) {
+    control = path_join ("%s/boxer.slice/cgroup.subtree_control", unified[i]);
+    shard = path_join ("%s/boxer.slice/%c/cgroup.subtree_control", unified[i], boxer.id[0]);
+    container.path.cgroup = path_join ("%s/boxer.slice/%c/%s", unified[i], boxer.id[0], boxer.id);
+    path_create (container.path.cgroup);
+    fd = open (container.path.cgroup, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+      fatal ("open %s", container.path.cgroup);
+  }
+
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++) {
+    cgroup = container.cgroup + i;
+
+    /**
+     * A controller bound to a cgroup v1 hierarchy can't be enabled. It's
+     * enabled for the shards below boxer, then for the containers.
+     */
+    if (control) {
+      file = open (control, O_WRONLY | O_CLOEXEC);
+      cgroup->unified = file >= 0 && dprintf (file, "+%s", cgroup->subsystem) > 0;
+      if (file >= 0)
+        close (file);
+      file = open (shard, O_WRONLY | O_CLOEXEC);
+      cgroup->unified = cgroup->unified && file >= 0 && dprintf (file, "+%s", cgroup->subsystem) > 0;
+      if (file >= 0)
+        close (file);
+      errno = 0;
+    }
+    if (cgroup->unified) {
+      cgroup->path.parameter = path_join ("%s/%s.%s", container.path.cgroup, cgroup->subsystem, cgroup->parameter);
+      path_write (cgroup->path.parameter, "%s\n", cgroup->value);
+      continue;
+    }
+
+    default_value (cgroup->path.subsystem, path_join ("/sys/fs/cgroup/%s", cgroup->subsystem));
+    default_value (cgroup->path.hierarchy, boxer_cgroup (cgroup->path.subsystem, boxer.id));
+    default_value (cgroup->path.parameter, path_join ("%s/%s.%s", cgroup->path.hierarchy, cgroup->subsystem, cgroup->parameter));
+    default_value (cgroup->path.tasks, path_join ("%s/tasks", cgroup->path.hierarchy));
+
+    boxer_mount_cgroup (cgroup->path.subsystem, cgroup->subsystem, 0);
+
+    path_create (cgroup->path.hierarchy);
+    path_write (cgroup->path.parameter, "%s\n", cgroup->value);
+  }
+  free (control);
+  free (shard);
+  return fd;
+}
+
+static void
+container_run (void)
+{
+  if (container.path.commit)
+    commit_mark ();
+
+  /**
+   * Drop the root rights, then run the command.
+   */
+  if (setgroups (container.user.groups, container.user.group) != 0)
+    fatal ("setgroups");
+  if (setgid (container.user.gid) != 0)
+    fatal ("setgid");
+  if (setuid (container.user.uid) != 0)
+    fatal ("setuid");
+  if (setuid (0) == 0)
+    fatal ("permissions restorable");
+  notify_exec ();
+  if (execv (container.cmd[0], container.cmd) != 0) {
+    notify_noexec ();
+    fatal ("execv");
+  }
+}
+
+/**
+ * container_setup prepares the container in the container process. The
+ * root filesystem, the mounts and the device nodes are set up as a graph of
+ * steps, then the process enters the container.
+ */
+static void
+container_setup (void)
+{
+  net_setup ();
+  setup_run ();
+
+  /**
+   * Change the root directory.
+   */
+  info ("Entering container");
+  if (chroot (container.path.root) != 0)
+    fatal ("chroot");
+  if (chdir ("/") != 0)
+    fatal ("chdir /");
+
+  if (!path_exists (container.path.home)) {
+    path_create (container.path.home);
+    if (chown (container.path.home, container.user.uid, container.user.gid) != 0)
+      fatal ("chown %s", container.path.home);
+  }
+
+  if (!path_exists (container.path.work)) {
+    path_create (container.path.work);
+    if (chown (container.path.work, container.user.uid, container.user.gid) != 0)
+      fatal ("chown %s", container.path.work);
+  }
+
+  info ("Changing working directory to %s", container.path.work);
+  if (chdir (container.path.work) != 0)
+    fatal ("chdir %s", container.path.work);
+
+  /**
+   * This should happen after entering the container. Otherwise the user
+   * inside the container sees an empty /sys/fs/cgroups directory.
+   */
+  container_setup_cgroup ();
+  container_setup_rlimit ();
+  umask (0022);
+
+  /**
+   * fsconfig only fills the context of a new file system, it doesn't touch
+   * the mount tree like the other calls.
+   */
+  info ("Set up %zu mounts with %zu mount and %zu fsconfig system calls", mounter.mounts, mounter.calls, mounter.configs);
+}
+
+/**
+ * container_setup_cgroup shows the cgroup v1 hierarchies of the container
+ * inside of it. The cgroups were prepared and entered before the container
+ * process started to set itself up.
+ */
+static void
+container_setup_cgroup (void)
+{
+  struct container_cgroup *cgroup;
+  size_t i;
+
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++) {
+    cgroup = container.cgroup + i;
+    if (!cgroup->unified && !path_exists (cgroup->path.subsystem))
+      mount_setup (&(struct mount){
+        .source = "cgroup",
+        .target = cgroup->path.subsystem,
+        .type   = "cgroup",
+        .data   = cgroup->subsystem,
+      });
+  }
+}
+
+/**
+ * container_setup_overlay mounts the image layers as read-only lower directories
+ * of an overlay filesystem on the container root. The upper and work directories
+ * live on the tmpfs that is already mounted on the container root, which the
+ * overlay hides once it's mounted on top.
+ */
+static void
+container_setup_overlay (void)
+{
+  static const char *types[] = {
+    [IMAGE_EROFS] = "erofs",
+    [IMAGE_SQUASHFS] = "squashfs",
+  };
+
+  struct container_image *image;
+  char *lower = NULL;
+  char *loop;
+  char *upper;
+  char *work;
+  char *data;
+  char *tmp;
+  size_t i;
+  int fd;
+
+  /**
+   * Mount file system images read-only and extract archives next to the
+   * upper directory, then keep a descriptor of each layer for
+   * container_image_contains.
+   */
+  for (i = 0; container.image[i].source != NULL; i++) {
+    image = container.image + i;
+    if (image->type == IMAGE_TAR) {
+      tmp = path_join ("%s/.boxer/lower/%zu", container.path.root, i);
+      info ("Extracting %s into %s", image->path, tmp);
+      path_create (tmp);
+      tar_extract (image, tmp);
+      free (image->path);
+      image->path = tmp;
+    }
+    else if (image->type != IMAGE_DIRECTORY) {
+      tmp = path_join ("%s/.boxer/lower/%zu", container.path.root, i);
+      fd = device_loop (image->path, &loop);
+      mount_setup (&(struct mount){
+        .source = loop,
+        .target = tmp,
+        .type   = (char *) types[image->type],
+        .flags  = MS_RDONLY | MS_NODEV,
+      });
+      close (fd);
+      free (loop);
+      free (image->path);
+      image->path = tmp;
+    }
+    /**
+     * Show the layer through the ID mapping. Extracted archives are
+     * translated already, directories fall back to a translated copy if
+     * the kernel can't idmap them.
+     */
+    if (idmap.count > 0 && image->type != IMAGE_TAR) {
+      tmp = path_join ("%s/.boxer/idmap/%zu", container.path.root, i);
+      if (!idmap_mount (image->path, tmp)) {
+        if (image->type != IMAGE_DIRECTORY)
+          fatal ("Can't idmap image %s", image->path);
+        free (tmp);
+        tmp = path_join ("%s/.boxer/lower/%zu", container.path.root, i);
+        info ("Copying %s into %s", image->path, tmp);
+        path_create (tmp);
+        path_sync (image->path, tmp, false, &image->index);
+      }
+      free (image->path);
+      image->path = tmp;
+    }
+    image->fd = open (image->path, O_CLOEXEC | O_DIRECTORY | O_PATH);
+    if (image->fd < 0)
+      fatal ("open %s", image->path);
+  }
+
+  for (i = 0; container.image[i].source != NULL; i++) {
+    if (strpbrk (container.image[i].path, ":,"))
+      fatal ("Image path %s must not contain ':' or ','", container.image[i].path);
+    /**
+     * The first lowerdir is the topmost layer, but images are stacked in the
+     * order they appear on the command line.
+     */
+    if (lower) {
+      if (asprintf (&tmp, "%s:%s", container.image[i].path, lower) < 0)
+        fatal ("asprintf");
+      free (lower);
+      lower = tmp;
+    }
+    else
+      lower = strdup (container.image[i].path);
+    if (lower == NULL)
+      fatal ("strdup");
+  }
+
+  upper = path_join ("%s/.boxer/upper", container.path.root);
+  work = path_join ("%s/.boxer/work", container.path.root);
+  path_create (upper);
+  path_create (work);
+
+  if (asprintf (&data, "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work) < 0)
+    fatal ("asprintf");
+
+  info ("Stacking %zu image layers as root filesystem in %s", i, container.path.root);
+  mount_setup (&(struct mount){
+    .source = "overlay",
+    .target = container.path.root,
+    .type   = "overlay",
+    .data   = data,
+    .flags  = MS_NOSUID,
+  });
+
+  free (data);
+  free (work);
+  free (upper);
+  free (lower);
+}
+
+static void
+container_setup_rlimit (void)
+{
+#define item(name) [RLIMIT_ ## name] = #name
+  static const char *names[] = {
+    item (CPU),
+    item (FSIZE),
+    item (DATA),
+    item (STACK),
+    item (CORE),
+    item (RSS),
+    item (NOFILE),
+    item (AS),
+    item (NPROC),
+    item (MEMLOCK),
+    item (LOCKS),
+    item (SIGPENDING),
+    item (MSGQUEUE),
+    item (NICE),
+    item (RTPRIO),
+    item (RTTIME),
+  };
+#undef item
+
+  size_t i;
+  size_t j;
+
+  for (i = 0; container.rlimit[i].name != NULL; i++) {
+    for (j = 0; j < length (names); j++)
+      if (names[j] && strcasecmp (names[j], container.rlimit[i].name) == 0)
+        break;
+    if (j == length (names))
+      fatal ("Unknown rlimit %s", container.rlimit[i].name);
+
+    struct rlimit rlimit = {
+      .rlim_cur = container.rlimit[i].soft,
+      .rlim_max = container.rlimit[i].hard,
+    };
+    if (setrlimit (j, &rlimit) != 0)
+      fatal ("setrlimit %s", names[j]);
+  }
+}
+
+/**
+ * user_group adds a supplementary group of the container user.
+ */
+static void
+user_group (gid_t gid)
+{
+  size_t i;
+
+  for (i = 0; i < container.user.groups; i++)
+    if (container.user.group[i] == gid)
+      return;
+  container.user.group = reallocarray (container.user.group, container.user.groups + 1, sizeof (gid_t));
+  if (container.user.group == NULL)
+    fatal ("reallocarray");
+  container.user.group[container.user.groups++] = gid;
+}
+
+/**
+ * user_groups collects the groups of the container user from /etc/group, or
+ * from NSS if the user was found there.
+ */
+static void
+user_groups (void)
+{
+  struct group *grp;
+  size_t i;
+  FILE *f;
+
+  user_group (container.user.gid);
+#if WITH_NSS
+  if (user.nss_found) {
+    user_groups_nss ();
+    return;
+  }
+#endif
+
+  f = fopen ("/etc/group", "re");
+  if (f == NULL)
+    fatal ("fopen /etc/group");
+  while ((grp = fgetgrent (f)) != NULL)
+    for (i = 0; grp->gr_mem[i] != NULL; i++)
+      if (str_equals (grp->gr_mem[i], container.user.name))
+        user_group (grp->gr_gid);
+  fclose (f);
+  errno = 0;
+}
+
+#if WITH_NSS
+static void
+user_groups_nss (void)
+{
+  gid_t *groups;
+  int n;
+  int i;
+
+  n = 0;
+  getgrouplist (container.user.name, container.user.gid, NULL, &n);
+  groups = calloc (n, sizeof (gid_t));
+  if (groups == NULL)
+    fatal ("calloc");
+  if (getgrouplist (container.user.name, container.user.gid, groups, &n) < 0)
+    fatal ("getgrouplist %s", container.user.name);
+  for (i = 0; i < n; i++)
+    user_group (groups[i]);
+  free (groups);
+  errno = 0;
+}
+#endif
+
+/**
+ * user_init looks up the container user, the calling user by default. The
+ * user comes from /etc/passwd, because NSS loads modules into the setuid
+ * process and may ask a directory service, which can take longer than the
+ * whole container setup. Only with --nss=on, NSS is asked for users which
+ * aren't in the file.
+ */
+static void
+user_init (void)
+{
+  const char *name = container.user.name;
+  struct passwd *pwd;
+  FILE *f;
+
+  f = fopen ("/etc/passwd", "re");
+  if (f == NULL)
+    fatal ("fopen /etc/passwd");
+  while ((pwd = fgetpwent (f)) != NULL)
+    if (name ? str_equals (pwd->pw_name, name) : pwd->pw_uid == getuid ())
+      break;
+  if (pwd)
+    user_set (pwd);
+  fclose (f);
+  errno = 0;
+
+#if WITH_NSS
+  if (pwd == NULL && user.nss) {
+    pwd = name ? getpwnam (name) : getpwuid (getuid ());
+    if (pwd)
+      user_set (pwd);
+    user.nss_found = (pwd != NULL);
+    errno = 0;
+  }
+#endif
+  if (pwd == NULL && name)
+    fatal ("Unknown user %s%s", name, user.nss ? "" : ", look it up with --nss=on");
+  if (pwd == NULL)
+    fatal ("Unknown user ID %d%s", getuid (), user.nss ? "" : ", look it up with --nss=on");
+  user_groups ();
+}
+
+static void
+user_set (const struct passwd *pwd)
+{
+  container.user = (struct container_user){
+    .name = strdup (pwd->pw_name),
+    .home = strdup (pwd->pw_dir),
+    .shell = strdup (pwd->pw_shell),
+    .uid = pwd->pw_uid,
+    .gid = pwd->pw_gid,
+  };
+  if (!container.user.name || !container.user.home || !container.user.shell)
+    fatal ("strdup");
+}
+
+static unsigned long
+tar_checksum (const struct tar_header *header)
+{
+  const unsigned char *pos = (const unsigned char *) header;
+  unsigned long sum = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof (struct tar_header); i++) {
+    if (i >= offsetof (struct tar_header, chksum) && i < offsetof (struct tar_header, typeflag))
+      sum += ' ';
+    else
+      sum += pos[i];
+  }
+  return sum;
+}
+
+/**
+ * tar_create creates the tar entry name in directory dir. Hard links are
+ * created by the caller. Returns a descriptor for regular files.
+ */
+static int
+tar_create (int dir, const char *name, const struct tar_entry *entry)
+{
+  int ret;
+
+  switch (entry->type) {
+    case '2':
+      ret = symlinkat (entry->target, dir, name);
+      break;
+    case '3':
+      ret = mknodat (dir, name, S_IFCHR | entry->mode, entry->dev);
+      break;
+    case '4':
+      ret = mknodat (dir, name, S_IFBLK | entry->mode, entry->dev);
+      break;
+    case '5':
+      ret = mkdirat (dir, name, entry->mode);
+      if (ret != 0 && errno == EEXIST)
+        ret = 0;
+      break;
+    case '6':
+      ret = mkfifoat (dir, name, entry->mode);
+      break;
+    default:
+      ret = openat (dir, name, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW, entry->mode);
+      break;
+  }
+  if (ret < 0)
+    fatal ("Failed to create %s", entry->name);
+  errno = 0;
+  return ret;
+}
+
+/**
+ * tar_data writes len bytes of the archive to file descriptor ofd. If the
+ * archive comes out of a decompressor, the data is spliced from the pipe into
+ * the file without passing through user space.
+ */
+static void
+tar_data (int ifd, int ofd, off_t len)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = splice (ifd, NULL, ofd, NULL, len, SPLICE_F_MOVE);
+    if (ret < 0) {
+      if (errno != EINVAL)
+        fatal ("splice");
+      errno = 0;
+      break;
+    }
+    if (ret == 0)
+      fatal ("Unexpected end of archive");
+    len -= ret;
+  }
+  if (len > 0 && copy_data (ifd, ofd, len) != len)
+    fatal ("Unexpected end of archive");
+}
+
+/**
+ * tar_dir opens directory path below root, creating it and its parents if
+ * they are missing, because the archive doesn't list them before their
+ * contents. The path is resolved as if root was the root directory, so
+ * neither ".." nor symbolic links of the archive lead out of it. More
+ * resolve flags like RESOLVE_NO_SYMLINKS can be given.
+ */
+static int
+tar_dir (int root, char *path, uint64_t resolve)
+{
+  struct open_how how = {
+    .flags = O_CLOEXEC | O_DIRECTORY | O_PATH,
+    .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS | resolve,
+  };
+  const char *name;
+  char *pos;
+  int parent;
+  int fd;
+
+  fd = syscall (SYS_openat2, root, path, &how, sizeof (how));
+  if (fd >= 0 || errno != ENOENT)
+    return fd;
+
+  pos = strrchr (path, '/');
+  if (pos) {
+    *pos = '\0';
+    parent = tar_dir (root, path, resolve);
+    *pos = '/';
+    name = pos + 1;
+  }
+  else {
+    parent = tar_dir (root, ".", resolve);
+    name = path;
+  }
+  if (parent < 0)
+    return -1;
+  if (mkdirat (parent, name, 0755) != 0 && errno != EEXIST) {
+    close (parent);
+    return -1;
+  }
+  close (parent);
+  errno = 0;
+  return syscall (SYS_openat2, root, path, &how, sizeof (how));
+}
+
+/**
+ * tar_escapes checks if a relative path contains a ".." component.
+ */
+static bool
+tar_escapes (const char *path)
+{
+  const char *pos;
+
+  for (pos = path; pos; pos = strchr (pos, '/')) {
+    pos += (*pos == '/');
+    if (pos[0] == '.' && pos[1] == '.' && (pos[2] == '/' || pos[2] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * tar_extract extracts the tar archive of image into directory dst. Compressed
+ * archives are decompressed by a separate process, which runs concurrently
+ * with the extraction. The pipe between both processes serves as bounded
+ * buffer.
+ */
+static void
+tar_extract (const struct container_image *image, const char *dst)
+{
+  struct tar_header header;
+  struct tar_entry entry;
+  off_t left;
+  pid_t pid;
+  int status;
+  int root;
+  int fd;
+
+  root = open (dst, O_CLOEXEC | O_DIRECTORY | O_PATH);
+  if (root < 0)
+    fatal ("open %s", dst);
+  fd = tar_open (image, &pid);
+  zero (entry);
+  entry.size = -1;
+  while (tar_read (fd, &header, sizeof (header)) && header.name[0] != '\0') {
+    if (tar_number (header.chksum, sizeof (header.chksum)) != (off_t) tar_checksum (&header))
+      fatal ("Invalid tar header in %s", image->path);
+    if (entry.size < 0)
+      entry.size = tar_number (header.size, sizeof (header.size));
+
+    /**
+     * GNU long names and pax extended headers describe the next entry.
+     */
+    switch (header.typeflag) {
+      case 'L':
+        free (entry.name);
+        entry.name = tar_string (fd, entry.size);
+        entry.size = -1;
+        continue;
+      case 'K':
+        free (entry.target);
+        entry.target = tar_string (fd, entry.size);
+        entry.size = -1;
+        continue;
+      case 'x':
+        entry.size = tar_pax (fd, entry.size, &entry);
+        continue;
+      case 'g':
+        free (tar_string (fd, entry.size));
+        entry.size = -1;
+        continue;
+    }
+
+    if (entry.name == NULL) {
+      if (memcmp (header.magic, "ustar", 5) == 0 && header.prefix[0] != '\0') {
+        if (asprintf (&entry.name, "%.155s/%.100s", header.prefix, header.name) < 0)
+          fatal ("asprintf");
+      }
+      else if ((entry.name = strndup (header.name, sizeof (header.name))) == NULL)
+        fatal ("strndup");
+    }
+    if (entry.target == NULL)
+      if ((entry.target = strndup (header.linkname, sizeof (header.linkname))) == NULL)
+        fatal ("strndup");
+    entry.type = header.typeflag;
+    entry.mode = tar_number (header.mode, sizeof (header.mode)) & 07777;
+    if (!entry.uid_set)
+      entry.uid = tar_number (header.uid, sizeof (header.uid));
+    if (!entry.gid_set)
+      entry.gid = tar_number (header.gid, sizeof (header.gid));
+    entry.dev = makedev (tar_number (header.devmajor, sizeof (header.devmajor)),
+                         tar_number (header.devminor, sizeof (header.devminor)));
+
+    left = tar_extract_entry (fd, root, &entry);
+    tar_skip (fd, left + (512 - entry.size % 512) % 512);
+
+    free (entry.name);
+    free (entry.target);
+    zero (entry);
+    entry.size = -1;
+  }
+  close (fd);
+  close (root);
+
+  if (pid > 0) {
+    if (waitpid (pid, &status, 0) != pid)
+      fatal ("waitpid");
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+      fatal ("Failed to decompress %s", image->path);
+  }
+}
+
+/**
+ * tar_extract_entry creates a single entry of the archive in directory root
+ * and returns the number of data bytes of the entry it didn't consume. All
+ * calls work relative to the parent directory of the entry and don't follow
+ * a symbolic link in place of the entry itself.
+ */
+static off_t
+tar_extract_entry (int fd, int root, const struct tar_entry *entry)
+{
+  const char *target;
+  const char *name;
+  size_t len;
+  char *rel;
+  int parent;
+  int dir;
+  int ofd;
+
+  rel = entry->name;
+  while (*rel == '/' || str_starts_with (rel, "./"))
+    rel += (*rel == '/') ? 1 : 2;
+  for (len = strlen (rel); len > 0 && rel[len - 1] == '/'; len--)
+    rel[len - 1] = '\0';
+  if (tar_escapes (rel) || (entry->type == '1' && tar_escapes (entry->target)))
+    fatal ("Archive member %s leaves the image", entry->name);
+  if (*rel == '\0')
+    return entry->size;
+
+  parent = tar_parent (root, rel, 0, &name);
+  if (parent < 0)
+    fatal ("open %s", entry->name);
+
+  /**
+   * Like layers copied with path_sync, later entries replace earlier ones
+   * except for directories, which are merged.
+   */
+  if (entry->type != '5')
+    if (unlinkat (parent, name, 0) != 0 && errno != ENOENT && errno != EISDIR)
+      fatal ("unlink %s", entry->name);
+  errno = 0;
+
+  switch (entry->type) {
+    case '1':
+      /**
+       * The link target must be a member of the archive itself, not some
+       * file a symbolic link points to.
+       */
+      dir = tar_parent (root, entry->target + strspn (entry->target, "/"), RESOLVE_NO_SYMLINKS, &target);
+      if (dir < 0 || linkat (dir, target, parent, name, 0) != 0)
+        fatal ("Failed to create %s", entry->name);
+      close (dir);
+      break;
+    case '2':
+      tar_create (parent, name, entry);
+      if (fchownat (parent, name, idmap_id (entry->uid), idmap_id (entry->gid), AT_SYMLINK_NOFOLLOW) != 0)
+        fatal ("chown %s", entry->name);
+      break;
+    case '3':
+    case '4':
+    case '6':
+      /**
+       * mknodat fails if anything took the place of the removed entry, so
+       * the name refers to the new node and following it is safe.
+       */
+      tar_create (parent, name, entry);
+      if (fchownat (parent, name, idmap_id (entry->uid), idmap_id (entry->gid), AT_SYMLINK_NOFOLLOW) != 0
+          || fchmodat (parent, name, entry->mode, 0) != 0)
+        fatal ("chown %s", entry->name);
+      break;
+    case '5':
+      /**
+       * Directories are merged, so the name may be a symbolic link or a file
+       * of an earlier member. It's kept as it is and never followed.
+       */
+      tar_create (parent, name, entry);
+      ofd = openat (parent, name, O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW | O_RDONLY);
+      if (ofd < 0) {
+        if (errno != ELOOP && errno != ENOTDIR)
+          fatal ("open %s", entry->name);
+        break;
+      }
+      if (fchown (ofd, idmap_id (entry->uid), idmap_id (entry->gid)) != 0 || fchmod (ofd, entry->mode) != 0)
+        fatal ("chown %s", entry->name);
+      close (ofd);
+      break;
+    case '0':
+    case '7':
+    case '\0':
+      ofd = tar_create (parent, name, entry);
+      tar_data (fd, ofd, entry->size);
+      if (fchown (ofd, idmap_id (entry->uid), idmap_id (entry->gid)) != 0 || fchmod (ofd, entry->mode) != 0)
+        fatal ("chown %s", entry->name);
+      if (close (ofd) != 0)
+        fatal ("close %s", entry->name);
+      close (parent);
+      return 0;
+    default:
+      warning ("Skipping %s of unsupported type %c", entry->name, entry->type);
+      break;
+  }
+  errno = 0;
+  close (parent);
+  return entry->size;
+}
+
+/**
+ * tar_number parses a numeric header field, which is either an octal
+ * string or, for values that don't fit, a base-256 number.
+ */
+static off_t
+tar_number (const char *field, size_t len)
+{
+  char buffer[16];
+  off_t value;
+  size_t i;
+
+  if (field[0] & 0x80) {
+    value = field[0] & 0x3f;
+    for (i = 1; i < len; i++)
+      value = (value << 8) | (unsigned char) field[i];
+    return value;
+  }
+  memcpy (buffer, field, len);
+  buffer[len] = '\0';
+  return strtoll (buffer, NULL, 8);
+}
+
+/**
+ * tar_open opens the archive of image for reading. If the archive is
+ * compressed, the descriptor is the read end of a pipe fed by the
+ * decompressor process pid.
+ */
+static int
+tar_open (const struct container_image *image, pid_t *pid)
+{
+  static const char *dirs[] = {
+    "/usr/local/bin",
+    "/usr/bin",
+    "/bin",
+  };
+
+  char *path;
+  int fds[2];
+  int fd;
+  size_t i;
+
+  *pid = 0;
+  fd = open (image->path, O_CLOEXEC | O_RDONLY);
+  if (fd < 0)
+    fatal ("open %s", image->path);
+  if (image->filter == NULL)
+    return fd;
+
+  if (pipe2 (fds, O_CLOEXEC) != 0)
+    fatal ("pipe2");
+  /**
+   * A larger pipe lets the decompressor run further ahead of the extraction.
+   */
+  if (fcntl (fds[0], F_SETPIPE_SZ, 1024 * 1024) < 0)
+    errno = 0;
+
+  *pid = fork ();
+  if (*pid < 0)
+    fatal ("fork");
+  if (*pid == 0) {
+    if (dup2 (fd, STDIN_FILENO) != STDIN_FILENO || dup2 (fds[1], STDOUT_FILENO) != STDOUT_FILENO)
+      _exit (EXIT_FAILURE);
+    for (i = 0; i < length (dirs); i++) {
+      path = path_join ("%s/%s", dirs[i], image->filter);
+      execl (path, image->filter, "-dc", NULL);
+      free (path);
+    }
+    fatal ("Failed to run %s", image->filter);
+  }
+  close (fds[1]);
+  close (fd);
+  return fds[0];
+}
+
+/**
+ * tar_parent opens the parent directory of the archive member rel below root
+ * with tar_dir and points name to the last component of rel.
+ */
+static int
+tar_parent (int root, const char *rel, uint64_t resolve, const char **name)
+{
+  const char *pos;
+  char *parent;
+  int fd;
+
+  pos = strrchr (rel, '/');
+  *name = pos ? pos + 1 : rel;
+  parent = pos ? strndup (rel, pos - rel) : strdup (".");
+  if (parent == NULL)
+    fatal ("strdup");
+  fd = tar_dir (root, parent, resolve);
+  free (parent);
+  return fd;
+}
+
+/**
+ * tar_pax parses a pax extended header of len bytes. The keywords boxer
+ * knows are stored in entry, and the size of the next entry is returned.
+ */
+static off_t
+tar_pax (int fd, off_t len, struct tar_entry *entry)
+{
+  char *data;
+  char *pos;
+  char *end;
+  char *key;
+  char *value;
+  off_t size = -1;
+  long n;
+
+  data = tar_string (fd, len);
+  for (pos = data; pos < data + len; pos += n) {
+    n = strtol (pos, &key, 10);
+    if (n <= 0 || pos + n > data + len || *key != ' ')
+      break;
+    key++;
+    end = pos + n - 1;
+    *end = '\0';
+    value = strchr (key, '=');
+    if (value == NULL)
+      continue;
+    *value++ = '\0';
+    if (str_equals (key, "path")) {
+      free (entry->name);
+      entry->name = strdup (value);
+    }
+    else if (str_equals (key, "linkpath")) {
+      free (entry->target);
+      entry->target = strdup (value);
+    }
+    else if (str_equals (key, "size"))
+      size = strtoll (value, NULL, 10);
+    else if (str_equals (key, "uid")) {
+      entry->uid = strtoul (value, NULL, 10);
+      entry->uid_set = true;
+    }
+    else if (str_equals (key, "gid")) {
+      entry->gid = strtoul (value, NULL, 10);
+      entry->gid_set = true;
+    }
+  }
+  free (data);
+  return size;
+}
+
+/**
+ * tar_read reads exactly len bytes. It returns false if the archive ends
+ * before the first byte.
+ */
+static bool
+tar_read (int fd, void *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < len) {
+    ret = read (fd, (char *) buf + done, len - done);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fatal ("read");
+    }
+    if (ret == 0) {
+      if (done == 0)
+        return false;
+      fatal ("Unexpected end of archive");
+    }
+    done += ret;
+  }
+  return true;
+}
+
+static void
+tar_skip (int fd, off_t len)
+{
+  char buffer[4096];
+  size_t n;
+
+  while (len > 0) {
+    n = (len < (off_t) sizeof (buffer)) ? (size_t) len : sizeof (buffer);
+    if (!tar_read (fd, buffer, n))
+      fatal ("Unexpected end of archive");
+    len -= n;
+  }
+}
+
+/**
+ * tar_string reads len bytes of data and the padding up to the next block,
+ * and returns the data as string.
+ */
+static char *
+tar_string (int fd, off_t len)
+{
+  char *str;
+
+  str = calloc (len + 1, sizeof (char));
+  if (str == NULL)
+    fatal ("calloc");
+  if (len > 0 && !tar_read (fd, str, len))
+    fatal ("Unexpected end of archive");
+  tar_skip (fd, (512 - len % 512) % 512);
+  return str;
+}
+
+/**
+ * store_command runs the image store commands "gc" and "stat".
+ */
+static void
+store_command (int argc, char *const argv[])
+{
+  if (str_equals (argv[1], "gc"))
+    store_gc ();
+  else if (str_equals (argv[1], "stat"))
+    store_stat ();
+  else
+    fatal ("Call: %s store gc|stat", program_invocation_short_name);
+}
+
+/**
+ * store_gc removes all prepared image trees which aren't used by a running
+ * container, then all objects which aren't referenced by any image tree
+ * anymore. The link count of an object is its reference count, because each
+ * image tree holds a hard link to it.
+ */
+static void
+store_gc (void)
+{
+  struct dirent *entry;
+  char *path;
+  DIR *dir;
+  int lock;
+  int fd;
+
+  lock = store_lock (LOCK_EX);
+  dir = opendir ("/var/boxer/store/images");
+  if (dir == NULL)
+    fatal ("opendir /var/boxer/store/images");
+  while ((entry = readdir (dir)) != NULL) {
+    if (entry->d_name[0] == '.' || str_ends_with (entry->d_name, ".lock"))
+      continue;
+    /**
+     * Running containers hold a shared lock on their image trees.
+     * Trees still being imported carry a suffix after the key, but
+     * they are locked as well.
+     */
+    path = path_join ("/var/boxer/store/images/%.64s.lock", entry->d_name);
+    fd = open (path, O_CLOEXEC | O_RDONLY);
+    free (path);
+    if (fd < 0) {
+      errno = 0;
+      continue;
+    }
+    if (flock (fd, LOCK_EX | LOCK_NB) == 0) {
+      path = path_join ("/var/boxer/store/images/%s", entry->d_name);
+      info ("Removing %s", path);
+      path_remove (path);
+      free (path);
+    }
+    errno = 0;
+    close (fd);
+  }
+  closedir (dir);
+
+  store.size = 0;
+  store.objects = 0;
+  if (nftw ("/var/boxer/store/objects", store_gc_callback, 32, FTW_PHYS) != 0)
+    fatal ("nftw /var/boxer/store/objects");
+  info ("Removed %zu objects with %jd bytes", store.objects, (intmax_t) store.size);
+  close (lock);
+}
+
+static int
+store_gc_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  if (type != FTW_F || sb->st_nlink > 1)
+    return 0;
+  /**
+   * Leftovers of interrupted imports are only removed once they are old
+   * enough to be sure that no import is still writing them.
+   */
+  if (str_starts_with (path + buf->base, "tmp.") && sb->st_mtime > time (NULL) - 24 * 60 * 60)
+    return 0;
+  if (unlink (path) != 0)
+    fatal ("unlink %s", path);
+  store.objects++;
+  store.size += sb->st_size;
+  return 0;
+}
+
+/**
+ * store_import builds the image tree dst of image src. Each regular file of
+ * the tree is a hard link to a store object. The tree is built under a
+ * temporary name and renamed once it's complete, so concurrent imports of
+ * the same image don't see half-built trees.
+ */
+static void
+store_import (const char *src, const char *dst)
+{
+  char *tmp;
+
+  info ("Importing %s into the image store", src);
+  tmp = path_join ("%s.%s", dst, boxer.id);
+  store.src = src;
+  store.dst = tmp;
+  store.size = 0;
+  store.objects = 0;
+  if (nftw (src, store_import_callback, 32, FTW_PHYS) != 0)
+    fatal ("nftw %s", src);
+  if (rename (tmp, dst) != 0) {
+    if (errno != EEXIST && errno != ENOTEMPTY)
+      fatal ("rename %s %s", tmp, dst);
+    errno = 0;
+    path_remove (tmp);
+  }
+  info ("Stored %zu new objects with %jd bytes", store.objects, (intmax_t) store.size);
+  free (tmp);
+}
+
+static int
+store_import_callback (const char *src, const struct stat *sb, int type, struct FTW *buf)
+{
+  char *object;
+  char *dst;
+
+  dst = path_join ("%s/%s", store.dst, src + strlen (store.src));
+  switch (type) {
+    case FTW_D:
+      if (mkdir (dst, sb->st_mode & 07777) != 0)
+        fatal ("mkdir %s", dst);
+      chown (dst, sb->st_uid, sb->st_gid);
+      chmod (dst, sb->st_mode);
+      break;
+    case FTW_SL:
+      path_sync_sym (dst, src, sb, NULL);
+      lchown (dst, sb->st_uid, sb->st_gid);
+      break;
+    case FTW_F:
+      if (S_ISREG (sb->st_mode)) {
+        object = store_object (src, sb);
+        if (link (object, dst) != 0)
+          fatal ("link %s %s", object, dst);
+        free (object);
+      }
+      else if (mknod (dst, sb->st_mode, sb->st_rdev) == 0)
+        chown (dst, sb->st_uid, sb->st_gid);
+      else
+        fatal ("mknod %s", dst);
+      break;
+  }
+  errno = 0;
+  free (dst);
+  return 0;
+}
+
+static int
+store_key_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  char meta[160];
+
+  snprintf (meta, sizeof (meta), "%ju %ju %o %u %u %jd %jd.%09ld %jd.%09ld",
+            (uintmax_t) sb->st_dev, (uintmax_t) sb->st_ino, sb->st_mode, sb->st_uid, sb->st_gid, (intmax_t) sb->st_size,
+            (intmax_t) sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec, (intmax_t) sb->st_ctim.tv_sec, sb->st_ctim.tv_nsec);
+  hash_update (&store.key, path + strlen (store.src), strlen (path + strlen (store.src)) + 1);
+  hash_update (&store.key, meta, strlen (meta) + 1);
+  return 0;
+}
+
+/**
+ * store_lock locks the whole image store. Imports hold it shared, because an
+ * object they found may only be linked into their tree a moment later, while
+ * store_gc holds it exclusively to remove objects nobody links to.
+ */
+static int
+store_lock (int operation)
+{
+  int fd;
+
+  fd = open ("/var/boxer/store/store.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    fatal ("open /var/boxer/store/store.lock");
+  if (flock (fd, operation) != 0)
+    fatal ("flock /var/boxer/store/store.lock");
+  return fd;
+}
+
+/**
+ * store_object returns the path of the store object with the contents, mode
+ * and ownership of file src. The object is created if it doesn't exist yet.
+ * Mode and ownership are part of the key, because all hard links of an
+ * object share them.
+ */
+static char *
+store_object (const char *src, const struct stat *sb)
+{
+  struct hash hash;
+  char meta[64];
+  char hex[65];
+  char *object;
+  char *dir;
+  char *tmp;
+  int ifd;
+  int ofd;
+
+  ifd = open (src, O_CLOEXEC | O_RDONLY | O_NOFOLLOW);
+  if (ifd < 0)
+    fatal ("open %s", src);
+  hash_init (&hash);
+  hash_fd (&hash, ifd);
+  snprintf (meta, sizeof (meta), "%o %u %u", sb->st_mode, sb->st_uid, sb->st_gid);
+  hash_update (&hash, meta, strlen (meta));
+  hash_final (&hash, hex);
+
+  object = path_join ("/var/boxer/store/objects/%.2s/%s", hex, hex + 2);
+  if (path_exists (object)) {
+    close (ifd);
+    return object;
+  }
+
+  /**
+   * Write the object under a temporary name first, then link it to its real
+   * name. If another import created the same object in the meantime, the
+   * link fails and the temporary file is dropped.
+   */
+  tmp = path_join ("/var/boxer/store/objects/tmp.%s.%zu", boxer.id, store.objects);
+  ofd = open (tmp, O_CLOEXEC | O_CREAT | O_EXCL | O_WRONLY, 0600);
+  if (ofd < 0)
+    fatal ("open %s", tmp);
+  if (lseek (ifd, 0, SEEK_SET) != 0)
+    fatal ("lseek %s", src);
+  copy_fd (ifd, ofd, sb->st_size, sb->st_blocks * 512 < sb->st_size);
+  fchown (ofd, sb->st_uid, sb->st_gid);
+  fchmod (ofd, sb->st_mode);
+  if (close (ofd) != 0)
+    fatal ("close %s", tmp);
+  close (ifd);
+
+  dir = path_join ("/var/boxer/store/objects/%.2s", hex);
+  path_create_dir (dir);
+  free (dir);
+  if (link (tmp, object) == 0) {
+    store.objects++;
+    store.size += sb->st_size;
+  }
+  else if (errno != EEXIST)
+    fatal ("link %s %s", tmp, object);
+  errno = 0;
+  unlink (tmp);
+  free (tmp);
+  return object;
+}
+
+/**
+ * store_prepare makes sure the image tree of an image layer exists and
+ * points the layer to it. The shared lock on the tree keeps store_gc from
+ * removing it until boxer exits.
+ *
+ * Trees are keyed by the identity of the image rather than its name, so a
+ * changed image gets a tree of its own: the path together with the inode,
+ * mode, owner, size and timestamps of every entry. A current index of the
+ * image describes all of them, otherwise the image tree is walked.
+ */
+static void
+store_prepare (struct container_image *image)
+{
+  char hex[65];
+  char *source;
+  char *tree;
+  char *lock;
+  int fd;
+
+  source = realpath (image->path, NULL);
+  if (source == NULL)
+    fatal ("realpath %s", image->path);
+  hash_init (&store.key);
+  hash_update (&store.key, source, strlen (source) + 1);
+  store.src = source;
+  if (image->index.data)
+    hash_update (&store.key, image->index.data, image->index.size);
+  else if (nftw (source, store_key_callback, 32, FTW_PHYS) != 0)
+    fatal ("nftw %s", source);
+  hash_final (&store.key, hex);
+
+  tree = path_join ("/var/boxer/store/images/%s", hex);
+  lock = path_join ("%s.lock", tree);
+  fd = open (lock, O_CLOEXEC | O_CREAT | O_RDONLY, 0600);
+  if (fd < 0)
+    fatal ("open %s", lock);
+  if (flock (fd, LOCK_SH) != 0)
+    fatal ("flock %s", lock);
+  image->lock = fd;
+  if (!path_exists (tree))
+    store_import (source, tree);
+  debug ("Using image tree %s for %s", tree, source);
+
+  free (image->path);
+  image->path = tree;
+  free (source);
+  free (lock);
+}
+
+static void
+store_setup (void)
+{
+  size_t i;
+  int lock;
+
+  path_create ("/var/boxer/store/images");
+  path_create ("/var/boxer/store/objects");
+  lock = store_lock (LOCK_SH);
+  for (i = 0; container.image[i].source != NULL; i++)
+    if (container.image[i].type == IMAGE_DIRECTORY)
+      store_prepare (container.image + i);
+  close (lock);
+}
+
+/**
+ * store_stat prints how much space the image store saves by sharing objects
+ * between image trees.
+ */
+static void
+store_stat (void)
+{
+  store.size = 0;
+  store.objects = 0;
+  store.refs = 0;
+  if (nftw ("/var/boxer/store/objects", store_stat_callback, 32, FTW_PHYS) != 0)
+    fatal ("nftw /var/boxer/store/objects");
+  printf ("Objects:     %zu\n"
+          "References:  %zu\n"
+          "Stored:      %jd bytes\n"
+          "Referenced:  %jd bytes\n"
+          "Saved:       %jd bytes\n",
+          store.objects,
+          store.refs,
+          (intmax_t) store.size,
+          (intmax_t) store.referenced,
+          (intmax_t) (store.referenced - store.size));
+}
+
+static int
+store_stat_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  if (type != FTW_F || str_starts_with (path + buf->base, "tmp."))
+    return 0;
+  store.objects++;
+  store.refs += sb->st_nlink - 1;
+  store.size += sb->st_size;
+  store.referenced += sb->st_size * (sb->st_nlink - 1);
+  return 0;
+}
+
+/**
+ * delta_apply brings the entry of the current image into the container root,
+ * unless the previous sync already did so with the same source entry.
+ */
+static void
+delta_apply (const struct delta_entry *entry, const struct delta_entry *prev)
+{
+  struct stat sb;
+  bool changed;
+  bool linked;
+  char *dst;
+
+  changed = (prev == NULL || !delta_equals (&entry->st, &prev->st));
+  dst = path_join ("%s/%s", container.path.root, entry->path);
+  linked = delta_link (entry, dst, changed);
+  if (!changed) {
+    free (dst);
+    return;
+  }
+
+  delta.changed++;
+  if (lstat (dst, &sb) == 0) {
+    /**
+     * Directories are updated in place, everything else is replaced.
+     */
+    if (S_ISDIR (sb.st_mode) && !S_ISDIR (entry->st.mode))
+      path_remove (dst);
+    else if (!S_ISDIR (sb.st_mode) && unlink (dst) != 0)
+      fatal ("unlink %s", dst);
+  }
+  errno = 0;
+  if (linked) {
+    free (dst);
+    return;
+  }
+
+  sb = (struct stat){
+    .st_mode = entry->st.mode,
+    .st_uid = idmap_id (entry->st.uid),
+    .st_gid = idmap_id (entry->st.gid),
+    .st_size = entry->st.size,
+    .st_blocks = entry->st.blocks,
+  };
+  if (S_ISREG (entry->st.mode))
+    copy_file (entry->src, dst, &sb);
+  else if (S_ISDIR (entry->st.mode)) {
+    if (mkdir (dst, entry->st.mode & 07777) != 0 && errno != EEXIST)
+      fatal ("mkdir %s", dst);
+    chown (dst, sb.st_uid, sb.st_gid);
+    chmod (dst, entry->st.mode);
+  }
+  else if (S_ISLNK (entry->st.mode)) {
+    path_sync_sym (dst, entry->src, &sb, NULL);
+    lchown (dst, sb.st_uid, sb.st_gid);
+  }
+  else if (mknod (dst, entry->st.mode, entry->st.rdev) == 0)
+    chown (dst, sb.st_uid, sb.st_gid);
+  else
+    fatal ("mknod %s", dst);
+  errno = 0;
+  free (dst);
+}
+
+static int
+delta_collect (const char *src, const struct stat *sb, int type, struct FTW *buf)
+{
+  struct delta_entry *entry;
+  const char *rel;
+
+  rel = src + strlen (delta.src);
+  rel += strspn (rel, "/");
+  if (*rel == '\0')
+    return 0;
+
+  if (delta.entries % 1024 == 0) {
+    delta.entry = realloc (delta.entry, (delta.entries + 1024) * sizeof (struct delta_entry));
+    if (delta.entry == NULL)
+      fatal ("realloc");
+  }
+  entry = delta.entry + delta.entries++;
+  entry->path = strdup (rel);
+  entry->src = strdup (src);
+  if (entry->path == NULL || entry->src == NULL)
+    fatal ("strdup");
+  entry->st = (struct delta_stat){
+    .dev = sb->st_dev,
+    .ino = sb->st_ino,
+    .rdev = sb->st_rdev,
+    .size = sb->st_size,
+    .blocks = sb->st_blocks,
+    .mode = sb->st_mode,
+    .uid = sb->st_uid,
+    .gid = sb->st_gid,
+    .mtime = sb->st_mtim,
+    .ctime = sb->st_ctim,
+  };
+  entry->layer = delta.layer;
+  entry->nlink = sb->st_nlink;
+  entry->opaque = (delta.layer > 0 && S_ISDIR (sb->st_mode) && path_sync_opaque (src));
+  return 0;
+}
+
+/**
+ * delta_compare sorts entries by path, and entries with the same path by
+ * their image layer.
+ */
+static int
+delta_compare (const void *a, const void *b)
+{
+  const struct delta_entry *x = a;
+  const struct delta_entry *y = b;
+  int ret;
+
+  ret = strcmp (x->path, y->path);
+  if (ret == 0)
+    ret = (x->layer > y->layer) - (x->layer < y->layer);
+  return ret;
+}
+
+static int
+delta_compare_path (const void *a, const void *b)
+{
+  return strcmp (((const struct delta_entry *) a)->path, ((const struct delta_entry *) b)->path);
+}
+
+/**
+ * delta_equals compares the stat data of an entry field by field, the
+ * padding of the structure is undefined.
+ */
+static bool
+delta_equals (const struct delta_stat *a, const struct delta_stat *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->rdev == b->rdev && a->size == b->size
+         && a->blocks == b->blocks && a->mode == b->mode && a->uid == b->uid && a->gid == b->gid
+         && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec
+         && a->ctime.tv_sec == b->ctime.tv_sec && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+/**
+ * delta_hidden checks if an entry is a whiteout or is below a whiteout, an
+ * opaque directory or anything but a directory of a higher layer.
+ */
+static bool
+delta_hidden (const struct delta_entry *entry)
+{
+  const struct delta_entry *found;
+  struct delta_entry key;
+  char *pos;
+  bool result;
+
+  if (S_ISCHR (entry->st.mode) && entry->st.rdev == 0)
+    return true;
+
+  result = false;
+  key.path = strdup (entry->path);
+  if (key.path == NULL)
+    fatal ("strdup");
+  for (pos = strchr (key.path, '/'); !result && pos != NULL; pos = strchr (pos + 1, '/')) {
+    *pos = '\0';
+    found = bsearch (&key, delta.entry, delta.entries, sizeof (struct delta_entry), delta_compare_path);
+    result = (found && found->layer > entry->layer && (!S_ISDIR (found->st.mode) || found->opaque));
+    *pos = '/';
+  }
+  free (key.path);
+  return result;
+}
+
+/**
+ * delta_link keeps hard links of the image. The first path of a file with
+ * more than one link is copied, the other paths are linked to it once the
+ * copies are done. Paths of the same file change together, as they share
+ * their stat data, so an unchanged path still provides the link target.
+ */
+static bool
+delta_link (const struct delta_entry *entry, const char *dst, bool changed)
+{
+  struct path_sync_inode *inode;
+  struct path_sync_link *l;
+  void *node;
+
+  if (!S_ISREG (entry->st.mode) || entry->nlink < 2)
+    return false;
+  inode = calloc (1, sizeof (struct path_sync_inode));
+  if (inode == NULL)
+    fatal ("calloc");
+  inode->dev = entry->st.dev;
+  inode->ino = entry->st.ino;
+  node = tsearch (inode, &path.sync.inodes, path_sync_inode_compare);
+  if (node == NULL)
+    fatal ("tsearch");
+  if (*(struct path_sync_inode **) node == inode) {
+    inode->dst = strdup (dst);
+    if (inode->dst == NULL)
+      fatal ("strdup");
+    return false;
+  }
+  free (inode);
+  if (!changed)
+    return true;
+  inode = *(struct path_sync_inode **) node;
+  if (path.sync.links % 64 == 0) {
+    path.sync.link = realloc (path.sync.link, (path.sync.links + 64) * sizeof (struct path_sync_link));
+    if (path.sync.link == NULL)
+      fatal ("realloc");
+  }
+  l = path.sync.link + path.sync.links++;
+  l->target = inode->dst;
+  l->dst = strdup (dst);
+  if (l->dst == NULL)
+    fatal ("strdup");
+  return true;
+}
+
+/**
+ * delta_load reads the entries recorded by the previous sync of the
+ * container root.
+ */
+static struct delta_entry *
+delta_load (const char *path, size_t *count)
+{
+  struct delta_entry *entries = NULL;
+  struct delta_entry entry;
+  uint32_t len;
+  FILE *f;
+
+  *count = 0;
+  f = fopen (path, "re");
+  if (f == NULL) {
+    errno = 0;
+    return NULL;
+  }
+  while (fread (&entry.st, sizeof (entry.st), 1, f) == 1 && fread (&len, sizeof (len), 1, f) == 1) {
+    entry.path = calloc (len + 1, sizeof (char));
+    if (entry.path == NULL)
+      fatal ("calloc");
+    if (fread (entry.path, 1, len, f) != len)
+      fatal ("Truncated sync state %s", path);
+    entry.src = NULL;
+    entry.layer = 0;
+    if (*count % 1024 == 0) {
+      entries = realloc (entries, (*count + 1024) * sizeof (struct delta_entry));
+      if (entries == NULL)
+        fatal ("realloc");
+    }
+    entries[(*count)++] = entry;
+  }
+  fclose (f);
+  return entries;
+}
+
+/**
+ * delta_save records the entries of this sync for the next one. The state
+ * only replaces the previous one once it's written completely. Each record is
+ * copied field by field into a cleared buffer, so no padding bytes of the
+ * entry end up in the file.
+ */
+static void
+delta_save (const char *path)
+{
+  const struct delta_entry *entry;
+  struct delta_stat st;
+  uint32_t len;
+  char *tmp;
+  size_t i;
+  FILE *f;
+
+  tmp = path_join ("%s.%s", path, boxer.id);
+  f = fopen (tmp, "we");
+  if (f == NULL)
+    fatal ("fopen %s", tmp);
+  for (i = 0; i < delta.entries; i++) {
+    entry = delta.entry + i;
+    zero (st);
+    st.dev = entry->st.dev;
+    st.ino = entry->st.ino;
+    st.rdev = entry->st.rdev;
+    st.size = entry->st.size;
+    st.blocks = entry->st.blocks;
+    st.mode = entry->st.mode;
+    st.uid = entry->st.uid;
+    st.gid = entry->st.gid;
+    st.mtime = entry->st.mtime;
+    st.ctime = entry->st.ctime;
+    len = strlen (entry->path);
+    if (fwrite (&st, sizeof (st), 1, f) != 1 || fwrite (&len, sizeof (len), 1, f) != 1
+        || fwrite (entry->path, 1, len, f) != len)
+      break;
+  }
+
+  /**
+   * Successful calls leave errno alone, so it still explains the failure
+   * after the temporary file is removed again.
+   */
+  if (i < delta.entries || ferror (f)) {
+    fclose (f);
+    unlink (tmp);
+    fatal ("Can't write %s", tmp);
+  }
+  if (fclose (f) != 0) {
+    unlink (tmp);
+    fatal ("fclose %s", tmp);
+  }
+  if (rename (tmp, path) != 0)
+    fatal ("rename %s %s", tmp, path);
+  free (tmp);
+}
+
+/**
+ * delta_setup syncs the image into a persistent container root. The source
+ * entries of the last sync are recorded next to the root. Entries whose device,
+ * inode, size, mode, ownership and timestamps didn't change since then are
+ * left alone, entries that left the image are deleted from the root, and
+ * everything else is copied. Changes made inside the container survive
+ * until the image changes the same entry.
+ */
+static void
+delta_setup (void)
+{
+  struct delta_entry *prev;
+  struct delta_entry *old;
+  const struct index *index;
+  bool *hidden;
+  struct stat sb;
+  char *state;
+  char *root;
+  char *src;
+  char *dst;
+  size_t count;
+  size_t i;
+  size_t j;
+  size_t n;
+  int ret;
+
+  root = path_clean (container.path.root);
+  state = path_join ("%s.sync", root);
+  free (root);
+  prev = delta_load (state, &count);
+
+  delta.entries = 0;
+  delta.changed = 0;
+  delta.removed = 0;
+  for (i = 0; container.image[i].source != NULL; i++) {
+    if (container.image[i].type != IMAGE_DIRECTORY)
+      fatal ("Image %s must be a directory in sync mode", container.image[i].path);
+    delta.src = container.image[i].path;
+    delta.layer = i;
+    index = &container.image[i].index;
+    if (index->data == NULL) {
+      if (nftw (delta.src, delta_collect, 32, FTW_PHYS) != 0)
+        fatal ("nftw %s", delta.src);
+      continue;
+    }
+    for (j = 0; j < index->count; j++) {
+      index_stat (index->entry + j, &sb);
+      src = path_join ("%s/%s", delta.src, index_path (index, index->entry + j));
+      delta_collect (src, &sb, 0, NULL);
+      free (src);
+    }
+  }
+
+  /**
+   * Of entries with the same path, only the one of the topmost layer is kept.
+   */
+  qsort (delta.entry, delta.entries, sizeof (struct delta_entry), delta_compare);
+  for (i = 0, n = 0; i < delta.entries; i++) {
+    if (i + 1 < delta.entries && str_equals (delta.entry[i].path, delta.entry[i + 1].path)) {
+      free (delta.entry[i].path);
+      free (delta.entry[i].src);
+      continue;
+    }
+    delta.entry[n++] = delta.entry[i];
+  }
+  delta.entries = n;
+
+  /**
+   * Whiteouts hide the entry and everything below it in lower layers, opaque
+   * directories everything below them. Mark
+   * all hidden entries first, the lookups need the complete list.
+   */
+  hidden = calloc (delta.entries + 1, sizeof (bool));
+  if (hidden == NULL)
+    fatal ("calloc");
+  for (i = 0; i < delta.entries; i++)
+    hidden[i] = delta_hidden (delta.entry + i);
+  for (i = 0, n = 0; i < delta.entries; i++) {
+    if (hidden[i]) {
+      free (delta.entry[i].path);
+      free (delta.entry[i].src);
+      continue;
+    }
+    delta.entry[n++] = delta.entry[i];
+  }
+  delta.entries = n;
+  free (hidden);
+
+  /**
+   * Both lists are sorted, so walk them side by side. Parent directories
+   * sort before their contents and are created first.
+   */
+  copy_start ();
+  for (i = 0, j = 0; i < delta.entries; i++) {
+    ret = 1;
+    while (j < count && (ret = strcmp (prev[j].path, delta.entry[i].path)) < 0)
+      j++;
+    delta_apply (delta.entry + i, (j < count && ret == 0) ? prev + j : NULL);
+  }
+  copy_finish ();
+  path_sync_links ();
+  path.sync.links = 0;
+
+  /**
+   * Delete entries of the previous sync that are gone from the image, children
+   * before their parents.
+   */
+  for (j = count; j-- > 0; ) {
+    old = bsearch (prev + j, delta.entry, delta.entries, sizeof (struct delta_entry), delta_compare_path);
+    if (old == NULL) {
+      dst = path_join ("%s/%s", container.path.root, prev[j].path);
+      if (remove (dst) != 0 && errno != ENOENT) {
+        errno = 0;
+        path_remove (dst);
+      }
+      errno = 0;
+      delta.removed++;
+      free (dst);
+    }
+    free (prev[j].path);
+  }
+  free (prev);
+
+  delta_save (state);
+  info ("Synced %zu of %zu entries and removed %zu entries", delta.changed, delta.entries, delta.removed);
+
+  for (i = 0; i < delta.entries; i++) {
+    free (delta.entry[i].path);
+    free (delta.entry[i].src);
+  }
+  free (delta.entry);
+  delta.entry = NULL;
+  free (state);
+}
+
+/**
+ * index_callback adds an entry of the image directory to the index that's
+ * being built.
+ */
+static int
+index_callback (const char *src, const struct stat *sb, int type, struct FTW *buf)
+{
+  struct index_build *entry;
+  const char *rel;
+
+  rel = src + strlen (indexer.src);
+  rel += strspn (rel, "/");
+  if (*rel == '\0')
+    return 0;
+
+  if (indexer.entries % 1024 == 0) {
+    indexer.entry = realloc (indexer.entry, (indexer.entries + 1024) * sizeof (struct index_build));
+    if (indexer.entry == NULL)
+      fatal ("realloc");
+  }
+  entry = indexer.entry + indexer.entries++;
+  *entry = (struct index_build){
+    .path = strdup (rel),
+    .entry = {
+      .size = sb->st_size,
+      .blocks = sb->st_blocks,
+      .dev = sb->st_dev,
+      .ino = sb->st_ino,
+      .rdev = sb->st_rdev,
+      .mtime = sb->st_mtim.tv_sec,
+      .ctime = sb->st_ctim.tv_sec,
+      .mtime_nsec = sb->st_mtim.tv_nsec,
+      .ctime_nsec = sb->st_ctim.tv_nsec,
+      .mode = sb->st_mode,
+      .uid = sb->st_uid,
+      .gid = sb->st_gid,
+      .nlink = sb->st_nlink,
+    },
+  };
+  if (entry->path == NULL)
+    fatal ("strdup");
+
+  if (S_ISLNK (sb->st_mode)) {
+    entry->target = calloc (sb->st_size + 1, sizeof (char));
+    if (entry->target == NULL)
+      fatal ("calloc");
+    if (readlink (src, entry->target, sb->st_size + 1) != sb->st_size)
+      fatal ("readlink %s", src);
+  }
+  return 0;
+}
+
+/**
+ * index_command writes the index of each image directory given as argument.
+ */
+static void
+index_command (int argc, char *const argv[])
+{
+  int i;
+
+  if (argc < 2)
+    fatal ("Call: %s index IMAGE...", program_invocation_short_name);
+  for (i = 1; i < argc; i++)
+    index_write (argv[i]);
+}
+
+static int
+index_compare (const void *a, const void *b)
+{
+  return strcmp (((const struct index_build *) a)->path, ((const struct index_build *) b)->path);
+}
+
+/**
+ * index_current compares the modification times of the indexed directories
+ * with the image. Adding, removing or renaming an entry changes the time of
+ * its directory, so this notices a changed tree with only a stat per
+ * directory. Files changed in place aren't noticed, but copies take their
+ * size from the opened file, not from the index.
+ */
+static bool
+index_current (const struct index *index, const char *image)
+{
+  const struct index_entry *entry;
+  struct stat sb;
+  size_t i;
+  int fd;
+
+  fd = open (image, O_CLOEXEC | O_DIRECTORY | O_PATH);
+  if (fd < 0)
+    fatal ("open %s", image);
+  for (i = 0; i < index->count; i++) {
+    entry = index->entry + i;
+    if (!S_ISDIR (entry->mode))
+      continue;
+    if (fstatat (fd, index_path (index, entry), &sb, AT_SYMLINK_NOFOLLOW) != 0
+        || sb.st_mode != entry->mode
+        || sb.st_mtim.tv_sec != entry->mtime
+        || sb.st_mtim.tv_nsec != entry->mtime_nsec) {
+      debug ("Index entry %s doesn't match the image", index_path (index, entry));
+      errno = 0;
+      close (fd);
+      return false;
+    }
+  }
+  close (fd);
+  return true;
+}
+
+/**
+ * index_find looks up a path, which is relative to the image directory, in the
+ * index. Entries are sorted by path, so this is a binary search.
+ */
+static const struct index_entry *
+index_find (const struct index *index, const char *path)
+{
+  size_t lo;
+  size_t hi;
+  size_t mid;
+  int ret;
+
+  path += strspn (path, "/");
+  lo = 0;
+  hi = index->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    ret = strcmp (path, index_path (index, index->entry + mid));
+    if (ret == 0)
+      return index->entry + mid;
+    if (ret < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+/**
+ * index_open maps the index of an image directory, if there's one. An index
+ * which belongs to another directory, e.g. because the image was replaced by
+ * a new one, or which doesn't match the directory anymore is ignored.
+ */
+static void
+index_open (struct index *index, const char *image)
+{
+  const struct index_header *header;
+  const char *reason;
+  struct stat sb;
+  struct stat image_sb;
+  char *path;
+  void *data;
+  int fd;
+
+  zero (*index);
+  path = path_join ("%s.index", image);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    errno = 0;
+    free (path);
+    return;
+  }
+  if (fstat (fd, &sb) != 0)
+    fatal ("fstat %s", path);
+  if ((size_t) sb.st_size < sizeof (struct index_header)) {
+    warning ("Ignoring index %s which is invalid", path);
+    errno = 0;
+    close (fd);
+    free (path);
+    return;
+  }
+  data = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    fatal ("mmap %s", path);
+  close (fd);
+
+  header = data;
+  index->data = data;
+  index->size = sb.st_size;
+  index->count = header->count;
+  index->entry = (const struct index_entry *) (header + 1);
+  if (memcmp (header->magic, INDEX_MAGIC, sizeof (header->magic)) != 0)
+    reason = "written by another version of boxer";
+  else if (header->count > (sb.st_size - sizeof (struct index_header)) / sizeof (struct index_entry) || !index_valid (index))
+    reason = "which is invalid";
+  else if (stat (image, &image_sb) != 0 || image_sb.st_dev != header->dev || image_sb.st_ino != header->ino)
+    reason = "of another image";
+  else if (image_sb.st_mtim.tv_sec != header->mtime || image_sb.st_mtim.tv_nsec != header->mtime_nsec || !index_current (index, image))
+    reason = "which is outdated";
+  else
+    reason = NULL;
+
+  if (reason) {
+    warning ("Ignoring index %s %s", path, reason);
+    errno = 0;
+    munmap (data, sb.st_size);
+    zero (*index);
+  }
+  else
+    debug ("Using index %s with %zu entries", path, index->count);
+  free (path);
+}
+
+static const char *
+index_path (const struct index *index, const struct index_entry *entry)
+{
+  return index->data + entry->path;
+}
+
+/**
+ * index_stat fills the fields of a stat buffer that boxer uses from an entry
+ * of the index.
+ */
+static void
+index_stat (const struct index_entry *entry, struct stat *sb)
+{
+  zero (*sb);
+  sb->st_dev = entry->dev;
+  sb->st_ino = entry->ino;
+  sb->st_rdev = entry->rdev;
+  sb->st_size = entry->size;
+  sb->st_blocks = entry->blocks;
+  sb->st_mode = entry->mode;
+  sb->st_uid = entry->uid;
+  sb->st_gid = entry->gid;
+  sb->st_nlink = entry->nlink;
+  sb->st_mtim = (struct timespec){entry->mtime, entry->mtime_nsec};
+  sb->st_ctim = (struct timespec){entry->ctime, entry->ctime_nsec};
+}
+
+/**
+ * index_string checks that a string of the index lies behind the entries and
+ * is terminated within the file.
+ */
+static bool
+index_string (const struct index *index, uint64_t offset)
+{
+  return offset >= sizeof (struct index_header) + index->count * sizeof (struct index_entry)
+         && offset < index->size
+         && memchr (index->data + offset, '\0', index->size - offset) != NULL;
+}
+
+static const char *
+index_target (const struct index *index, const struct index_entry *entry)
+{
+  return entry->target ? index->data + entry->target : NULL;
+}
+
+/**
+ * index_valid checks all offsets of an index before any of them is followed.
+ * Paths must be sorted for the lookups and relative without empty, "." or
+ * ".." components, so no entry points outside of the image directory.
+ */
+static bool
+index_valid (const struct index *index)
+{
+  const struct index_entry *entry;
+  const char *prev;
+  const char *p;
+  size_t len;
+  size_t i;
+
+  prev = NULL;
+  for (i = 0; i < index->count; i++) {
+    entry = index->entry + i;
+    if (!index_string (index, entry->path))
+      return false;
+    if (entry->target ? !index_string (index, entry->target) : S_ISLNK (entry->mode))
+      return false;
+    p = index_path (index, entry);
+    if (prev && strcmp (prev, p) >= 0)
+      return false;
+    prev = p;
+    for (;;) {
+      len = strcspn (p, "/");
+      if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+        return false;
+      if (p[len] == '\0')
+        break;
+      p += len + 1;
+    }
+  }
+  return true;
+}
+
+/**
+ * index_write walks an image directory once and writes a sorted manifest of
+ * its entries to IMAGE.index. The file consists of a header, the fixed-size
+ * entries and the paths and link targets they point to, so it can be mapped
+ * and searched without parsing.
+ */
+static void
+index_write (const char *image)
+{
+  struct index_header header;
+  struct index_build *b;
+  struct stat sb;
+  uint64_t offset;
+  char *path;
+  char *tmp;
+  size_t i;
+  FILE *f;
+
+  image = path_clean (image);
+  if (stat (image, &sb) != 0 || !S_ISDIR (sb.st_mode))
+    fatal ("Image %s is not a directory", image);
+
+  indexer.src = image;
+  indexer.entries = 0;
+  if (nftw (image, index_callback, 32, FTW_PHYS) != 0)
+    fatal ("nftw %s", image);
+  qsort (indexer.entry, indexer.entries, sizeof (struct index_build), index_compare);
+
+  zero (header);
+  memcpy (header.magic, INDEX_MAGIC, sizeof (header.magic));
+  header.count = indexer.entries;
+  header.dev = sb.st_dev;
+  header.ino = sb.st_ino;
+  header.mtime = sb.st_mtim.tv_sec;
+  header.mtime_nsec = sb.st_mtim.tv_nsec;
+
+  /**
+   * Strings follow the entries, each terminated by a null byte.
+   */
+  offset = sizeof (header) + indexer.entries * sizeof (struct index_entry);
+  for (i = 0; i < indexer.entries; i++) {
+    b = indexer.entry + i;
+    b->entry.path = offset;
+    offset += strlen (b->path) + 1;
+    if (b->target) {
+      b->entry.target = offset;
+      offset += strlen (b->target) + 1;
+    }
+  }
+
+  path = path_join ("%s.index", image);
+  tmp = path_join ("%s.%s", path, boxer.id);
+  f = fopen (tmp, "we");
+  if (f == NULL)
+    fatal ("fopen %s", tmp);
+  fwrite (&header, sizeof (header), 1, f);
+  for (i = 0; i < indexer.entries; i++)
+    fwrite (&indexer.entry[i].entry, sizeof (struct index_entry), 1, f);
+  for (i = 0; i < indexer.entries; i++) {
+    b = indexer.entry + i;
+    fwrite (b->path, 1, strlen (b->path) + 1, f);
+    if (b->target)
+      fwrite (b->target, 1, strlen (b->target) + 1, f);
+    free (b->path);
+    free (b->target);
+  }
+  if (fclose (f) != 0)
+    fatal ("fclose %s", tmp);
+  if (rename (tmp, path) != 0)
+    fatal ("rename %s %s", tmp, path);
+  info ("Indexed %zu entries of %s in %s", indexer.entries, image, path);
+
+  free (indexer.entry);
+  indexer.entry = NULL;
+  free (tmp);
+  free (path);
+  free ((char *) image);
+}
+
+static int
+warmup_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  if (type == FTW_F && S_ISREG (sb->st_mode))
+    warmup_file (path);
+  return 0;
+}
+
+/**
+ * warmup_command reads the given files and directories into the page cache.
+ * With --pin=SIZE, files are locked in memory in the given order until SIZE
+ * bytes are pinned, and boxer keeps them resident until it's interrupted.
+ */
+static void
+warmup_command (int argc, char *const argv[])
+{
+  sigset_t mask;
+  struct stat sb;
+  char *name;
+  char *value;
+  int sig;
+  int i;
+
+  zero (warmup);
+  for (i = 1; i < argc && str_starts_with (argv[i], "--"); i++) {
+    str_split_at (argv[i], '=', &name, &value);
+    if (str_equals (name, "--pin") && value != NULL)
+      warmup.budget = str_to_long (value);
+    else
+      fatal ("Unknown option %s", argv[i]);
+    free (name);
+  }
+  if (i == argc)
+    fatal ("Call: %s warmup [--pin=SIZE] PATH...", program_invocation_short_name);
+
+  for (; i < argc; i++) {
+    if (stat (argv[i], &sb) != 0)
+      fatal ("stat %s", argv[i]);
+    if (S_ISDIR (sb.st_mode)) {
+      if (nftw (argv[i], warmup_callback, 32, FTW_PHYS) != 0)
+        fatal ("nftw %s", argv[i]);
+    }
+    else
+      warmup_file (argv[i]);
+  }
+  warmup_report ();
+
+  if (warmup.pinned == 0)
+    return;
+
+  info ("Keeping %jd bytes pinned until interrupted", (intmax_t) warmup.pinned);
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGHUP);
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+    fatal ("sigprocmask");
+  sigwait (&mask, &sig);
+}
+
+/**
+ * warmup_elf reads ahead an ELF binary, its interpreter and the shared
+ * libraries it needs, recursively. The path is a path inside the container.
+ * Libraries are looked up like the dynamic linker does, in the RUNPATH or
+ * RPATH of the binary and then in the library directories of the container,
+ * including the multiarch directories of the architecture of the binary.
+ */
+static void
+warmup_elf (const char *path)
+{
+  static const struct {
+    uint16_t machine;
+    const char *triplet;
+  } arches[] = {
+    {EM_X86_64, "x86_64-linux-gnu"},
+    {EM_AARCH64, "aarch64-linux-gnu"},
+    {EM_PPC64, "powerpc64le-linux-gnu"},
+    {EM_RISCV, "riscv64-linux-gnu"},
+    {EM_S390, "s390x-linux-gnu"},
+  };
+  static const char *dirs[] = {
+    "/lib64",
+    "/usr/lib64",
+    "/lib",
+    "/usr/lib",
+  };
+
+  const Elf64_Ehdr *ehdr;
+  const Elf64_Phdr *phdr;
+  const Elf64_Dyn *dyn;
+  const char *triplet;
+  const char *strtab;
+  const char *runpath;
+  const char *needed;
+  const char *data;
+  struct stat sb;
+  char *resolved;
+  char *origin;
+  char *copy;
+  char *dir;
+  char *next;
+  char *name;
+  void *node;
+  size_t ndyn;
+  size_t i;
+  size_t j;
+  bool found;
+  int fd;
+
+  resolved = warmup_resolve (path);
+  if (resolved == NULL)
+    return;
+  node = tsearch (resolved, &warmup.seen, (int (*) (const void *, const void *)) strcmp);
+  if (node == NULL)
+    fatal ("tsearch");
+  if (*(char **) node != resolved) {
+    free (resolved);
+    return;
+  }
+  warmup_file (resolved);
+
+  fd = open (resolved, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat (fd, &sb) != 0 || (size_t) sb.st_size < sizeof (Elf64_Ehdr)) {
+    if (fd >= 0)
+      close (fd);
+    errno = 0;
+    return;
+  }
+  data = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED) {
+    errno = 0;
+    return;
+  }
+
+#define inside(off,len) ((off) <= (uint64_t) sb.st_size && (len) <= (uint64_t) sb.st_size - (off))
+
+  ehdr = (const Elf64_Ehdr *) data;
+  if (memcmp (ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+      || !inside (ehdr->e_phoff, (uint64_t) ehdr->e_phnum * sizeof (Elf64_Phdr)))
+    goto done;
+  phdr = (const Elf64_Phdr *) (data + ehdr->e_phoff);
+
+  dyn = NULL;
+  ndyn = 0;
+  for (i = 0; i < ehdr->e_phnum; i++) {
+    if (phdr[i].p_type == PT_INTERP && inside (phdr[i].p_offset, phdr[i].p_filesz) && phdr[i].p_filesz > 0
+        && data[phdr[i].p_offset + phdr[i].p_filesz - 1] == '\0')
+      warmup_elf (data + phdr[i].p_offset);
+    if (phdr[i].p_type == PT_DYNAMIC && inside (phdr[i].p_offset, phdr[i].p_filesz)) {
+      dyn = (const Elf64_Dyn *) (data + phdr[i].p_offset);
+      ndyn = phdr[i].p_filesz / sizeof (Elf64_Dyn);
+    }
+  }
+
+  /**
+   * The string table is referenced by its address, find the loaded segment
+   * that contains it to get its offset in the file.
+   */
+  strtab = NULL;
+  for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+    if (dyn[i].d_tag != DT_STRTAB)
+      continue;
+    for (j = 0; j < ehdr->e_phnum; j++)
+      if (phdr[j].p_type == PT_LOAD && dyn[i].d_un.d_ptr >= phdr[j].p_vaddr
+          && dyn[i].d_un.d_ptr - phdr[j].p_vaddr < phdr[j].p_filesz
+          && inside (phdr[j].p_offset, phdr[j].p_filesz))
+        strtab = data + phdr[j].p_offset + (dyn[i].d_un.d_ptr - phdr[j].p_vaddr);
+  }
+  if (strtab == NULL)
+    goto done;
+
+#define string(val) \
+  (inside ((uint64_t) (strtab - data) + (val), 1) \
+   && memchr (strtab + (val), '\0', data + sb.st_size - strtab - (val)) != NULL ? strtab + (val) : NULL)
+
+  /**
+   * RUNPATH takes the place of RPATH if a binary has both.
+   */
+  runpath = NULL;
+  for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++)
+    if (dyn[i].d_tag == DT_RUNPATH || (dyn[i].d_tag == DT_RPATH && runpath == NULL))
+      runpath = string (dyn[i].d_un.d_val);
+  triplet = NULL;
+  for (i = 0; i < length (arches); i++)
+    if (ehdr->e_machine == arches[i].machine)
+      triplet = arches[i].triplet;
+  origin = strdup (path);
+  if (origin == NULL)
+    fatal ("strdup");
+  if (strrchr (origin, '/') != NULL)
+    *strrchr (origin, '/') = '\0';
+
+  for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+    if (dyn[i].d_tag != DT_NEEDED || (needed = string (dyn[i].d_un.d_val)) == NULL)
+      continue;
+    if (strchr (needed, '/') != NULL) {
+      warmup_elf (needed);
+      continue;
+    }
+
+    found = false;
+    if (runpath) {
+      copy = strdup (runpath);
+      if (copy == NULL)
+        fatal ("strdup");
+      for (dir = strtok_r (copy, ":", &next); dir && !found; dir = strtok_r (NULL, ":", &next)) {
+        if (str_starts_with (dir, "$ORIGIN") || str_starts_with (dir, "${ORIGIN}")) {
+          name = path_join ("%s%s", origin, dir + (dir[1] == '{' ? 9 : 7));
+          found = warmup_library (name, needed, NULL);
+          free (name);
+        }
+        else
+          found = warmup_library (dir, needed, NULL);
+      }
+      free (copy);
+    }
+    if (!found && triplet)
+      found = warmup_library ("/lib", needed, triplet) || warmup_library ("/usr/lib", needed, triplet);
+    for (j = 0; j < length (dirs) && !found; j++)
+      found = warmup_library (dirs[j], needed, NULL);
+  }
+  free (origin);
+
+#undef string
+#undef inside
+
+done:
+  munmap ((void *) data, sb.st_size);
+}
+
+/**
+ * warmup_file reads a file into the page cache and measures how much of it
+ * was resident before and after. While the pin budget lasts, the file stays
+ * mapped and locked in memory.
+ */
+static void
+warmup_file (const char *path)
+{
+  unsigned char *vec;
+  struct stat sb;
+  size_t pages;
+  size_t page;
+  void *data;
+  bool locked;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    debug ("Can't warm up %s", path);
+    errno = 0;
+    return;
+  }
+  if (fstat (fd, &sb) != 0 || !S_ISREG (sb.st_mode) || sb.st_size == 0) {
+    close (fd);
+    errno = 0;
+    return;
+  }
+  data = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    fatal ("mmap %s", path);
+
+  page = sysconf (_SC_PAGESIZE);
+  pages = (sb.st_size + page - 1) / page;
+  vec = malloc (pages);
+  if (vec == NULL)
+    fatal ("malloc");
+
+  warmup.files++;
+  warmup.pages += pages;
+  warmup.before += warmup_resident (data, sb.st_size, vec, pages);
+
+  /**
+   * readahead only starts reading, populating the mapping waits until the
+   * file is in the page cache.
+   */
+  if (readahead (fd, 0, sb.st_size) != 0)
+    posix_fadvise (fd, 0, sb.st_size, POSIX_FADV_WILLNEED);
+  madvise (data, sb.st_size, MADV_POPULATE_READ);
+  errno = 0;
+
+  locked = false;
+  if (warmup.pinned + sb.st_size <= warmup.budget) {
+    locked = (mlock (data, sb.st_size) == 0);
+    if (locked)
+      warmup.pinned += sb.st_size;
+    else
+      warning ("mlock %s", path);
+    errno = 0;
+  }
+
+  warmup.after += warmup_resident (data, sb.st_size, vec, pages);
+  if (!locked)
+    munmap (data, sb.st_size);
+  free (vec);
+  close (fd);
+}
+
+/**
+ * warmup_library warms up the library of the given name if the directory,
+ * or its multiarch subdirectory, contains it.
+ */
+static bool
+warmup_library (const char *dir, const char *needed, const char *triplet)
+{
+  char *resolved;
+  char *name;
+  bool found;
+
+  if (triplet)
+    name = path_join ("%s/%s/%s", dir, triplet, needed);
+  else
+    name = path_join ("%s/%s", dir, needed);
+  resolved = warmup_resolve (name);
+  found = (resolved != NULL);
+  free (resolved);
+  if (found)
+    warmup_elf (name);
+  free (name);
+  return found;
+}
+
+static void
+warmup_report (void)
+{
+  if (warmup.pages == 0)
+    return;
+  info ("Warmed up %zu files: %zu of %zu pages resident before, %zu after (%zu%%)",
+        warmup.files,
+        warmup.before,
+        warmup.pages,
+        warmup.after,
+        100 * warmup.after / warmup.pages);
+}
+
+/**
+ * warmup_resident counts the resident pages of a mapped file.
+ */
+static size_t
+warmup_resident (void *data, size_t size, unsigned char *vec, size_t pages)
+{
+  size_t count;
+  size_t i;
+
+  if (mincore (data, size, vec) != 0)
+    fatal ("mincore");
+  count = 0;
+  for (i = 0; i < pages; i++)
+    count += vec[i] & 1;
+  return count;
+}
+
+/**
+ * warmup_resolve maps a path inside the container to the file on the host
+ * that will provide it: the topmost image directory containing the path or,
+ * if there's none, the host file itself, as system directories which aren't
+ * part of the image are bound from the host.
+ */
+static char *
+warmup_resolve (const char *path)
+{
+  struct container_image *image;
+  char *result;
+  size_t i;
+
+  for (i = 0; container.image[i].source != NULL; i++)
+    ;
+  while (i-- > 0) {
+    image = container.image + i;
+    if (image->type != IMAGE_DIRECTORY)
+      continue;
+    result = path_join ("%s/%s", image->path, path);
+    if (path_exists (result))
+      return result;
+    free (result);
+  }
+  if (!path_exists (path))
+    return NULL;
+  result = strdup (path);
+  if (result == NULL)
+    fatal ("strdup");
+  return result;
+}
+
+/**
+ * warmup_setup warms up the container before it's set up, as selected by
+ * --warmup: the files of the image and the command with its libraries.
+ */
+static void
+warmup_setup (void)
+{
+  const struct index *index;
+  char *path;
+  size_t i;
+  size_t j;
+
+  if (container.warmup & WARMUP_IMAGE) {
+    for (i = 0; container.image[i].source != NULL; i++) {
+      index = &container.image[i].index;
+      if (container.image[i].type != IMAGE_DIRECTORY)
+        warmup_file (container.image[i].path);
+      else if (index->data == NULL)
+        nftw (container.image[i].path, warmup_callback, 32, FTW_PHYS);
+      else {
+        for (j = 0; j < index->count; j++) {
+          if (!S_ISREG (index->entry[j].mode))
+            continue;
+          path = path_join ("%s/%s", container.image[i].path, index_path (index, index->entry + j));
+          warmup_file (path);
+          free (path);
+        }
+      }
+      errno = 0;
+    }
+  }
+  if (container.warmup & WARMUP_EXEC && container.cmd[0][0] == '/')
+    warmup_elf (container.cmd[0]);
+  tdestroy (warmup.seen, free);
+  warmup.seen = NULL;
+  warmup_report ();
+}
+
+/**
+ * template_clone attaches a copy of the template entry for a default mount to
+ * the container root. It returns false for mounts which are created fresh
+ * for each container.
+ *
+ * Each entry is cloned on its own. A clone of the whole template would bring
+ * the template's top mount along, which would hide the container root, and
+ * the kernel doesn't move submounts out of a detached tree.
+ */
+static bool
+template_clone (const struct mount *mnt)
+{
+  char *source;
+  char *target;
+  int fd;
+
+  if (!template_entry (mnt))
+    return false;
+  if (container_image_contains (mnt->source)) {
+    warning ("Skipping %s because it's part of the container image", mnt->source);
+    return true;
+  }
+
+  /**
+   * A template prepared with another profile may lack the entry, which is
+   * then mounted like without a template.
+   */
+  source = path_join ("%s/%s", container.path.template, mnt->source);
+  if (!path_exists (source)) {
+    free (source);
+    return !path_exists (mnt->source);
+  }
+  mounter.calls++;
+  fd = open_tree (AT_FDCWD, source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+  if (fd < 0) {
+    if (errno != ENOSYS)
+      fatal ("open_tree %s", source);
+    errno = 0;
+    free (source);
+    return false;
+  }
+
+  info ("Cloning %s", mnt->source);
+  target = path_join ("%s/%s", container.path.root, mnt->source);
+  path_create (target);
+  mounter.mounts++;
+  mounter.calls++;
+  if (move_mount (fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    fatal ("move_mount %s %s", source, target);
+  if (str_equals (mnt->source, "/dev"))
+    template.dev = true;
+  close (fd);
+  free (source);
+  free (target);
+  return true;
+}
+
+/**
+ * template_entry checks if a default mount is part of the template. These
+ * are the bind mounts of system directories and /dev with its device nodes,
+ * which is read-only in the template. Everything with per-container state,
+ * e.g. devpts, proc or tmpfs mounts, is mounted fresh.
+ */
+static bool
+template_entry (const struct mount *mnt)
+{
+  return (mnt->flags & MS_BIND) || str_equals (mnt->source, "/dev");
+}
+
+/**
+ * template_prepare builds the mount template unless another boxer process
+ * already did. The template lives in the host mount namespace, so it's built
+ * once and then shared by all containers started with the same template.
+ */
+static void
+template_prepare (void)
+{
+  struct mount_attr attr;
+  struct mount m;
+  struct device d;
+  char *ready;
+  char *lock;
+  char *path;
+  size_t i;
+  size_t j;
+  int file;
+  int fd;
+
+  path_create (container.path.template);
+  lock = path_join ("%s.lock", container.path.template);
+  fd = open (lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    fatal ("open %s", lock);
+  if (flock (fd, LOCK_EX) != 0)
+    fatal ("flock %s", lock);
+
+  ready = path_join ("%s/.ready", container.path.template);
+  if (path_exists (ready))
+    goto done;
+
+  /**
+   * Remove the remains of a template whose preparation didn't finish.
+   */
+  umount2 (container.path.template, MNT_DETACH);
+  errno = 0;
+
+  info ("Preparing mount template in %s", container.path.template);
+  mount_setup (&(struct mount){
+    .source = "tmpfs",
+    .target = container.path.template,
+    .type   = "tmpfs",
+    .data   = "mode=755,size=64k",
+    .flags  = MS_NOSUID,
+  });
+
+  for (i = 0; i < profile.mounts; i++) {
+    if (!template_entry (profile.mount + i) || !path_exists (profile.mount[i].source))
+      continue;
+    m = profile.mount[i];
+    m.target = path_join ("%s/%s", container.path.template, m.source);
+    mount_setup (&m);
+    if (!str_equals (m.source, "/dev")) {
+      free (m.target);
+      continue;
+    }
+
+    for (j = 0; j < profile.devices; j++) {
+      d = profile.device[j];
+      d.path = path_join ("%s/%s", container.path.template, d.name);
+      device_setup (&d);
+      free (d.path);
+    }
+
+    device_links (container.path.template);
+    path = path_join ("%s/pts", m.target);
+    path_create (path);
+    free (path);
+    path = path_join ("%s/shm", m.target);
+    path_create (path);
+    free (path);
+
+    zero (attr);
+    attr.attr_set = MOUNT_ATTR_RDONLY;
+    if (mount_setattr (AT_FDCWD, m.target, 0, &attr, sizeof (attr)) != 0) {
+      if (errno != ENOSYS)
+        fatal ("mount_setattr %s", m.target);
+      errno = 0;
+      if (mount (NULL, m.target, NULL, m.flags | MS_REMOUNT | MS_RDONLY, profile.mount[i].data) != 0)
+        fatal ("mount %s", m.target);
+    }
+    free (m.target);
+  }
+  file = open (ready, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (file < 0)
+    fatal ("open %s", ready);
+  close (file);
+
+done:
+  close (fd);
+  free (ready);
+  free (lock);
+}
+
+/**
+ * profile_compare orders mounts by path, so a mount is always created before
+ * the mounts below it, whatever order the profile lists them in.
+ */
+static int
+profile_compare (const void *a, const void *b)
+{
+  return strcmp (((const struct mount *) a)->source, ((const struct mount *) b)->source);
+}
+
+/**
+ * profile_device adds a device node of the host to the profile. Nodes of the
+ * catalog keep their definition, any other node gets the device number it
+ * has on the host. With bind, the host node is bind mounted instead of
+ * created with mknod.
+ */
+static void
+profile_device (const char *name, bool bind)
+{
+  struct device dev;
+  struct stat sb;
+  size_t i;
+
+  if (stat (name, &sb) != 0) {
+    errno = 0;
+    debug ("Skipping device %s, the host has no such node", name);
+    return;
+  }
+  if (!S_ISCHR (sb.st_mode) && !S_ISBLK (sb.st_mode))
+    fatal ("%s isn't a device node", name);
+
+  dev = (struct device){.name = (char *) name, .dev = sb.st_rdev};
+  for (i = 0; i < length (devices); i++)
+    if (str_equals (devices[i].name, name))
+      dev = devices[i];
+  dev.name = strdup (dev.name);
+  if (dev.name == NULL)
+    fatal ("strdup");
+  dev.bind = bind;
+
+  profile_omit (name);
+  profile.device = reallocarray (profile.device, profile.devices + 1, sizeof (struct device));
+  if (profile.device == NULL)
+    fatal ("reallocarray");
+  profile.device[profile.devices++] = dev;
+}
+
+/**
+ * profile_init loads the profile of the container, the default profile
+ * unless --profile names another one.
+ */
+static void
+profile_init (void)
+{
+  default_value (profile.name, "default");
+  profile_load (profile.name, 0);
+  qsort (profile.mount, profile.mounts, sizeof (struct mount), profile_compare);
+  info ("Using profile %s with %zu mounts and %zu devices", profile.name, profile.mounts, profile.devices);
+}
+
+static void
+profile_line (char **words, const char *where, size_t line, unsigned int depth)
+{
+  size_t n;
+
+  for (n = 0; words[n] != NULL; n++)
+    ;
+  if (n >= 2 && words[1][0] != '/' && !str_equals (words[0], "include"))
+    fatal ("Path %s in line %zu of %s isn't absolute", words[1], line, where);
+
+  if (n == 2 && str_equals (words[0], "include"))
+    profile_load (words[1], depth + 1);
+  else if (n == 2 && str_equals (words[0], "mount"))
+    profile_mount (words[1], false);
+  else if (n == 3 && str_equals (words[0], "mount") && str_equals (words[2], "rw"))
+    profile_mount (words[1], true);
+  else if (n == 2 && str_equals (words[0], "device"))
+    profile_device (words[1], false);
+  else if (n == 3 && str_equals (words[0], "device") && str_equals (words[2], "bind"))
+    profile_device (words[1], true);
+  else if (n == 2 && str_equals (words[0], "omit"))
+    profile_omit (words[1]);
+  else
+    fatal ("Invalid line %zu in %s", line, where);
+}
+
+/**
+ * profile_load adds the mounts and devices of a built-in profile or of a
+ * section of PROFILE_PATH to the profile of the container.
+ */
+static void
+profile_load (const char *name, unsigned int depth)
+{
+  bool found;
+  size_t i;
+  size_t j;
+  FILE *f;
+
+  if (depth > PROFILE_DEPTH)
+    fatal ("Profile %s is included too deep, does it include itself?", name);
+
+  for (i = 0; i < length (profiles); i++) {
+    if (!str_equals (profiles[i].name, name))
+      continue;
+    if (profiles[i].text == NULL) {
+      for (j = 0; j < length (mounts); j++)
+        profile_mount (mounts[j].source, false);
+      for (j = 0; j < length (devices); j++)
+        profile_device (devices[j].name, false);
+      return;
+    }
+    f = fmemopen (profiles[i].text, strlen (profiles[i].text), "r");
+    if (f == NULL)
+      fatal ("fmemopen");
+    profile_read (f, NULL, "built-in profile", depth);
+    fclose (f);
+    return;
+  }
+
+  f = fopen (PROFILE_PATH, "re");
+  if (f == NULL)
+    fatal ("Unknown profile %s, open %s", name, PROFILE_PATH);
+  found = profile_read (f, name, PROFILE_PATH, depth);
+  fclose (f);
+  if (!found)
+    fatal ("Unknown profile %s, it's not in %s", name, PROFILE_PATH);
+}
+
+/**
+ * profile_mount adds a mount to the profile. Mounts of the catalog keep
+ * their definition, any other path is a read-only bind mount of the host
+ * directory. With rw, the mount is writable.
+ */
+static void
+profile_mount (const char *path, bool rw)
+{
+  struct mount mnt;
+  struct stat sb;
+  size_t i;
+
+  mnt = (struct mount){.source = (char *) path, .flags = MS_BIND | MS_RDONLY | MS_NOSUID};
+  for (i = 0; i < length (mounts); i++)
+    if (str_equals (mounts[i].source, path))
+      break;
+  if (i < length (mounts))
+    mnt = mounts[i];
+  else if (stat (path, &sb) != 0) {
+    errno = 0;
+    debug ("Skipping mount %s, the host has no such directory", path);
+    return;
+  }
+  else if (!S_ISDIR (sb.st_mode))
+    fatal ("%s isn't a directory", path);
+
+  mnt.source = strdup (mnt.source);
+  if (mnt.source == NULL)
+    fatal ("strdup");
+  if (rw)
+    mnt.flags &= ~MS_RDONLY;
+
+  profile_omit (path);
+  profile.mount = reallocarray (profile.mount, profile.mounts + 1, sizeof (struct mount));
+  if (profile.mount == NULL)
+    fatal ("reallocarray");
+  profile.mount[profile.mounts++] = mnt;
+}
+
+/**
+ * profile_omit removes a mount or device from the profile, e.g. one of a
+ * profile included before.
+ */
+static void
+profile_omit (const char *path)
+{
+  size_t i;
+
+  for (i = 0; i < profile.mounts; i++)
+    if (str_equals (profile.mount[i].source, path)) {
+      free (profile.mount[i].source);
+      memmove (profile.mount + i, profile.mount + i + 1, (--profile.mounts - i) * sizeof (struct mount));
+      break;
+    }
+  for (i = 0; i < profile.devices; i++)
+    if (str_equals (profile.device[i].name, path)) {
+      free (profile.device[i].name);
+      memmove (profile.device + i, profile.device + i + 1, (--profile.devices - i) * sizeof (struct device));
+      break;
+    }
+}
+
+/**
+ * profile_read reads the lines of the section name from f, or all lines if
+ * name is NULL. It returns false if the section wasn't found.
+ */
+static bool
+profile_read (FILE *f, const char *name, const char *where, unsigned int depth)
+{
+  char **words;
+  char *line;
+  char *start;
+  char *end;
+  size_t size;
+  size_t n;
+  size_t i;
+  bool found;
+  bool in;
+
+  in = found = (name == NULL);
+  line = NULL;
+  size = 0;
+  for (n = 1; getline (&line, &size, f) > 0; n++) {
+    line[strcspn (line, "\n")] = '\0';
+    start = line + strspn (line, " \t");
+    if (*start == '\0' || *start == '#')
+      continue;
+    if (*start == '[') {
+      end = strchr (start, ']');
+      if (end == NULL || name == NULL)
+        fatal ("Invalid section in line %zu of %s", n, where);
+      *end = '\0';
+      in = str_equals (start + 1, name);
+      found = found || in;
+      continue;
+    }
+    if (!in)
+      continue;
+
+    words = str_split_words (start);
+    if (words == NULL)
+      fatal ("Unterminated quote in line %zu of %s", n, where);
+    if (words[0] != NULL)
+      profile_line (words, where, n, depth);
+    for (i = 0; words[i] != NULL; i++)
+      free (words[i]);
+    free (words);
+  }
+  free (line);
+  return found;
+}
+
+static int
+commit_callback (const char *src, const struct stat *sb, int type, struct FTW *buf)
+{
+  const char *rel;
+
+  rel = src + strlen (commit.src);
+  rel += strspn (rel, "/");
+  if (*rel == '\0')
+    return 0;
+
+  /**
+   * Everything that changed while the container ran has a newer change time
+   * than the start of the command. The change time of a directory also moves
+   * when entries are removed from it. A file written in place leaves the time
+   * of its directory alone though, so the walk can't skip directories which
+   * didn't change and stats every entry of the root.
+   */
+  if (sb->st_ctim.tv_sec < commit.start->tv_sec
+      || (sb->st_ctim.tv_sec == commit.start->tv_sec && sb->st_ctim.tv_nsec <= commit.start->tv_nsec))
+    return 0;
+
+  commit_entry (rel, src, sb);
+  if (type == FTW_D && commit.scan)
+    commit_deleted (rel);
+  return 0;
+}
+
+/**
+ * commit_command flattens image layers into a new image directory. Regular
+ * files are hard links to the files of the layers, whiteouts of upper layers
+ * delete the entries of lower layers.
+ */
+static void
+commit_command (int argc, char *const argv[])
+{
+  char *dst;
+  char *src;
+  int i;
+
+  if (argc < 3)
+    fatal ("Call: %s commit DIR IMAGE...", program_invocation_short_name);
+  dst = path_clean (argv[1]);
+  if (path_exists (dst))
+    fatal ("Commit target %s exists", dst);
+  path_create (dst);
+
+  path.sync.hardlink = true;
+  for (i = 2; i < argc; i++) {
+    src = path_clean (argv[i]);
+    info ("Linking %s into %s", src, dst);
+    if (path_sync (src, dst, i > 2, NULL) != 0)
+      fatal ("nftw %s", src);
+    free (src);
+  }
+  free (dst);
+}
+
+/**
+ * commit_deleted looks for entries of the image directory rel which are gone
+ * from the container root and records them as whiteouts.
+ */
+static void
+commit_deleted (const char *rel)
+{
+  struct dirent *entry;
+  struct stat sb;
+  char *path;
+  DIR *dir;
+  size_t i;
+
+  for (i = 0; container.image[i].source != NULL; i++) {
+    if (container.image[i].type != IMAGE_DIRECTORY) {
+      if (!commit.untracked)
+        warning ("Can't find files deleted from image %s", container.image[i].path);
+      commit.untracked = true;
+      continue;
+    }
+    path = path_join ("%s/%s", container.image[i].path, rel);
+    dir = opendir (path);
+    free (path);
+    if (dir == NULL) {
+      errno = 0;
+      continue;
+    }
+    while ((entry = readdir (dir)) != NULL) {
+      if (str_equals (entry->d_name, ".") || str_equals (entry->d_name, ".."))
+        continue;
+      path = path_join ("%s/%s/%s", commit.src, rel, entry->d_name);
+      if (lstat (path, &sb) != 0 && errno == ENOENT) {
+        free (path);
+        path = path_join ("%s/%s", rel, entry->d_name);
+        commit_entry (path, NULL, &(struct stat){ .st_mode = S_IFCHR });
+      }
+      errno = 0;
+      free (path);
+    }
+    closedir (dir);
+  }
+}
+
+/**
+ * commit_entry writes an entry of the container root to the new layer,
+ * together with the directories leading to it. Without a source, the entry
+ * is a whiteout.
+ */
+static void
+commit_entry (const char *rel, const char *src, const struct stat *sb)
+{
+  struct stat parent;
+  char *path;
+  char *dst;
+  char *pos;
+
+  /**
+   * Create the parents of the entry with the mode and owner they have in the
+   * container root, unless they exist already.
+   */
+  path = path_join ("%s", rel);
+  for (pos = strchr (path, '/'); pos != NULL; pos = strchr (pos + 1, '/')) {
+    *pos = '\0';
+    dst = path_join ("%s/%s", commit.dst, path);
+    if (!path_exists (dst)) {
+      free (dst);
+      dst = path_join ("%s/%s", commit.src, path);
+      if (lstat (dst, &parent) != 0)
+        fatal ("lstat %s", dst);
+      commit_entry (path, dst, &parent);
+    }
+    free (dst);
+    *pos = '/';
+  }
+  free (path);
+
+  dst = path_join ("%s/%s", commit.dst, rel);
+  if (S_ISREG (sb->st_mode)) {
+    copy_file (src, dst, sb);
+    commit.files++;
+  }
+  else if (S_ISDIR (sb->st_mode)) {
+    if (mkdir (dst, sb->st_mode & 07777) != 0 && errno != EEXIST)
+      fatal ("mkdir %s", dst);
+    chown (dst, sb->st_uid, sb->st_gid);
+    chmod (dst, sb->st_mode);
+    if (src && path_sync_opaque (src) && lsetxattr (dst, "trusted.overlay.opaque", "y", 1, 0) != 0)
+      fatal ("lsetxattr %s", dst);
+  }
+  else if (S_ISLNK (sb->st_mode)) {
+    path_sync_sym (dst, src, sb, NULL);
+    lchown (dst, sb->st_uid, sb->st_gid);
+    commit.files++;
+  }
+  else if (mknod (dst, sb->st_mode, sb->st_rdev) == 0) {
+    if (src == NULL || (S_ISCHR (sb->st_mode) && sb->st_rdev == 0))
+      commit.whiteouts++;
+    else
+      commit.files++;
+    chown (dst, sb->st_uid, sb->st_gid);
+  }
+  else if (errno != EEXIST)
+    fatal ("mknod %s", dst);
+  errno = 0;
+  free (dst);
+}
+
+/**
+ * commit_mark records when the command of the container starts. Setup is
+ * complete at this point, so everything that changes from now on is part of
+ * the commit.
+ */
+static void
+commit_mark (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_REALTIME, commit.start);
+
+  /**
+   * File times come from the coarse clock. Wait until it passed the start,
+   * so that every later change gets a newer time.
+   */
+  do {
+    usleep (USLEEP_MILLISECONDS);
+    clock_gettime (CLOCK_REALTIME_COARSE, &now);
+  } while (now.tv_sec < commit.start->tv_sec
+           || (now.tv_sec == commit.start->tv_sec && now.tv_nsec <= commit.start->tv_nsec));
+}
+
+/**
+ * commit_prepare checks the commit target and allocates the start time,
+ * which is shared with the container process.
+ */
+static void
+commit_prepare (void)
+{
+  if (path_exists (container.path.commit))
+    fatal ("Commit target %s exists", container.path.commit);
+  commit.start = mmap (NULL, sizeof (struct timespec), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (commit.start == MAP_FAILED)
+    fatal ("mmap");
+  commit.start->tv_sec = -1;
+}
+
+/**
+ * commit_write writes the changes the container made to its root as a new
+ * image layer, in the format of an overlay layer. Files are copied, or cloned
+ * if the file system supports it, deleted entries become whiteouts.
+ */
+static void
+commit_write (void)
+{
+  char *src;
+  int fd;
+
+  if (commit.start->tv_sec < 0)
+    stop ("Not committing, the command of the container never started");
+
+  /**
+   * In the overlay modes, the upper directory holds all changes and whiteouts
+   * for all deletions. It's hidden below the overlay, which is detached
+   * together with all mounts on top of it. Otherwise, the container root is
+   * compared with the image, using a clone of the root without the mounts on
+   * top of it.
+   */
+  fd = -1;
+  if (container.mode == MODE_OVERLAY || container.mode == MODE_STORE) {
+    if (umount2 (container.path.root, MNT_DETACH) != 0)
+      fatal ("umount2 %s", container.path.root);
+    src = path_join ("%s/.boxer/upper", container.path.root);
+    commit.scan = false;
+  }
+  else {
+    fd = open_tree (AT_FDCWD, container.path.root, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    if (fd < 0)
+      fatal ("open_tree %s", container.path.root);
+    src = path_join ("/proc/self/fd/%d/.", fd);
+    commit.scan = true;
+  }
+
+  info ("Committing changes of %s to %s", container.path.root, container.path.commit);
+  commit.src = src;
+  commit.dst = container.path.commit;
+  path_create (commit.dst);
+  copy_start ();
+  if (nftw (src, commit_callback, 32, FTW_PHYS | FTW_MOUNT) != 0)
+    fatal ("nftw %s", src);
+  copy_finish ();
+  info ("Committed %zu files and %zu whiteouts", commit.files, commit.whiteouts);
+
+  if (fd >= 0)
+    close (fd);
+  free (src);
+}
+
+/**
+ * idmap_id translates an owner of the image to the owner inside the
+ * container. The mapping swaps the two ranges and leaves all other IDs alone.
+ */
+static unsigned int
+idmap_id (unsigned int id)
+{
+  if (idmap.count == 0)
+    return id;
+  if (id >= idmap.from && id - idmap.from < idmap.count)
+    return id - idmap.from + idmap.to;
+  if (id >= idmap.to && id - idmap.to < idmap.count)
+    return id - idmap.to + idmap.from;
+  return id;
+}
+
+/**
+ * idmap_mount attaches an idmapped clone of the directory source to target.
+ * It returns false if the kernel or the file system doesn't support
+ * idmapped mounts.
+ */
+static bool
+idmap_mount (const char *source, const char *target)
+{
+  struct mount_attr attr;
+  int fd;
+
+  if (idmap.fd < 0)
+    return false;
+
+  mounter.calls += 2;
+  fd = open_tree (AT_FDCWD, source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+  if (fd < 0)
+    fatal ("open_tree %s", source);
+
+  zero (attr);
+  attr.attr_set = MOUNT_ATTR_IDMAP;
+  attr.userns_fd = idmap.fd;
+  if (mount_setattr (fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof (attr)) != 0) {
+    if (errno != EINVAL && errno != ENOSYS && errno != EPERM && errno != EOPNOTSUPP)
+      fatal ("mount_setattr %s", source);
+    warning ("Can't idmap %s", source);
+    errno = 0;
+    close (fd);
+    return false;
+  }
+
+  path_create (target);
+  mounter.mounts++;
+  mounter.calls++;
+  if (move_mount (fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    fatal ("move_mount %s %s", source, target);
+  close (fd);
+  return true;
+}
+
+/**
+ * idmap_userns creates a user namespace with the ID mapping and returns a
+ * descriptor of it. The namespace belongs to a child process, which only
+ * lives until the descriptor is opened.
+ */
+static int
+idmap_userns (void)
+{
+  unsigned int ranges[4][2];
+  unsigned int start;
+  unsigned int tmp[2];
+  char map[256];
+  size_t len;
+  size_t i;
+  char *path;
+  pid_t pid;
+  int pipes[2];
+  int fd;
+  char c;
+
+  /**
+   * Besides the two swapped ranges, the map needs identity ranges for all
+   * gaps between them. Otherwise unmapped owners would show up as nobody.
+   */
+  ranges[0][0] = idmap.from;
+  ranges[0][1] = idmap.to;
+  ranges[1][0] = idmap.to;
+  ranges[1][1] = idmap.from;
+  if (ranges[1][0] < ranges[0][0]) {
+    memcpy (tmp, ranges[0], sizeof (tmp));
+    memcpy (ranges[0], ranges[1], sizeof (tmp));
+    memcpy (ranges[1], tmp, sizeof (tmp));
+  }
+  len = 0;
+  start = 0;
+  for (i = 0; i < 2; i++) {
+    if (ranges[i][0] > start)
+      len += snprintf (map + len, sizeof (map) - len, "%u %u %u\n", start, start, ranges[i][0] - start);
+    len += snprintf (map + len, sizeof (map) - len, "%u %u %u\n", ranges[i][0], ranges[i][1], idmap.count);
+    start = ranges[i][0] + idmap.count;
+  }
+  if (start < UINT_MAX)
+    len += snprintf (map + len, sizeof (map) - len, "%u %u %u\n", start, start, UINT_MAX - start);
+
+  if (pipe2 (pipes, O_CLOEXEC) != 0)
+    fatal ("pipe2");
+  pid = fork ();
+  if (pid < 0)
+    fatal ("fork");
+  if (pid == 0) {
+    close (pipes[0]);
+    if (unshare (CLONE_NEWUSER) != 0)
+      _exit (EXIT_FAILURE);
+    if (write (pipes[1], "", 1) != 1)
+      _exit (EXIT_FAILURE);
+    pause ();
+    _exit (EXIT_SUCCESS);
+  }
+  close (pipes[1]);
+
+  fd = -1;
+  if (read (pipes[0], &c, 1) == 1) {
+    path = path_join ("/proc/%d/uid_map", pid);
+    path_write (path, "%s", map);
+    free (path);
+    path = path_join ("/proc/%d/gid_map", pid);
+    path_write (path, "%s", map);
+    free (path);
+    path = path_join ("/proc/%d/ns/user", pid);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      fatal ("open %s", path);
+    free (path);
+  }
+  else {
+    warning ("Can't create a user namespace for the ID mapping");
+    errno = 0;
+  }
+  close (pipes[0]);
+  kill (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+  return fd;
+}
+
+static int
+writable_callback (const char *path, const struct stat *sb, int type, struct FTW *buf)
+{
+  writable.used_bytes += sb->st_blocks * 512;
+  writable.used_inodes++;
+  return 0;
+}
+
+/**
+ * writable_claim claims an ID of the project range for the writable layer.
+ * The claim is an exclusive flock on a lock file of the ID, which is released
+ * when boxer exits, so containers running at the same time never share a
+ * project. Returns 0 if all IDs are in use.
+ */
+static unsigned int
+writable_claim (void)
+{
+  unsigned int id;
+  char *path;
+  int fd;
+
+  path_create ("/run/boxer/projects");
+  for (id = writable.projects.first; id != 0 && id <= writable.projects.last; id++) {
+    path = path_join ("/run/boxer/projects/%u.lock", id);
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      fatal ("open %s", path);
+    free (path);
+    if (flock (fd, LOCK_EX | LOCK_NB) == 0) {
+      writable.lock = fd;
+      return id;
+    }
+    errno = 0;
+    close (fd);
+  }
+  return 0;
+}
+
+/**
+ * writable_prepare creates the directory of the writable container root
+ * below the directory given by the user. With a size or inode limit, the
+ * directory gets a project of its own, which all files created below it
+ * inherit, and the limits become the quota of the project.
+ */
+static void
+writable_prepare (void)
+{
+  struct fsxattr fsx;
+  unsigned int project;
+
+  writable.path = path_join ("%s/%s", writable.dir, boxer.id);
+  path_create (writable.path);
+  if (chmod (writable.path, 01777) != 0)
+    fatal ("chmod %s", writable.path);
+  writable.fd = open (writable.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (writable.fd < 0)
+    fatal ("open %s", writable.path);
+  if (writable.size == 0 && writable.nr_inodes == 0)
+    return;
+
+  project = writable_claim ();
+  if (project == 0) {
+    rmdir (writable.path);
+    fatal ("All projects %u-%u are in use", writable.projects.first, writable.projects.last);
+  }
+
+  /**
+   * Successful calls leave errno alone, so it still explains the failure
+   * after the directory is removed again. Only a quota boxer did set is
+   * reset when the container exits.
+   */
+  info ("Limiting %s to %jd bytes and %jd inodes with project %u", writable.path,
+        (intmax_t) writable.size, (intmax_t) writable.nr_inodes, project);
+  if (ioctl (writable.fd, FS_IOC_FSGETXATTR, &fsx) != 0) {
+    rmdir (writable.path);
+    fatal ("Can't assign a project to %s", writable.path);
+  }
+  fsx.fsx_projid = project;
+  fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
+  if (ioctl (writable.fd, FS_IOC_FSSETXATTR, &fsx) != 0) {
+    rmdir (writable.path);
+    fatal ("Can't assign a project to %s", writable.path);
+  }
+  if (!writable_quota (project, writable.size, writable.nr_inodes)) {
+    rmdir (writable.path);
+    fatal ("Can't set the quota of project %u, are project quotas enabled on %s", project, writable.dir);
+  }
+  writable.project = project;
+}
+
+/**
+ * writable_quota sets the hard limits of the project quota and returns false
+ * if that fails. The file system must be mounted with project quotas enabled,
+ * e.g. with prjquota for ext4 and XFS.
+ */
+static bool
+writable_quota (unsigned int project, off_t size, off_t inodes)
+{
+  struct dqblk dq;
+
+  zero (dq);
+  dq.dqb_bhardlimit = (size + QIF_DQBLKSIZE - 1) / QIF_DQBLKSIZE;
+  dq.dqb_ihardlimit = inodes;
+  dq.dqb_valid = QIF_LIMITS;
+  return syscall (SYS_quotactl_fd, writable.fd, QCMD (Q_SETQUOTA, PRJQUOTA), project, &dq) == 0;
+}
+
+/**
+ * writable_remove drops the writable container root on a disk. All mounts
+ * stacked on the root are detached first, as the mounts inside it keep its
+ * directories busy.
+ */
+static void
+writable_remove (void)
+{
+  while (umount2 (container.path.root, MNT_DETACH) == 0)
+    ;
+  errno = 0;
+  path_remove (writable.path);
+  if (writable.project) {
+    if (!writable_quota (writable.project, 0, 0))
+      warning ("Can't reset the quota of project %u", writable.project);
+    close (writable.lock);
+  }
+  close (writable.fd);
+}
+
+/**
+ * writable_report logs how much of the writable container root is in use.
+ * A layer that is almost full likely made writes inside the container fail.
+ */
+static void
+writable_report (void)
+{
+  struct statvfs sv;
+  struct dqblk dq;
+  const char *path;
+  off_t size;
+  off_t inodes;
+
+  path = writable.dir ? writable.path : container.path.root;
+  if (statvfs (path, &sv) != 0)
+    stop ("statvfs %s", path);
+  size = (off_t) (sv.f_blocks * sv.f_frsize);
+  inodes = sv.f_files;
+  writable.used_bytes = (off_t) ((sv.f_blocks - sv.f_bfree) * sv.f_frsize);
+  writable.used_inodes = sv.f_files - sv.f_ffree;
+  if (writable.dir != NULL) {
+    writable.used_bytes = 0;
+    writable.used_inodes = 0;
+    if (writable.project) {
+      if (syscall (SYS_quotactl_fd, writable.fd, QCMD (Q_GETQUOTA, PRJQUOTA), writable.project, &dq) != 0)
+        stop ("quotactl %s", writable.dir);
+      writable.used_bytes = dq.dqb_curspace;
+      writable.used_inodes = dq.dqb_curinodes;
+    }
+    else if (nftw (writable.path, writable_callback, 32, FTW_PHYS | FTW_MOUNT) != 0)
+      stop ("nftw %s", writable.path);
+    /**
+     * A directory without limits has the free space of its file system left.
+     */
+    size = writable.size ? writable.size : writable.used_bytes + (off_t) (sv.f_bavail * sv.f_frsize);
+    inodes = writable.nr_inodes ? writable.nr_inodes : writable.used_inodes + (off_t) sv.f_favail;
+  }
+
+  info ("Writable layer used %jd of %jd MiB and %jd of %jd inodes",
+        (intmax_t) (writable.used_bytes >> 20), (intmax_t) (size >> 20),
+        (intmax_t) writable.used_inodes, (intmax_t) inodes);
+  if ((size > 0 && writable.used_bytes >= size - size / 20)
+      || (inodes > 0 && writable.used_inodes >= inodes - inodes / 20))
+    warning ("Writable layer is full, writes inside the container may have failed");
+}
+
+/**
+ * pool_accept takes all pending connections to the pool. Clients are polled
+ * until their message arrived, which usually happens right after connecting.
+ */
+static void
+pool_accept (void)
+{
+  int client;
+
+  for (;;) {
+    client = accept4 (pool.listen, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        fatal ("accept4");
+      errno = 0;
+      return;
+    }
+    pool.pending = reallocarray (pool.pending, pool.pendings + 1, sizeof (struct pool_claim));
+    if (pool.pending == NULL)
+      fatal ("reallocarray");
+    pool.pending[pool.pendings++] = (struct pool_claim){client, pool_now ()};
+    boxer_fd_poll (client);
+    pool_request (pool.pendings - 1);
+  }
+}
+
+/**
+ * pool_claim runs the command in a prepared container of the pool named by
+ * --pool and exits with its status. The container uses the standard file
+ * descriptors and the environment of this process.
+ */
+static void
+pool_claim (void)
+{
+  struct pool_message msg;
+  uint64_t start;
+  size_t size;
+  size_t i;
+  char *data;
+  char *pos;
+  int fd;
+
+  zero (msg);
+  msg.type = POOL_CLAIM;
+  msg.uid = getuid ();
+  size = 0;
+  for (i = 0; container.cmd && container.cmd[i]; i++, msg.argc++)
+    size += strlen (container.cmd[i]) + 1;
+  for (i = 0; environ[i]; i++, msg.envc++)
+    size += strlen (environ[i]) + 1;
+  if (size > POOL_REQUEST_MAX)
+    fatal ("Command and environment exceed %d bytes", POOL_REQUEST_MAX);
+  msg.size = size;
+
+  data = malloc (size + 1);
+  if (data == NULL)
+    fatal ("malloc");
+  pos = data;
+  for (i = 0; i < msg.argc; i++)
+    pos = stpcpy (pos, container.cmd[i]) + 1;
+  for (i = 0; i < msg.envc; i++)
+    pos = stpcpy (pos, environ[i]) + 1;
+
+  start = pool_now ();
+  fd = pool_connect ();
+  if (!pool_send (fd, &msg, data, (const int[]){STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}, 3))
+    fatal ("Can't claim a container of pool %s", pool.name);
+  free (data);
+
+  if (pool_recv (fd, &msg, NULL, 0, 0) < 0 || msg.type != POOL_STARTED)
+    fatal ("Pool %s failed to start the command", pool.name);
+  info ("Started in a container of pool %s after %.3f ms", pool.name, (pool_now () - start) / 1e6);
+  if (pool_recv (fd, &msg, NULL, 0, 0) < 0 || msg.type != POOL_EXITED)
+    fatal ("Pool %s lost the container", pool.name);
+  exit (msg.value);
+}
+
+/**
+ * pool_command starts the pool daemon of the given name, which keeps
+ * containers prepared with the given options, or prints its state.
+ */
+static void
+pool_command (int argc, char *const argv[])
+{
+  struct pool_message msg;
+  char *data;
+  int fd;
+
+  if (argc < 3)
+    fatal ("Call: %s pool start|stat NAME [OPTION]...", program_invocation_short_name);
+  if (strchr (argv[2], '/'))
+    fatal ("Invalid pool name %s", argv[2]);
+
+  if (str_equals (argv[1], "start")) {
+    options_parse (argc - 2, argv + 2);
+    if (notify.fd >= 0)
+      fatal ("Pooled containers can't use --ready-fd");
+    pool.name = argv[2];
+    default_value (pool.size, 4);
+    pool_run ();
+  }
+  else if (str_equals (argv[1], "stat")) {
+    pool.name = argv[2];
+    fd = pool_connect ();
+    zero (msg);
+    msg.type = POOL_STAT;
+    if (!pool_send (fd, &msg, NULL, NULL, 0))
+      fatal ("send");
+    if (pool_recv (fd, &msg, NULL, 0, 0) < 0 || msg.type != POOL_STAT)
+      fatal ("Pool %s sent no state", pool.name);
+    data = pool_data (fd, msg.size);
+    fputs (data, stdout);
+    free (data);
+    close (fd);
+  }
+  else
+    fatal ("Unknown pool command %s", argv[1]);
+}
+
+static int
+pool_connect (void)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  pool.path = path_join ("/run/boxer/pool/%s.sock", pool.name);
+  zero (addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (pool.path) >= sizeof (addr.sun_path))
+    fatal ("Pool name %s is too long", pool.name);
+  strcpy (addr.sun_path, pool.path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    fatal ("socket");
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    fatal ("Can't connect to pool %s", pool.name);
+  return fd;
+}
+
+/**
+ * pool_data reads the size bytes following a message and terminates them, so
+ * the last string of a message can't run past its end.
+ */
+static char *
+pool_data (int fd, size_t size)
+{
+  char *data;
+
+  if (size > POOL_REQUEST_MAX)
+    fatal ("Pool message of %zu bytes is too large", size);
+  data = malloc (size + 1);
+  if (data == NULL)
+    fatal ("malloc");
+  if (size > 0 && recv (fd, data, size, MSG_WAITALL) != (ssize_t) size)
+    fatal ("Short pool message");
+  data[size] = '\0';
+  return data;
+}
+
+/**
+ * pool_dispatch hands a claim to a parked worker, or queues it until the
+ * next worker parks.
+ */
+static void
+pool_dispatch (int client, uint64_t time)
+{
+  struct pool_message msg;
+  struct pool_worker *w;
+  size_t i;
+
+  for (i = 0; i < pool.workers; i++) {
+    w = pool.worker + i;
+    if (w->state != POOL_WORKER_PARKED)
+      continue;
+    zero (msg);
+    msg.type = POOL_CLAIM;
+    msg.time = time;
+    if (!pool_send (w->fd, &msg, NULL, &client, 1))
+      continue;
+    w->state = POOL_WORKER_RUNNING;
+    pool.parked--;
+    close (client);
+    return;
+  }
+
+  pool.waiting = reallocarray (pool.waiting, pool.waits + 1, sizeof (struct pool_claim));
+  if (pool.waiting == NULL)
+    fatal ("reallocarray");
+  pool.waiting[pool.waits++] = (struct pool_claim){client, time};
+  info ("No container of pool %s is ready, %zu claims are waiting", pool.name, pool.waits);
+}
+
+static uint64_t
+pool_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * pool_park runs in the prepared container process right before the command
+ * would be executed. It waits for a claim, takes over the standard file
+ * descriptors and the environment of the client and sets the command. The
+ * descriptor closes on exec, which tells the worker that the command started.
+ */
+static void
+pool_park (int fd)
+{
+  struct pool_message msg;
+  char **strings;
+  char *data;
+  char *pos;
+  int stdio[3];
+  int i;
+
+  zero (msg);
+  msg.type = POOL_PARKED;
+  if (!pool_send (fd, &msg, NULL, NULL, 0))
+    fatal ("send");
+  if (pool_recv (fd, &msg, stdio, 3, 0) != 3 || msg.type != POOL_CLAIM)
+    exit (EXIT_FAILURE);
+
+  data = pool_data (fd, msg.size);
+  strings = calloc ((size_t) msg.argc + msg.envc + 2, sizeof (char *));
+  if (strings == NULL)
     fatal ("calloc");
+  pos = data;
+  for (i = 0; i < (int) (msg.argc + msg.envc); i++) {
+    if (pos >= data + msg.size)
+      fatal ("Invalid claim");
+    strings[i + (i >= (int) msg.argc)] = pos;
+    pos += strlen (pos) + 1;
+  }
+
+  for (i = 0; i < 3; i++) {
+    if (dup2 (stdio[i], i) != i)
+      fatal ("dup2");
+    close (stdio[i]);
+  }
+  if (msg.argc > 0)
+    container.cmd = strings;
+  environ = strings + msg.argc + 1;
+}
+
+/**
+ * pool_reap collects exited workers. A worker that exits before it parked
+ * failed to prepare its container, which is fatal as long as no container
+ * of the pool was ever prepared, since all others would fail the same way.
+ */
+static void
+pool_reap (void)
+{
+  struct pool_worker *w;
+  int status;
+  pid_t pid;
+  size_t i;
+
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+    for (i = 0; i < pool.workers; i++)
+      if (pool.worker[i].pid == pid)
+        break;
+    if (i == pool.workers)
+      continue;
+    w = pool.worker + i;
+    if (w->state == POOL_WORKER_STARTING) {
+      if (!pool.started)
+        fatal ("Pool %s can't prepare containers", pool.name);
+      pool.starting--;
+    }
+    if (w->state == POOL_WORKER_PARKED)
+      pool.parked--;
+    if (w->fd >= 0) {
+      boxer_fd_unpoll (w->fd);
+      close (w->fd);
+    }
+    *w = pool.worker[--pool.workers];
+  }
+  errno = 0;
+}
+
+/**
+ * pool_recv receives a message and up to n file descriptors, and returns the
+ * number of descriptors received. It returns -1 if the peer is gone or, with
+ * MSG_DONTWAIT in flags, if there's no message yet.
+ */
+static int
+pool_recv (int fd, struct pool_message *msg, int *fds, size_t n, int flags)
+{
+  char control[CMSG_SPACE (3 * sizeof (int))];
+  struct cmsghdr *cmsg;
+  struct msghdr hdr;
+  struct iovec iov;
+  ssize_t ret;
+  size_t count;
+  size_t i;
+  int *received;
+
+  iov.iov_base = msg;
+  iov.iov_len = sizeof (*msg);
+  zero (hdr);
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof (control);
+
+  ret = recvmsg (fd, &hdr, MSG_WAITALL | MSG_CMSG_CLOEXEC | flags);
+  if (ret <= 0)
+    return -1;
+  if (ret != sizeof (*msg) || (hdr.msg_flags & MSG_CTRUNC))
+    fatal ("Invalid pool message");
+
+  count = 0;
+  for (cmsg = CMSG_FIRSTHDR (&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR (&hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    received = (int *) CMSG_DATA (cmsg);
+    for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int); i++) {
+      if (count < n)
+        fds[count++] = received[i];
+      else
+        close (received[i]);
+    }
+  }
+  return (int) count;
+}
+
+/**
+ * pool_refill starts new workers until enough containers are parked or
+ * being prepared.
+ */
+static void
+pool_refill (void)
+{
+  while (pool.parked + pool.starting < pool.size)
+    pool_spawn ();
+}
+
+/**
+ * pool_request peeks at the message of a pending client once all of it has
+ * arrived, to answer stat requests here and to hand claims to a worker. A
+ * client that is slow to send never holds up the pool, it stays pending.
+ */
+static void
+pool_request (size_t i)
+{
+  struct pool_message msg;
+  struct pool_claim client;
+  struct pollfd pfd;
+  ssize_t ret;
+
+  /**
+   * Part of a message stays pending, unless the client hung up already.
+   */
+  client = pool.pending[i];
+  ret = recv (client.fd, &msg, sizeof (msg), MSG_PEEK | MSG_DONTWAIT);
+  if (ret > 0 && ret < (ssize_t) sizeof (msg)) {
+    pfd = (struct pollfd){.fd = client.fd, .events = POLLRDHUP};
+    if (poll (&pfd, 1, 0) == 0)
+      return;
+    ret = 0;
+  }
+  else if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+    errno = 0;
+    return;
+  }
+  errno = 0;
+  boxer_fd_unpoll (client.fd);
+  pool.pending[i] = pool.pending[--pool.pendings];
+  if (ret <= 0) {
+    warning ("Dropping a client without a message");
+    close (client.fd);
+    return;
+  }
+
+  switch (msg.type) {
+    case POOL_CLAIM:
+      pool.claims++;
+      pool_dispatch (client.fd, client.time);
+      break;
+    case POOL_STAT:
+      pool_stat (client.fd);
+      close (client.fd);
+      break;
+    default:
+      warning ("Dropping a client with message type %u", msg.type);
+      close (client.fd);
+  }
+}
+
+/**
+ * pool_run is the pool daemon. It keeps pool.size containers prepared, each
+ * by a worker process of its own, and hands every claim to a parked worker.
+ */
+static void
+pool_run (void)
+{
+  struct sockaddr_un addr;
+  struct epoll_event events[16];
+  struct signalfd_siginfo sig;
+  sigset_t mask;
+  size_t i;
+  int j;
+  int n;
+
+  path_create ("/run/boxer/pool");
+  pool.path = path_join ("/run/boxer/pool/%s.sock", pool.name);
+  zero (addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (pool.path) >= sizeof (addr.sun_path))
+    fatal ("Pool name %s is too long", pool.name);
+  strcpy (addr.sun_path, pool.path);
+
+  pool.listen = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (pool.listen < 0)
+    fatal ("socket");
+  unlink (pool.path);
+  errno = 0;
+  if (bind (pool.listen, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    fatal ("bind %s", pool.path);
+  if (chmod (pool.path, 0600) != 0)
+    fatal ("chmod %s", pool.path);
+  if (listen (pool.listen, SOMAXCONN) != 0)
+    fatal ("listen %s", pool.path);
+
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) == -1)
+    fatal ("sigprocmask");
+  boxer.fd.signal = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (boxer.fd.signal == -1)
+    fatal ("signalfd");
+  boxer.fd.epoll = epoll_create1 (EPOLL_CLOEXEC);
+  if (boxer.fd.epoll < 0)
+    fatal ("epoll_create1");
+  boxer_fd_poll (pool.listen);
+  boxer_fd_poll (boxer.fd.signal);
+
+  info ("Keeping %zu containers prepared for pool %s on %s", pool.size, pool.name, pool.path);
+  pool_refill ();
+  for (;;) {
+    n = epoll_wait (boxer.fd.epoll, events, length (events), -1);
+    if (n == -1)
+      fatal ("epoll_wait");
+    for (j = 0; j < n; j++) {
+      if (events[j].data.fd == pool.listen)
+        pool_accept ();
+      else if (events[j].data.fd == boxer.fd.signal) {
+        while (read (boxer.fd.signal, &sig, sizeof (sig)) == sizeof (sig)) {
+          if (sig.ssi_signo == SIGCHLD)
+            pool_reap ();
+          else
+            pool_stop ();
+        }
+        errno = 0;
+      }
+      else {
+        for (i = 0; i < pool.pendings; i++)
+          if (pool.pending[i].fd == events[j].data.fd)
+            break;
+        if (i < pool.pendings) {
+          pool_request (i);
+          continue;
+        }
+        for (i = 0; i < pool.workers; i++)
+          if (pool.worker[i].fd == events[j].data.fd)
+            pool_update (pool.worker + i);
+      }
+    }
+    pool_refill ();
+  }
+}
+
+/**
+ * pool_send sends a message with the data and n file descriptors attached.
+ * It returns false if the peer is gone.
+ */
+static bool
+pool_send (int fd, const struct pool_message *msg, const void *data, const int *fds, size_t n)
+{
+  char control[CMSG_SPACE (3 * sizeof (int))];
+  struct cmsghdr *cmsg;
+  struct msghdr hdr;
+  struct iovec iov[2];
+
+  iov[0].iov_base = (void *) msg;
+  iov[0].iov_len = sizeof (*msg);
+  iov[1].iov_base = (void *) data;
+  iov[1].iov_len = msg->size;
+  zero (hdr);
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = data ? 2 : 1;
+  if (n > 0) {
+    zero (control);
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE (n * sizeof (int));
+    cmsg = CMSG_FIRSTHDR (&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (n * sizeof (int));
+    memcpy (CMSG_DATA (cmsg), fds, n * sizeof (int));
+  }
+  if (sendmsg (fd, &hdr, MSG_NOSIGNAL) != (ssize_t) (sizeof (*msg) + (data ? msg->size : 0))) {
+    errno = 0;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * pool_spawn starts a worker, which prepares a container and reports to the
+ * daemon through a socket pair.
+ */
+static void
+pool_spawn (void)
+{
+  int link[2];
+  pid_t pid;
+  size_t i;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, link) != 0)
+    fatal ("socketpair");
+  pid = fork ();
+  if (pid == -1)
+    fatal ("fork");
+  if (pid == 0) {
+    close (link[0]);
+    close (pool.listen);
+    close (boxer.fd.epoll);
+    close (boxer.fd.signal);
+    for (i = 0; i < pool.workers; i++)
+      if (pool.worker[i].fd >= 0)
+        close (pool.worker[i].fd);
+    for (i = 0; i < pool.waits; i++)
+      close (pool.waiting[i].fd);
+    pool_worker (link[1]);
+  }
+
+  close (link[1]);
+  fd_block (link[0], false);
+  pool.worker = reallocarray (pool.worker, pool.workers + 1, sizeof (struct pool_worker));
+  if (pool.worker == NULL)
+    fatal ("reallocarray");
+  pool.worker[pool.workers++] = (struct pool_worker){pid, link[0], POOL_WORKER_STARTING};
+  pool.starting++;
+  boxer_fd_poll (link[0]);
+}
+
+static int
+pool_stat_compare (const void *a, const void *b)
+{
+  const uint32_t *x = a;
+  const uint32_t *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+/**
+ * pool_stat sends the state of the pool and percentiles of the time from
+ * accepting a claim until its command started, over the last claims.
+ */
+static void
+pool_stat (int client)
+{
+  struct pool_message msg;
+  uint32_t sorted[POOL_LATENCIES];
+  size_t n;
+  char *text;
+
+  n = pool.latencies < POOL_LATENCIES ? pool.latencies : POOL_LATENCIES;
+  memcpy (sorted, pool.latency, n * sizeof (uint32_t));
+  qsort (sorted, n, sizeof (uint32_t), pool_stat_compare);
+  if (n == 0)
+    sorted[0] = 0;
+
+#define percentile(p) (sorted[n > 0 ? (n - 1) * (p) / 100 : 0] / 1000.0)
+  if (asprintf (&text,
+                "Pool:      %s\n"
+                "Size:      %zu\n"
+                "Parked:    %zu\n"
+                "Starting:  %zu\n"
+                "Running:   %zu\n"
+                "Waiting:   %zu\n"
+                "Claims:    %zu\n"
+                "Latency:   p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms of %zu claims\n",
+                pool.name, pool.size, pool.parked, pool.starting,
+                pool.workers - pool.parked - pool.starting, pool.waits, pool.claims,
+                percentile (50), percentile (90), percentile (99), percentile (100), n) < 0)
+    fatal ("asprintf");
+#undef percentile
+
+  zero (msg);
+  msg.type = POOL_STAT;
+  msg.size = strlen (text);
+  pool_send (client, &msg, text, NULL, 0);
+  free (text);
+}
+
+/**
+ * pool_stop shuts the pool down. Closing the socket pairs makes the parked
+ * workers drop their containers, running containers finish on their own.
+ */
+static void
+pool_stop (void)
+{
+  size_t i;
+
+  info ("Stopping pool %s", pool.name);
+  unlink (pool.path);
+  for (i = 0; i < pool.workers; i++)
+    if (pool.worker[i].fd >= 0)
+      close (pool.worker[i].fd);
+  exit (EXIT_SUCCESS);
+}
+
+/**
+ * pool_update handles the messages of a worker: a worker reports when its
+ * container is parked and how long its claim took to start.
+ */
+static void
+pool_update (struct pool_worker *w)
+{
+  struct pool_message msg;
+  struct pool_claim claim;
+
+  while (w->fd >= 0) {
+    if (pool_recv (w->fd, &msg, NULL, 0, MSG_DONTWAIT) < 0) {
+      if (errno != EAGAIN) {
+        boxer_fd_unpoll (w->fd);
+        close (w->fd);
+        w->fd = -1;
+      }
+      errno = 0;
+      return;
+    }
+    switch (msg.type) {
+      case POOL_PARKED:
+        w->state = POOL_WORKER_PARKED;
+        pool.starting--;
+        pool.parked++;
+        pool.started = true;
+        if (pool.waits > 0) {
+          claim = pool.waiting[0];
+          memmove (pool.waiting, pool.waiting + 1, --pool.waits * sizeof (struct pool_claim));
+          pool_dispatch (claim.fd, claim.time);
+        }
+        break;
+      case POOL_STARTED:
+        pool.latency[pool.latencies++ % POOL_LATENCIES] = msg.value;
+        break;
+    }
+  }
+}
+
+/**
+ * pool_worker prepares a container and parks it until the daemon hands it a
+ * claim. It passes the claim on to the container, tells the client and the
+ * daemon once the command started, and supervises the container like a
+ * regular boxer process until the command exits or the client is gone.
+ */
+static void
+pool_worker (int daemon)
+{
+  struct signalfd_siginfo sig;
+  struct pool_message msg;
+  struct pollfd fds[3];
+  siginfo_t info;
+  sigset_t mask;
+  uint64_t time;
+  char *data;
+  char byte;
+  int stdio[3];
+  int link[2];
+  int client;
+  int i;
+  pid_t pid;
+
+  /**
+   * The container process inherits the signal mask of the daemon, which
+   * would block these signals for the command.
+   */
+  sigemptyset (&mask);
+  if (sigprocmask (SIG_SETMASK, &mask, NULL) != 0)
+    fatal ("sigprocmask");
 
-  container.rlimit = calloc (argc, sizeof (struct container_rlimit));
-  if (container.rlimit == NULL)
-    fatal ("calloc");
+  boxer_init ();
+  console_init ();
+  container_init ();
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, link) != 0)
+    fatal ("socketpair");
+  pid = boxer_start (false);
+  if (pid == 0) {
+    close (daemon);
+    close (link[0]);
+    if (setsid () < 0)
+      fatal ("setsid");
+    container_setup ();
+    pool_park (link[1]);
+    container_run ();
+  }
+  close (link[1]);
 
-  container.bind = calloc (argc, sizeof (struct mount));
-  if (container.bind == NULL)
-    fatal ("calloc");
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+    fatal ("sigprocmask");
+  boxer.fd.signal = signalfd (-1, &mask, SFD_CLOEXEC);
+  if (boxer.fd.signal == -1)
+    fatal ("signalfd");
 
-  for (i = 1; argv[i] != NULL; i++) {
-    char *name;
-    char *argument;
+  if (pool_recv (link[0], &msg, NULL, 0, 0) < 0 || msg.type != POOL_PARKED)
+    pool_worker_stop (false, EXIT_FAILURE);
+  if (!pool_send (daemon, &msg, NULL, NULL, 0))
+    pool_worker_stop (false, EXIT_FAILURE);
+  info ("Container parked in pool %s", pool.name);
+  if (pool_recv (daemon, &msg, &client, 1, 0) != 1)
+    pool_worker_stop (false, EXIT_FAILURE);
+  time = msg.time;
 
-    name = argv[i];
-    if (name[0] != '-')
+  /**
+   * Containers run as the user of the pool, so only that user and root may
+   * claim them.
+   */
+  if (pool_recv (client, &msg, stdio, 3, 0) != 3 || msg.type != POOL_CLAIM) {
+    warning ("Invalid claim for pool %s", pool.name);
+    pool_worker_stop (false, EXIT_FAILURE);
+  }
+  if (msg.uid != 0 && msg.uid != container.user.uid) {
+    warning ("User %u may not claim containers of pool %s", msg.uid, pool.name);
+    pool_worker_stop (false, EXIT_FAILURE);
+  }
+  data = pool_data (client, msg.size);
+  if (!pool_send (link[0], &msg, data, stdio, 3))
+    pool_worker_stop (false, EXIT_FAILURE);
+  for (i = 0; i < 3; i++)
+    close (stdio[i]);
+  free (data);
+
+  if (read (link[0], &byte, 1) != 0)
+    pool_worker_stop (false, EXIT_FAILURE);
+  close (link[0]);
+  zero (msg);
+  msg.type = POOL_STARTED;
+  msg.value = (int32_t) ((pool_now () - time) / 1000);
+  pool_send (client, &msg, NULL, NULL, 0);
+  pool_send (daemon, &msg, NULL, NULL, 0);
+  close (daemon);
+
+  fds[0] = (struct pollfd){.fd = boxer.fd.child, .events = POLLIN};
+  fds[1] = (struct pollfd){.fd = client, .events = POLLIN};
+  fds[2] = (struct pollfd){.fd = boxer.fd.signal, .events = POLLIN};
+  while (poll (fds, length (fds), -1) < 0)
+    if (errno != EINTR)
+      fatal ("poll");
+  errno = 0;
+  if (fds[1].revents || fds[2].revents) {
+    if (fds[2].revents)
+      read (boxer.fd.signal, &sig, sizeof (sig));
+    warning ("Claim of pool %s was cancelled", pool.name);
+    pool_worker_stop (false, EXIT_FAILURE);
+  }
+
+  zero (info);
+  if (waitid (P_PIDFD, boxer.fd.child, &info, WEXITED) != 0)
+    fatal ("waitid");
+  container_kill ();
+  container_finish (true, info.si_status);
+  zero (msg);
+  msg.type = POOL_EXITED;
+  msg.value = info.si_status;
+  pool_send (client, &msg, NULL, NULL, 0);
+  exit (EXIT_SUCCESS);
+}
+
+/**
+ * pool_worker_stop drops the container of a worker whose claim failed or
+ * was cancelled.
+ */
+static void
+pool_worker_stop (bool exited, int status)
+{
+  container_kill ();
+  container_finish (exited, status);
+  exit (status);
+}
+
+static void
+setup_binds (void)
+{
+  size_t i;
+
+  for (i = 0; container.bind[i].source != NULL; i++)
+    mount_setup (container.bind + i);
+}
+
+static void
+setup_console (void)
+{
+  char *path;
+  int fd;
+
+  /**
+   * The profile may leave out devpts or the console node.
+   */
+  path = path_join ("%s/dev/pts/ptmx", container.path.root);
+  if (chmod (path, 0666) != 0 && errno != ENOENT)
+    fatal ("chmod %s", path);
+  errno = 0;
+  free (path);
+
+  if (container.path.console == NULL)
+    return;
+  path = path_join ("%s/dev/console", container.path.root);
+  fd = open (path, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0);
+  if (fd < 0 && errno != EEXIST)
+    fatal ("open %s", path);
+  if (fd >= 0)
+    close (fd);
+  errno = 0;
+  mount_setup (&(struct mount){
+    .source = container.path.console,
+    .target = path,
+    .flags  = MS_BIND,
+  });
+}
+
+/**
+ * setup_devices creates the device nodes and links in /dev, unless /dev was
+ * cloned from a template.
+ */
+static void
+setup_devices (void)
+{
+  size_t i;
+
+  if (template.dev)
+    return;
+  for (i = 0; i < profile.devices; i++)
+    device_setup (profile.device + i);
+  device_links (container.path.root);
+}
+
+static void
+setup_image (void)
+{
+  size_t i;
+
+  switch (container.mode) {
+    case MODE_COPY:
+      for (i = 0; container.image[i].source != NULL; i++) {
+        info ("Creating a copy of %s as root filesystem in %s", container.image[i].path, container.path.root);
+        if (container.image[i].type == IMAGE_TAR)
+          tar_extract (container.image + i, container.path.root);
+        else
+          path_sync (container.image[i].path, container.path.root, i > 0, &container.image[i].index);
+      }
+      break;
+    case MODE_OVERLAY:
+    case MODE_STORE:
+      if (container.image[0].source != NULL)
+        container_setup_overlay ();
       break;
+    case MODE_SYNC:
+      if (container.image[0].source != NULL) {
+        info ("Syncing image into persistent root filesystem in %s", container.path.root);
+        delta_setup ();
+      }
+      break;
+  }
+}
 
-    /**
-     * Allow --name argument and --name=argument.
-     *
-     * Assume that all options take arguments. Only two options take no
-     * arguments: --help and --version. These two options exit the program
-     * on their options_set() call, so it doesn't matter if we assign them
-     * the next item in the argv array as argument.
-     */
-    str_split_at (name, '=', &name, &argument);
-    if (argument == NULL)
-      argument = argv[++i];
+/**
+ * setup_mounts creates the default mounts which don't overlap the image, so
+ * they can be mounted while the image is copied. With a template, the static
+ * part of the mount tree is cloned from it and already contains the device
+ * nodes.
+ */
+static void
+setup_mounts (void)
+{
+  size_t i;
+
+  for (i = 0; i < profile.mounts; i++)
+    if (!setup_overlaps (profile.mount[i].source))
+      if (container.path.template == NULL || !template_clone (profile.mount + i))
+        mount_setup (profile.mount + i);
+}
+
+/**
+ * setup_mounts_image creates the default mounts which overlap the image
+ * once the image is in place.
+ */
+static void
+setup_mounts_image (void)
+{
+  size_t i;
+
+  for (i = 0; i < profile.mounts; i++)
+    if (setup_overlaps (profile.mount[i].source))
+      if (container.path.template == NULL || !template_clone (profile.mount + i))
+        mount_setup (profile.mount + i);
+}
+
+/**
+ * setup_overlaps tells if the image may put anything below the top level
+ * directory of path into the root, so a mount on path has to wait for the
+ * image. The contents of a tar archive are only known once it's extracted.
+ */
+static bool
+setup_overlaps (const char *path)
+{
+  char *top;
+  bool result;
+  size_t i;
+
+  for (i = 0; container.image[i].source != NULL; i++)
+    if (container.image[i].type == IMAGE_TAR)
+      return true;
+  top = strndup (path, strcspn (path + 1, "/") + 1);
+  if (top == NULL)
+    fatal ("strndup");
+  result = container_image_contains (top);
+  free (top);
+  return result;
+}
+
+/**
+ * setup_report logs the critical path of the setup, the chain of steps
+ * which each waited for the previous one and ended with the last step.
+ */
+static void
+setup_report (void)
+{
+  struct setup_step *step;
+  char text[512];
+  size_t chain[SETUP_STEPS];
+  size_t n;
+  size_t i;
+  size_t j;
+  int len;
+
+  n = 0;
+  for (i = 1, j = 0; i < SETUP_STEPS; i++)
+    if (setup.step[i].end > setup.step[j].end)
+      j = i;
+  for (;;) {
+    chain[n++] = j;
+    step = setup.step + j;
+    if (step->deps == 0)
+      break;
+    for (i = 0, j = SETUP_STEPS; i < SETUP_STEPS; i++)
+      if ((step->deps & (1u << i)) && (j == SETUP_STEPS || setup.step[i].end > setup.step[j].end))
+        j = i;
+  }
+
+  len = 0;
+  text[0] = '\0';
+  while (n-- > 0 && len < (int) sizeof (text)) {
+    step = setup.step + chain[n];
+    len += snprintf (text + len, sizeof (text) - len, "%s%s %.3f ms", len > 0 ? ", " : "",
+                     step->name, (step->end - step->begin) / 1e6);
+  }
+  for (i = 0; i < SETUP_STEPS; i++)
+    debug ("Setup step %s ran from %.3f ms to %.3f ms", setup.step[i].name,
+           (setup.step[i].begin - setup.start) / 1e6, (setup.step[i].end - setup.start) / 1e6);
+  info ("Set up the container in %.3f ms, critical path: %s", (pool_now () - setup.start) / 1e6, text);
+}
+
+static void
+setup_root (void)
+{
+  path_create (container.path.root);
+
+  /**
+   * Do not propagate mounts to or from the real root.
+   */
+  mount_setup (&(struct mount){
+    .target = "/",
+    .flags  = MS_PRIVATE | MS_REC,
+  });
+
+  /**
+   * In sync mode the container root is persistent and lives on the file
+   * system it was created on. Otherwise it's a tmpfs or a directory of its
+   * own on a disk.
+   */
+  if (container.mode != MODE_SYNC && writable.dir != NULL)
+    mount_setup (&(struct mount){
+      .source = writable.path,
+      .target = container.path.root,
+      .flags  = MS_BIND | MS_NOSUID,
+    });
+  else if (container.mode != MODE_SYNC)
+    mount_setup (&(struct mount){
+      .source = "tmpfs",
+      .target = container.path.root,
+      .type   = "tmpfs",
+      .data   = writable.data,
+      .flags  = MS_NOSUID,
+    });
+}
+
+/**
+ * setup_run runs the setup steps, each as soon as the steps it depends on
+ * finished. The image is copied while the mounts and device nodes outside
+ * of it are created. The overlay is mounted on the root, so in the overlay modes all mounts
+ * wait for the image. Steps which can't get a thread of their own run right
+ * away instead.
+ */
+static void
+setup_run (void)
+{
+  const unsigned int mounts = 1u << SETUP_MOUNTS | 1u << SETUP_MOUNTS_IMAGE;
+  const bool overlay = container.mode == MODE_OVERLAY || container.mode == MODE_STORE;
+  struct setup_step *step;
+  bool started;
+  size_t i;
 
+#define step(id,fn,mask) \
+  setup.step[id] = (struct setup_step){.name = #fn, .run = setup_##fn, .deps = (mask)}
+  step (SETUP_ROOT, root, 0);
+  step (SETUP_IMAGE, image, 1u << SETUP_ROOT);
+  step (SETUP_UTS, uts, 0);
+  step (SETUP_MOUNTS, mounts, 1u << SETUP_ROOT | (overlay ? 1u << SETUP_IMAGE : 0));
+  step (SETUP_MOUNTS_IMAGE, mounts_image, 1u << SETUP_IMAGE | 1u << SETUP_MOUNTS);
+  step (SETUP_DEVICES, devices, setup_overlaps ("/dev") ? mounts : 1u << SETUP_MOUNTS);
+  step (SETUP_BINDS, binds, 1u << SETUP_IMAGE | 1u << SETUP_DEVICES | mounts);
+  step (SETUP_CONSOLE, console, 1u << SETUP_DEVICES | 1u << SETUP_BINDS);
+#undef step
+  setup.finished = 0;
+  setup.start = pool_now ();
+
+  pthread_mutex_lock (&setup.lock);
+  while (setup.finished != (1u << SETUP_STEPS) - 1) {
     /**
-     * Skip the "-" or "--" prefixes of the option name.
+     * Steps may finish while the lock is dropped to start another one, and
+     * their signal is lost. Only a pass which didn't start anything held the
+     * lock all along and may wait.
      */
-    name++;
-    if (*name == '-') {
-      name++;
-      /**
-       * Just like getopt and getopt_long, allow a single "--" to force
-       * the end of option parsing.
-       */
-      if (*name == '\0')
-        break;
+    started = false;
+    for (i = 0; i < SETUP_STEPS; i++) {
+      step = setup.step + i;
+      if (step->started || (step->deps & setup.finished) != step->deps)
+        continue;
+      step->started = true;
+      started = true;
+      pthread_mutex_unlock (&setup.lock);
+      errno = pthread_create (&step->thread, NULL, setup_step, step);
+      step->threaded = (errno == 0);
+      if (errno == EINVAL || errno == EAGAIN)
+        setup_step (step);
+      else if (errno != 0)
+        fatal ("pthread_create");
+      errno = 0;
+      pthread_mutex_lock (&setup.lock);
     }
+    if (!started && setup.finished != (1u << SETUP_STEPS) - 1)
+      pthread_cond_wait (&setup.change, &setup.lock);
+  }
+  pthread_mutex_unlock (&setup.lock);
 
-    for (j = 0; j < length (options); j++) {
-      if (str_equals (name, options[j].shortname) || str_equals (name, options[j].longname))
-        break;
-      if (str_starts_with (name, options[j].prefix)) {
-        name += strlen (options[j].prefix);
-        break;
+  for (i = 0; i < SETUP_STEPS; i++)
+    if (setup.step[i].threaded && pthread_join (setup.step[i].thread, NULL) != 0)
+      fatal ("pthread_join");
+  setup_report ();
+}
+
+static void *
+setup_step (void *arg)
+{
+  struct setup_step *step = arg;
+
+  step->begin = pool_now ();
+  step->run ();
+  pthread_mutex_lock (&setup.lock);
+  step->end = pool_now ();
+  setup.finished |= 1u << (step - setup.step);
+  pthread_cond_signal (&setup.change);
+  pthread_mutex_unlock (&setup.lock);
+  return NULL;
+}
+
+static void
+setup_uts (void)
+{
+  if (container.uts.host)
+    sethostname (container.uts.host, strlen (container.uts.host));
+  if (container.uts.domain)
+    setdomainname (container.uts.domain, strlen (container.uts.domain));
+}
+
+/**
+ * batch_command runs the containers listed in a job file from this process,
+ * so host-wide setup is done once and a single loop collects all of them.
+ */
+static void
+batch_command (int argc, char *const argv[])
+{
+  struct epoll_event events[16];
+  struct signalfd_siginfo sig;
+  sigset_t mask;
+  cpu_set_t cpus;
+  char *name;
+  char *value;
+  size_t j;
+  int i;
+  int n;
+
+  for (i = 1; i < argc && str_starts_with (argv[i], "--"); i++) {
+    str_split_at (argv[i], '=', &name, &value);
+    if (str_equals (name, "--jobs") && value != NULL)
+      batch.limit = str_to_long (value);
+    else if (str_equals (name, "--results") && value != NULL)
+      batch.results = value;
+    else
+      fatal ("Unknown option %s", argv[i]);
+  }
+  if (i + 1 != argc)
+    fatal ("Call: %s batch [--jobs=N] [--results=FILE] JOBS", program_invocation_short_name);
+
+  /**
+   * Container setup keeps a core busy, so by default as many containers
+   * start at a time as this process may use cores.
+   */
+  if (batch.limit == 0) {
+    batch.limit = 1;
+    if (sched_getaffinity (0, sizeof (cpus), &cpus) == 0)
+      batch.limit = CPU_COUNT (&cpus);
+    errno = 0;
+  }
+  batch_load (argv[i]);
+  default_value (batch.results, path_join ("%s.results", argv[i]));
+  batch.out = fopen (batch.results, "we");
+  if (batch.out == NULL)
+    fatal ("fopen %s", batch.results);
+  fprintf (batch.out, "line\tid\tstatus\tstart_ms\tsetup_ms\trun_ms\tjob\n");
+
+  /**
+   * Each container shares a mount namespace of its own with this process.
+   * They're all created from the mount namespace this process started in.
+   */
+  batch.base = open ("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+  if (batch.base < 0)
+    fatal ("open /proc/self/ns/mnt");
+  batch.cwd = open (".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (batch.cwd < 0)
+    fatal ("open .");
+
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+    fatal ("sigprocmask");
+  boxer.fd.signal = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (boxer.fd.signal == -1)
+    fatal ("signalfd");
+  boxer.fd.epoll = epoll_create1 (EPOLL_CLOEXEC);
+  if (boxer.fd.epoll < 0)
+    fatal ("epoll_create1");
+  boxer_fd_poll (boxer.fd.signal);
+
+  batch.id = boxer.id;
+  info ("Running %zu jobs of %s, %zu at a time", batch.jobs, argv[i], batch.limit);
+  batch.start = pool_now ();
+  while (batch.next < batch.jobs || batch.running > 0) {
+    while (batch.running < batch.limit && batch.next < batch.jobs)
+      batch_launch (batch.job + batch.next++);
+    n = epoll_wait (boxer.fd.epoll, events, length (events), -1);
+    if (n == -1)
+      fatal ("epoll_wait");
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == boxer.fd.signal) {
+        if (read (boxer.fd.signal, &sig, sizeof (sig)) != sizeof (sig))
+          fatal ("read signalfd");
+        warning ("Stopping %zu running jobs", batch.running);
+        for (j = 0; j < batch.next; j++)
+          if (batch.job[j].pidfd >= 0)
+            batch_finish (batch.job + j, false);
+        batch_report ();
+        exit (EXIT_FAILURE);
       }
+      for (j = 0; j < batch.next; j++)
+        if (batch.job[j].pidfd == events[i].data.fd)
+          batch_finish (batch.job + j, true);
     }
+  }
+  batch_report ();
+  exit (batch.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int
+batch_compare (const void *a, const void *b)
+{
+  const uint64_t *x = a;
+  const uint64_t *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+/**
+ * batch_finish cleans up after the container of a job like boxer_stop does,
+ * killing it first unless it exited, and writes the result of the job.
+ */
+static void
+batch_finish (struct batch_job *job, bool exited)
+{
+  siginfo_t info;
+  uint64_t end;
+
+  job->status = EXIT_FAILURE;
+  if (exited) {
+    zero (info);
+    if (waitid (P_PIDFD, job->pidfd, &info, WEXITED) != 0)
+      fatal ("waitid");
+    job->status = info.si_status;
+  }
+  job->end = pool_now ();
+  boxer_fd_unpoll (job->pidfd);
+
+  /**
+   * A container that failed before it was set up spent all its time in
+   * the setup.
+   */
+  if (read (job->timing, &end, sizeof (end)) == sizeof (end))
+    job->setup = end - job->start;
+  else
+    job->setup = job->end - job->start;
+  close (job->timing);
+  errno = 0;
+
+  boxer.id = job->id;
+  boxer.fd.child = job->pidfd;
+  container = job->container;
+  writable = job->writable;
+  exec = job->exec;
+  commit = job->commit;
+  idmap = job->idmap;
+  net = job->net;
+  batch_switch (job->mnt);
+  container_kill ();
+  container_finish (exited, job->status);
+  batch_switch (batch.base);
+  boxer.id = batch.id;
+
+  close (job->pidfd);
+  close (job->mnt);
+  job->pidfd = -1;
+  batch.running--;
+  if (job->status != EXIT_SUCCESS)
+    batch.failed++;
+  fprintf (batch.out, "%zu\t%s\t%d\t%.3f\t%.3f\t%.3f\t%s\n", job->line, job->id, job->status,
+           (job->start - batch.start) / 1e6, job->setup / 1e6,
+           (job->end - job->start - job->setup) / 1e6, job->text);
+  fflush (batch.out);
+}
+
+/**
+ * batch_launch starts the container of a job the way main does, but
+ * without a terminal and with the standard input closed.
+ */
+static void
+batch_launch (struct batch_job *job)
+{
+  sigset_t mask;
+  uint64_t end;
+  int timing[2];
+  pid_t pid;
+  int argc;
+  int fd;
 
-    if (j >= length (options))
-      options_set (OPTION_UNKOWN, name, argument);
-    else
-      options_set (options[j].id, name, argument);
-  }
+  zero (container);
+  zero (writable);
+  zero (exec);
+  zero (commit);
+  zero (idmap);
+  zero (template);
+  zero (mounter);
+  zero (user);
+  zero (net);
+  free (profile.mount);
+  free (profile.device);
+  zero (profile);
+  for (argc = 0; job->argv[argc] != NULL; argc++)
+    ;
+  options_parse (argc, job->argv);
+  if (pool.name)
+    fatal ("Job in line %zu of the job file can't use a pool", job->line);
+  if (notify.fd >= 0)
+    fatal ("Job in line %zu of the job file can't use --ready-fd", job->line);
+  job->id = str_random ("abcdefghijklmnopqrstuvwxyz0123456789", 20);
+  boxer.id = job->id;
+  console_init ();
+  container_init ();
 
   /**
-   * What's left should be the command to run inside the container.
+   * The container process sets itself up after boxer_start returned, so it
+   * reports when it's done on a pipe of its own.
    */
-  if (argv[i] != NULL)
-    container.cmd = (char **) argv + i;
+  if (pipe2 (timing, O_CLOEXEC) != 0)
+    fatal ("pipe2");
+  job->start = pool_now ();
+  batch_switch (batch.base);
+  pid = boxer_start (false);
+  if (pid == 0) {
+    close (timing[0]);
+    sigemptyset (&mask);
+    if (sigprocmask (SIG_SETMASK, &mask, NULL) != 0)
+      fatal ("sigprocmask");
+    fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || dup2 (fd, STDIN_FILENO) != STDIN_FILENO)
+      fatal ("open /dev/null");
+    if (setsid () < 0)
+      fatal ("setsid");
+    container_setup ();
+    end = pool_now ();
+    if (write (timing[1], &end, sizeof (end)) != sizeof (end))
+      fatal ("write");
+    container_run ();
+  }
+  close (timing[1]);
+  job->timing = timing[0];
+  boxer.id = batch.id;
+
+  job->pidfd = boxer.fd.child;
+  job->mnt = open ("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+  if (job->mnt < 0)
+    fatal ("open /proc/self/ns/mnt");
+  job->container = container;
+  job->writable = writable;
+  job->exec = exec;
+  job->commit = commit;
+  job->idmap = idmap;
+  job->net = net;
+  boxer_fd_poll (job->pidfd);
+  batch.running++;
 }
 
+/**
+ * batch_load reads the job file. Each line holds the options and the
+ * command of a container like the command line of boxer. Empty lines and
+ * lines starting with # are skipped.
+ */
 static void
-options_set (int option, const char *name, char *value)
+batch_load (const char *path)
 {
-  switch (option) {
-    case OPTION_HELP:
-      print_help ();
-      exit (0);
-      break;
-    case OPTION_VERSION:
-      print_version ();
-      exit (0);
-      break;
-    case OPTION_USER:
-      container.user.name = value;
-      break;
-    case OPTION_HOST:
-      container.uts.host = value;
-      break;
-    case OPTION_DOMAIN:
-      container.uts.domain = value;
-      break;
-    case OPTION_IMAGE:
-      container.path.image = value;
-      break;
-    case OPTION_ROOT:
-      container.path.root = value;
-      break;
-    case OPTION_WORK:
-      container.path.work = value;
-      break;
-    case OPTION_HOME:
-      container.path.home = value;
-      break;
-    case OPTION_BIND:
-    case OPTION_BIND_RO:
-      options_set_bind_mount (value, option == OPTION_BIND_RO);
-      break;
-    case OPTION_RLIMIT:
-      debug ("rlimit name='%s' value='%s'", name, value);
-      options_set_rlimit (name, value);
-      break;
-    case OPTION_CGROUP:
-      debug ("cgroup name='%s' value='%s'", name, value);
-      options_set_cgroup (name, value);
-      break;
-    case OPTION_UNKOWN:
-      warning ("Unknown option %s", name);
-      break;
+  struct batch_job *job;
+  char **words;
+  char *line;
+  size_t count;
+  size_t size;
+  size_t n;
+  FILE *f;
+
+  f = fopen (path, "re");
+  if (f == NULL)
+    fatal ("fopen %s", path);
+  line = NULL;
+  size = 0;
+  for (n = 1; getline (&line, &size, f) > 0; n++) {
+    line[strcspn (line, "\n")] = '\0';
+    if (line[strspn (line, " \t")] == '\0' || line[strspn (line, " \t")] == '#')
+      continue;
+    words = str_split_words (line);
+    if (words == NULL)
+      fatal ("Unterminated quote in line %zu of %s", n, path);
+
+    batch.job = reallocarray (batch.job, batch.jobs + 1, sizeof (struct batch_job));
+    if (batch.job == NULL)
+      fatal ("reallocarray");
+    job = batch.job + batch.jobs++;
+    zero (*job);
+    job->line = n;
+    job->pidfd = -1;
+    job->text = strdup (line);
+    if (job->text == NULL)
+      fatal ("strdup");
+
+    /**
+     * The options parser skips the first word, the program name.
+     */
+    for (count = 0; words[count] != NULL; count++)
+      ;
+    job->argv = calloc (count + 2, sizeof (char *));
+    if (job->argv == NULL)
+      fatal ("calloc");
+    job->argv[0] = program_invocation_short_name;
+    memcpy (job->argv + 1, words, count * sizeof (char *));
+    free (words);
   }
+  free (line);
+  fclose (f);
+  if (batch.jobs == 0)
+    fatal ("No jobs in %s", path);
 }
 
+/**
+ * batch_report logs how many jobs failed and percentiles of the time from
+ * starting a container until it exited.
+ */
 static void
-options_set_bind_mount (const char *value, bool readonly)
+batch_report (void)
 {
+  uint64_t *times;
   size_t i;
+  size_t n;
 
-  for (i = 0; container.bind[i].source != NULL; i++)
-    ;
+  times = calloc (batch.next + 1, sizeof (uint64_t));
+  if (times == NULL)
+    fatal ("calloc");
+  for (i = n = 0; i < batch.next; i++)
+    if (batch.job[i].end > 0)
+      times[n++] = batch.job[i].end - batch.job[i].start;
+  qsort (times, n, sizeof (uint64_t), batch_compare);
+
+#define percentile(p) (times[n > 0 ? (n - 1) * (p) / 100 : 0] / 1e6)
+  info ("Ran %zu jobs in %.3f s, %zu failed, results are in %s",
+        n, (pool_now () - batch.start) / 1e9, batch.failed, batch.results);
+  info ("Job time p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+        percentile (50), percentile (90), percentile (99), percentile (100));
+#undef percentile
+  free (times);
+  fclose (batch.out);
+}
 
-  str_split_at (value, ':', &container.bind[i].source, &container.bind[i].target);
-  container.bind[i].flags = MS_BIND;
-  if (readonly)
-    container.bind[i].flags |= MS_RDONLY;
+/**
+ * batch_switch enters the mount namespace mnt. Entering a mount namespace
+ * changes the working directory, which the relative paths of the job file
+ * need, so it's restored.
+ */
+static void
+batch_switch (int mnt)
+{
+  if (setns (mnt, CLONE_NEWNS) != 0)
+    fatal ("setns");
+  if (fchdir (batch.cwd) != 0)
+    fatal ("fchdir");
 }
 
+/**
+ * exec_add adds a cgroup of the container to the sub-cgroups of commands.
+ */
 static void
-options_set_cgroup (const char *name, char *value)
+exec_add (char *path, bool unified)
 {
-  char *subsystem;
-  char *parameter;
   size_t i;
 
-  if (sscanf (name, "%m[^.].%ms", &subsystem, &parameter) != 2)
-    stop ("sscanf %%m[^.].%%ms %s", name);
+  for (i = 0; i < exec.cgroups; i++)
+    if (str_equals (exec.cgroup[i].path, path))
+      return;
+  exec.cgroup = reallocarray (exec.cgroup, exec.cgroups + 1, sizeof (struct exec_cgroup));
+  if (exec.cgroup == NULL)
+    fatal ("reallocarray");
+  exec.cgroup[exec.cgroups++] = (struct exec_cgroup){
+    .path = path,
+    .unified = unified,
+  };
+}
 
-  for (i = 0; container.cgroup[i].subsystem != NULL; i++) {
-    if (!str_equals (subsystem, container.cgroup[i].subsystem))
-      continue;
-    if (!str_equals (parameter, container.cgroup[i].parameter))
-      continue;
-    break;
+/**
+ * exec_command runs a command in a running container. It joins the
+ * namespaces and the root directory of the container process, puts the
+ * command into sub-cgroups of the container and supervises it like the
+ * container process, with a terminal of its own if it runs in one.
+ */
+static void
+exec_command (int argc, char *const argv[])
+{
+  const int namespaces = CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNET;
+  struct exec_cgroup *cgroup;
+  char *tasks;
+  char *path;
+  size_t i;
+  pid_t pid;
+  int pidfd;
+  int root;
+
+  if (argc < 2)
+    fatal ("Call: %s exec ID [COMMAND]...", program_invocation_short_name);
+  exec_load (argv[1]);
+  argv += str_equals (argv[2], "--") ? 3 : 2;
+  if (*argv == NULL) {
+    container.cmd = calloc (2, sizeof (char *));
+    if (container.cmd == NULL)
+      fatal ("calloc");
+    container.cmd[0] = exec.shell;
   }
+  else
+    container.cmd = (char **) argv;
+  container.user.uid = exec.uid;
+  container.user.gid = exec.gid;
 
-  container.cgroup[i].subsystem = subsystem;
-  container.cgroup[i].parameter = parameter;
-  container.cgroup[i].value = value;
+  /**
+   * The PID of the registry may have been reused by now. The pidfd refers
+   * to whatever process has it, so the process is checked for the boxer
+   * cgroup of the container after the pidfd was opened.
+   */
+  pidfd = pidfd_open (exec.pid, 0);
+  if (pidfd < 0)
+    fatal ("Container %s is gone", exec.id);
+  path = path_join ("/proc/%d/root", exec.pid);
+  root = open (path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (root < 0)
+    fatal ("open %s", path);
+  free (path);
+  tasks = path_join ("/sys/fs/cgroup/boxer/%c/%s/tasks", exec.id[0], exec.id);
+  if (!exec_member (tasks, exec.pid))
+    fatal ("Container %s is gone", exec.id);
+
+  /**
+   * The terminal of the command comes from the devpts instance of the
+   * container, so the command finds it under /dev/pts.
+   */
+  console_init ();
+  if (isatty (STDIN_FILENO) && isatty (STDOUT_FILENO)) {
+    path = path_join ("/proc/%d/root/dev/pts/ptmx", exec.pid);
+    console.master = open (path, O_RDWR | O_NOCTTY | O_CLOEXEC | O_NDELAY);
+    if (console.master < 0)
+      fatal ("open %s", path);
+    if (unlockpt (console.master) != 0)
+      fatal ("unlockpt");
+    container.path.console = strdup (ptsname (console.master));
+    if (container.path.console == NULL)
+      fatal ("ptsname");
+    free (path);
+  }
+  errno = 0;
+
+  if (setns (pidfd, namespaces) != 0)
+    fatal ("setns");
+  close (pidfd);
+  for (i = 0; i < exec.cgroups; i++) {
+    cgroup = exec.cgroup + i;
+    cgroup->sub = path_join ("%s/exec-%s", cgroup->path, boxer.id);
+    if (mkdir (cgroup->sub, 0755) != 0)
+      fatal ("mkdir %s", cgroup->sub);
+  }
+
+  pid = fork ();
+  if (pid == -1)
+    fatal ("fork");
+  if (pid == 0) {
+    /**
+     * Joining the boxer cgroup of the container makes sure the command is
+     * killed along with the container.
+     */
+    path_write (tasks, "0\n");
+    for (i = 0; i < exec.cgroups; i++) {
+      cgroup = exec.cgroup + i;
+      path = path_join ("%s/%s", cgroup->sub, cgroup->unified ? "cgroup.procs" : "tasks");
+      path_write (path, "0\n");
+      free (path);
+    }
+    if (fchdir (root) != 0 || chroot (".") != 0)
+      fatal ("chroot");
+    if (container.path.console) {
+      if (setsid () < 0)
+        fatal ("setsid");
+      console_setup_slave ();
+    }
+    if (chdir (exec.work) != 0)
+      fatal ("chdir %s", exec.work);
+    umask (0022);
+    container_run ();
+  }
+
+  free (tasks);
+  close (root);
+  boxer.fd.child = pidfd_open (pid, 0);
+  if (boxer.fd.child < 0)
+    fatal ("pidfd_open");
+  exec.client = true;
+  if (container.path.console)
+    console_setup_master ();
+  boxer_run ();
 }
 
+/**
+ * exec_idle takes the place of the command in a served container. As init
+ * of the PID namespace, it reaps the commands whose boxer exec process is
+ * gone, until the container is stopped.
+ */
 static void
-options_set_rlimit (const char *name, char *value)
+exec_idle (void)
 {
-  char *hard;
-  char *soft;
-  size_t i;
-
-  for (i = 0; container.rlimit[i].name != NULL; i++)
-    if (strcasecmp (name, container.rlimit[i].name) == 0)
-      break;
+  sigset_t mask;
 
-  str_split_at (value, '/', &soft, &hard);
-  if (hard == NULL)
-    hard = soft;
-  container.rlimit[i] = (struct container_rlimit){
-    .name = (char *) name,
-    .soft = str_to_long (soft),
-    .hard = str_to_long (hard)
-  };
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+    fatal ("sigprocmask");
+  info ("Waiting for commands");
+  for (;;) {
+    sigwaitinfo (&mask, NULL);
+    while (waitpid (-1, NULL, WNOHANG) > 0)
+      ;
+  }
 }
 
+/**
+ * exec_load reads the registry file of the container with the given ID, or
+ * of the only container whose ID starts with it.
+ */
 static void
-device_setup (const struct device *dev)
+exec_load (const char *id)
 {
-  struct device d = *dev;
-  struct stat sb;
+  struct dirent *entry;
+  char *line;
+  char *key;
+  char *value;
+  size_t size;
+  DIR *dir;
+  FILE *f;
 
-  if (stat (d.name, &sb) != 0)
-    fatal ("stat %s", d.name);
+  if (strchr (id, '/') || *id == '\0')
+    fatal ("Invalid container ID %s", id);
+  dir = opendir ("/run/boxer/exec");
+  if (dir == NULL)
+    fatal ("No containers are running");
+  while ((entry = readdir (dir)) != NULL) {
+    if (entry->d_name[0] == '.' || !str_starts_with (entry->d_name, id))
+      continue;
+    if (exec.id && !str_equals (entry->d_name, id))
+      fatal ("Container ID %s is ambiguous", id);
+    free (exec.id);
+    exec.id = strdup (entry->d_name);
+    if (exec.id == NULL)
+      fatal ("strdup");
+  }
+  closedir (dir);
+  if (exec.id == NULL)
+    fatal ("Container %s is not running", id);
+
+  exec.path = path_join ("/run/boxer/exec/%s", exec.id);
+  f = fopen (exec.path, "re");
+  if (f == NULL)
+    fatal ("fopen %s", exec.path);
+  line = NULL;
+  size = 0;
+  while (getline (&line, &size, f) > 0) {
+    line[strcspn (line, "\n")] = '\0';
+    str_split_at (line, ' ', &key, &value);
+    if (value == NULL)
+      fatal ("Invalid registry file %s", exec.path);
+    if (str_equals (key, "pid"))
+      exec.pid = (pid_t) str_to_long (value);
+    else if (str_equals (key, "uid"))
+      exec.uid = (uid_t) str_to_long (value);
+    else if (str_equals (key, "gid"))
+      exec.gid = (gid_t) str_to_long (value);
+    else if (str_equals (key, "groups"))
+      for (value = strtok (value, " "); value != NULL; value = strtok (NULL, " "))
+        user_group ((gid_t) str_to_long (value));
+    else if (str_equals (key, "work"))
+      exec.work = value;
+    else if (str_equals (key, "shell"))
+      exec.shell = value;
+    else if (str_equals (key, "cgroup") || str_equals (key, "cgroup2"))
+      exec_add (value, str_equals (key, "cgroup2"));
+  }
+  free (line);
+  fclose (f);
+  if (exec.pid <= 0 || exec.work == NULL || exec.shell == NULL)
+    fatal ("Invalid registry file %s", exec.path);
+  errno = 0;
+}
 
-  default_value (d.mode, sb.st_mode);
-  default_value (d.path, path_join ("%s/%s", container.path.root, d.name));
-  default_value (d.dev, makedev (d.maj, d.min));
+/**
+ * exec_member tells if the tasks file at path lists the given PID.
+ */
+static bool
+exec_member (const char *path, pid_t pid)
+{
+  unsigned long num;
+  bool found;
+  FILE *f;
 
-  info ("Creating %s", dev->name);
-  if (mknod (d.path, d.mode, d.dev) != 0)
-    fatal ("mknod %s in %s", d.name, d.path);
-  if (chown (d.path, sb.st_uid, sb.st_gid) != 0)
-    fatal ("chown %s uid=%sb.st_gid=%d", d.path, sb.st_uid, sb.st_gid);
+  f = fopen (path, "re");
+  if (f == NULL)
+    fatal ("fopen %s", path);
+  found = false;
+  while (!found && fscanf (f, "%lu", &num) == 1)
+    found = (pid_t) num == pid;
+  fclose (f);
+  return found;
 }
 
+/**
+ * exec_register writes the registry file of the container, which lets
+ * boxer exec find the container process and its cgroups.
+ */
 static void
-mount_setup (const struct mount *mnt)
+exec_register (pid_t pid)
 {
-  struct mount m = *mnt;
+  size_t i;
+  int fd;
 
-  default_value (m.target, path_join ("%s/%s", container.path.root, m.source));
-  default_value (m.data, "");
-  default_value (m.type, "");
+  if (container.path.cgroup)
+    exec_add (container.path.cgroup, true);
+  for (i = 0; container.cgroup[i].subsystem != NULL; i++)
+    if (!container.cgroup[i].unified)
+      exec_add (container.cgroup[i].path.hierarchy, false);
 
-  /**
-   * If the user provides any of the default mounts with the container image, e.g.
-   * folders like /bin or /etc, do not bind mount the system directories
-   * and leave the contents up to the user.
-   */
-  if (container_image_contains (m.target))
-    stop ("Skipping %s because it's part of the container image", m.source);
+  path_create ("/run/boxer/exec");
+  exec.path = path_join ("/run/boxer/exec/%s", boxer.id);
+  fd = open (exec.path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    fatal ("open %s", exec.path);
+  dprintf (fd, "pid %d\nuid %d\ngid %d\nwork %s\nshell %s\n",
+           pid, container.user.uid, container.user.gid, container.path.work, container.cmd[0]);
+  dprintf (fd, "groups");
+  for (i = 0; i < container.user.groups; i++)
+    dprintf (fd, " %d", container.user.group[i]);
+  dprintf (fd, "\n");
+  for (i = 0; i < exec.cgroups; i++)
+    dprintf (fd, "%s %s\n", exec.cgroup[i].unified ? "cgroup2" : "cgroup", exec.cgroup[i].path);
+  if (close (fd) != 0)
+    fatal ("close %s", exec.path);
+}
 
-  info ("Mounting %s", m.source);
-  path_create (m.target);
-  if (mount (m.source, m.target, m.type, m.flags, m.data) != 0) {
-    if (errno == ENOENT)
-      stop ("mount %s %s", m.source, m.target);
-    else
-      fatal ("mount %s %s", m.source, m.target);
+/**
+ * exec_serve starts a container without a command of its own, which stays
+ * up until it's stopped, so commands can be run in it with boxer exec.
+ */
+static void
+exec_serve (int argc, char *const argv[])
+{
+  pid_t pid;
+
+  options_parse (argc, argv);
+  if (container.cmd)
+    fatal ("A served container runs no command of its own");
+  console_init ();
+  container_init ();
+
+  pid = boxer_start (false);
+  if (pid == 0) {
+    if (setsid () < 0)
+      fatal ("setsid");
+    container_setup ();
+    notify_setup ();
+    notify_noexec ();
+    exec_idle ();
   }
-  /**
-   * If mount is a bind mount with additional options, the first mount created a bind
-   * mount with the options of the original mount point. To use the mount options of
-   * the user, a remount needs to be done.
-   */
-  if ((m.flags & MS_BIND) && (m.flags != MS_BIND))
-    if (mount (NULL, m.target, m.type, m.flags | MS_REMOUNT, m.data) != 0)
-      fatal ("mount %s %s", m.source, m.target);
+  info ("Serving container %s, run commands in it with %s exec %s", boxer.id, program_invocation_short_name, boxer.id);
+  boxer_run ();
+}
+
+/**
+ * exec_stop kills the command if it's still running, along with everything
+ * it left behind in its cgroup2 sub-cgroup, removes its sub-cgroups and
+ * exits with the given status.
+ */
+static void
+exec_stop (bool exited, int status)
+{
+  struct exec_cgroup *cgroup;
+  siginfo_t info;
+  char *path;
+  size_t i;
+  int retries;
+
+  if (!exited) {
+    pidfd_send_signal (boxer.fd.child, SIGKILL, NULL, 0);
+    waitid (P_PIDFD, boxer.fd.child, &info, WEXITED);
+  }
+  if (container.path.console)
+    console_restore ();
+
+  for (i = 0; i < exec.cgroups; i++) {
+    cgroup = exec.cgroup + i;
+    if (cgroup->unified) {
+      path = path_join ("%s/cgroup.kill", cgroup->sub);
+      if (access (path, F_OK) == 0)
+        path_write (path, "1\n");
+      free (path);
+    }
+    for (retries = 0; rmdir (cgroup->sub) != 0; retries++) {
+      if (errno != EBUSY || retries == 10) {
+        if (errno != ENOENT)
+          warning ("rmdir %s", cgroup->sub);
+        break;
+      }
+      usleep (10 * USLEEP_MILLISECONDS);
+    }
+    errno = 0;
+  }
+  exit (status);
 }
 
-static bool
-container_image_contains (const char *path)
+/**
+ * exec_unregister removes the registry file of the container and the
+ * sub-cgroups which commands left behind.
+ */
+static void
+exec_unregister (void)
 {
-  char *image_path;
-  bool result;
+  struct dirent *entry;
+  DIR *dir;
+  size_t i;
 
-  if (container.path.image == NULL)
-    return false;
-  image_path = path_join ("%s/%s", container.path.image, path);
-  result = path_exists (image_path);
-  free (image_path);
-  return result;
+  if (exec.path == NULL)
+    return;
+  unlink (exec.path);
+  for (i = 0; i < exec.cgroups; i++) {
+    dir = opendir (exec.cgroup[i].path);
+    if (dir == NULL)
+      continue;
+    while ((entry = readdir (dir)) != NULL)
+      if (str_starts_with (entry->d_name, "exec-") && unlinkat (dirfd (dir), entry->d_name, AT_REMOVEDIR) != 0)
+        warning ("rmdir %s/%s", exec.cgroup[i].path, entry->d_name);
+    closedir (dir);
+  }
+  errno = 0;
 }
 
+/**
+ * notify_child runs in the container process after it was cloned and drops
+ * the ends of the pipes which belong to boxer.
+ */
 static void
-container_init (void)
+notify_child (void)
 {
-  struct passwd *pwd;
-  size_t i;
+  if (notify.fd < 0)
+    return;
+  close (notify.setup[0]);
+  close (notify.app[0]);
+}
 
-  /**
-   * Get information about the container user.
-   */
-  if (container.user.name)
-    pwd = getpwnam (container.user.name);
-  else
-    pwd = getpwuid (getuid ());
+/**
+ * notify_exec passes the pipe for the readiness of the command to the
+ * command as the file descriptor given with --ready-fd, right before
+ * container_run executes it. The setup pipe is closed by the execution, which
+ * tells boxer that the command is running.
+ */
+static void
+notify_exec (void)
+{
+  char num[16];
 
-  if (pwd == NULL)
-    fatal ("getpw failed");
+  if (notify.fd < 0)
+    return;
+  if (dup2 (notify.app[1], notify.fd) < 0)
+    fatal ("dup2");
+  if (notify.app[1] != notify.fd)
+    close (notify.app[1]);
+  snprintf (num, sizeof (num), "%d", notify.fd);
+  if (setenv ("BOXER_READY_FD", num, 1) != 0)
+    fatal ("setenv");
+}
 
-  container.user = (struct container_user){
-    .name = strdup (pwd->pw_name),
-    .home = strdup (pwd->pw_dir),
-    .shell = strdup (pwd->pw_shell),
-    .uid = pwd->pw_uid,
-    .gid = pwd->pw_gid,
-  };
+/**
+ * notify_init checks the file descriptor given with --ready-fd and creates
+ * the pipes of the container process, one for its own setup and execution,
+ * one for the readiness of the command.
+ */
+static void
+notify_init (void)
+{
+  if (notify.fd < 0)
+    return;
+  if (fcntl (notify.fd, F_GETFD) < 0)
+    fatal ("Invalid file descriptor %d for --ready-fd", notify.fd);
+  if (pipe2 (notify.setup, O_CLOEXEC) != 0 || pipe2 (notify.app, O_CLOEXEC) != 0)
+    fatal ("pipe2");
+  notify_report ("start", boxer.start, NULL);
+}
 
-  /**
-   * Set the default paths.
-   */
-  default_value (container.path.root, path_join ("/var/boxer/%s/", boxer.id));
-  default_value (container.path.home, container.user.home);
-  default_value (container.path.work, container.path.home);
+/**
+ * notify_noexec tells boxer that the container process won't execute a
+ * command, because it failed or because the container is served, so the
+ * closed setup pipe isn't taken for an execution.
+ */
+static void
+notify_noexec (void)
+{
+  uint64_t none = 0;
+  int err = errno;
 
-  /**
-   * Now that container.path.root is known, place user-defined mount targets
-   * in the container root directory.
-   */
-  for (i = 0; container.bind[i].source != NULL; i++)
-    if (container.bind[i].target)
-      container.bind[i].target = path_join ("%s/%s", container.path.root, container.bind[i].target);
+  if (notify.fd >= 0 && write (notify.setup[1], &none, sizeof (none)) != sizeof (none))
+    warning ("write");
+  errno = err;
+}
 
-  /**
-   * If the user did not provided a command, run the user' shell instead.
-   */
-  if (container.cmd == NULL) {
-    container.cmd = calloc (2, sizeof (char *));
-    if (container.cmd == NULL)
-      fatal ("calloc");
-    container.cmd[0] = container.user.shell;
-  }
+/**
+ * notify_parent runs in boxer after the container process was cloned. It
+ * keeps the reading ends of the pipes, which the loop of boxer_run polls.
+ * A reader which goes away mustn't kill boxer, so SIGPIPE is ignored, but
+ * only here, as ignored signals are inherited by the command.
+ */
+static void
+notify_parent (void)
+{
+  if (notify.fd < 0)
+    return;
+  close (notify.setup[1]);
+  close (notify.app[1]);
+  if (fcntl (notify.setup[0], F_SETFL, O_NONBLOCK) != 0 || fcntl (notify.app[0], F_SETFL, O_NONBLOCK) != 0)
+    fatal ("fcntl O_NONBLOCK");
+  signal (SIGPIPE, SIG_IGN);
 }
 
 /**
- * container_kill reads the cgroups tasks file and kills all processes besides
- * the calling process.
+ * notify_read handles what the container process wrote to one of the pipes.
+ * The setup pipe carries the time when the setup was finished, followed by
+ * zero if no command is executed. It's closed once the command
+ * runs, or when the container process died before. Each line the command writes to its pipe is reported as readiness.
  */
 static void
-container_kill (void)
+notify_read (int fd)
 {
-  const int signum = SIGKILL;
-  unsigned long num;
-  char *path;
-  FILE *f;
+  uint64_t time;
+  ssize_t n;
+  char *end;
 
-  pid_t self = getpid ();
-  pid_t child;
+  if (fd == notify.setup[0]) {
+    while ((n = read (fd, &time, sizeof (time))) == sizeof (time)) {
+      notify.failed = (time == 0);
+      notify.set_up = true;
+      if (time != 0)
+        notify_report ("setup", time, NULL);
+    }
+    if (n == 0) {
+      if (notify.set_up && !notify.failed)
+        notify_report ("exec", pool_now (), NULL);
+      close (fd);
+      notify.setup[0] = -1;
+    }
+    errno = 0;
+    return;
+  }
 
-  path = path_join ("/sys/fs/cgroup/boxer/%s/tasks", boxer.id);
   for (;;) {
-    int killed;
-
-    f = fopen (path, "re");
-    if (f == NULL)
-      fatal ("fopen %s", path);
-    killed = 0;
-    for (;;) {
-      if (fscanf (f, "%lu", &num) != 1)
-        break;
-      child = (pid_t) num;
-      if (child == self)
-        continue;
-      killed++;
-      if (kill (child, signum) != 0)
-        warning ("kill");
-    }
-    if (!feof (f))
-      fatal ("failed to read all pids");
-    fclose (f);
-    /**
-     * It's safe to exit once the tasks file contained only this process' pid.
-     */
-    if (killed == 0)
+    n = read (fd, notify.line + notify.len, sizeof (notify.line) - 1 - notify.len);
+    if (n <= 0)
       break;
-    /**
-     * If one or more processes were killed, give the system some time and see
-     * if new processes are still being created.
-     */
-    usleep (100 * USLEEP_MILLISECONDS);
+    notify.len += n;
+    notify.line[notify.len] = '\0';
+    while ((end = strchr (notify.line, '\n')) != NULL || notify.len == sizeof (notify.line) - 1) {
+      if (end == NULL)
+        end = notify.line + notify.len - 1;
+      *end = '\0';
+      notify_report ("ready", pool_now (), notify.line);
+      notify.len -= end + 1 - notify.line;
+      memmove (notify.line, end + 1, notify.len + 1);
+    }
   }
-  free (path);
-
-  while (waitpid (-1, 0, WNOHANG) > 0);
+  if (n == 0) {
+    if (notify.len > 0)
+      notify_report ("ready", pool_now (), notify.line);
+    notify.len = 0;
+    close (fd);
+    notify.app[0] = -1;
+  }
+  errno = 0;
 }
 
+/**
+ * notify_report writes an event with its CLOCK_MONOTONIC time in
+ * nanoseconds to the file descriptor given with --ready-fd.
+ */
 static void
-container_run (void)
+notify_report (const char *event, uint64_t time, const char *text)
 {
-  /**
-   * Drop the root rights, then run the command.
-   */
-  if (setgid (container.user.gid) != 0)
-    fatal ("setgid");
-  if (setuid (container.user.uid) != 0)
-    fatal ("setuid");
-  if (setuid (0) == 0)
-    fatal ("permissions restorable");
-  if (execv (container.cmd[0], container.cmd) != 0)
-    fatal ("execv");
+  if (dprintf (notify.fd, "%s %s %ju%s%s\n", event, boxer.id, (uintmax_t) time, text ? " " : "", text ? text : "") < 0)
+    warning ("Can't report %s to file descriptor %d", event, notify.fd);
+  errno = 0;
 }
 
+/**
+ * notify_setup runs in the container process once it's set up.
+ */
 static void
-container_setup (void)
+notify_setup (void)
 {
-  char *path;
-  size_t i;
-
-  path_create (container.path.root);
-
-  /**
-   * Do not propagate mounts to or from the real root.
-   */
-  mount_setup (&(struct mount){
-    .target = "/",
-    .flags  = MS_PRIVATE | MS_REC,
-  });
-
-  mount_setup (&(struct mount){
-    .source = "tmpfs",
-    .target = container.path.root,
-    .type   = "tmpfs",
-    .data   = "size=512",
-    .flags  = MS_NOSUID,
-  });
+  uint64_t now = pool_now ();
 
-  if (container.path.image) {
-    info ("Creating a copy of %s as root filesystem in %s", container.path.image, container.path.root);
-    path_sync (container.path.image, container.path.root);
-  }
+  if (notify.fd >= 0 && write (notify.setup[1], &now, sizeof (now)) != sizeof (now))
+    fatal ("write");
+}
 
-  if (container.uts.host)
-    sethostname (container.uts.host, strlen (container.uts.host));
-  if (container.uts.domain)
-    setdomainname (container.uts.domain, strlen (container.uts.domain));
+/**
+ * notify_stop reports the exit status of the container after everything
+ * was cleaned up. Events still in the pipes are reported first.
+ */
+static void
+notify_stop (int status)
+{
+  char text[16];
 
-  for (i = 0; i < length (mounts); i++)
-    mount_setup (mounts + i);
+  if (notify.fd < 0)
+    return;
+  if (notify.setup[0] >= 0)
+    notify_read (notify.setup[0]);
+  if (notify.app[0] >= 0)
+    notify_read (notify.app[0]);
+  snprintf (text, sizeof (text), "%d", status);
+  notify_report ("exit", pool_now (), text);
+}
 
-  mode_t u = umask (0000);
-  for (i = 0; i < length (devices); i++)
-    device_setup (devices + i);
-  umask (u);
+/**
+ * net_claim takes a free network namespace of the pool for the container,
+ * adding one if all are in use. The claim is an exclusive flock on the
+ * namespace file, which is released when boxer exits. Containers of root
+ * may change their namespace, so they get a new one when they're cloned.
+ */
+static void
+net_claim (void)
+{
+  size_t i;
 
-  for (i = 0; container.bind[i].source != NULL; i++)
-    mount_setup (container.bind + i);
+  if (net.mode == NET_HOST || container.user.uid == 0)
+    return;
+  for (i = 0; i < 3 && !net_scan (); i++)
+    net_create ();
+  if (net.path == NULL)
+    fatal ("Can't claim a network namespace of %s", NET_POOL);
+  info ("Joining network namespace %s", net.path);
+}
 
-  path = path_join ("%s/dev/ptmx", container.path.root);
-  if (symlink ("pts/ptmx", path) != 0)
-    fatal ("symlink pts/ptmx %s", path);
-  free (path);
+/**
+ * net_command grows or shrinks the pool to the given number of network
+ * namespaces which aren't in use, so containers don't wait for a new one.
+ */
+static void
+net_command (int argc, char *const argv[])
+{
+  struct dirent *entry;
+  struct statfs sf;
+  size_t count;
+  size_t total;
+  size_t used;
+  char *path;
+  DIR *dir;
+  int fd;
 
-  path = path_join ("%s/dev/pts/ptmx", container.path.root);
-  if (chmod (path, 0666) != 0)
-    fatal ("chmod %s", path);
-  free (path);
+  if (argc != 2)
+    fatal ("Call: %s netns COUNT", program_invocation_short_name);
+  count = (size_t) str_to_long (argv[1]);
+
+  path_create (NET_POOL);
+  dir = opendir (NET_POOL);
+  if (dir == NULL)
+    fatal ("opendir %s", NET_POOL);
+  total = 0;
+  used = 0;
+  while ((entry = readdir (dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    fd = openat (dirfd (dir), entry->d_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (fstatfs (fd, &sf) != 0 || sf.f_type != NSFS_MAGIC)
+      ;
+    else if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+      used++;
+    else if (total >= count) {
+      path = path_join ("%s/%s", NET_POOL, entry->d_name);
+      if (umount2 (path, MNT_DETACH) != 0 || unlink (path) != 0)
+        warning ("Can't remove %s", path);
+      free (path);
+    }
+    else
+      total++;
+    close (fd);
+  }
+  closedir (dir);
+  errno = 0;
 
-  if (container.path.console)
-    mount_setup (&(struct mount){
-      .source = container.path.console,
-      .target = path_join ("%s/dev/console", container.path.root),
-      .flags  = MS_BIND,
-    });
+  for (; total < count; total++)
+    net_create ();
+  info ("The pool %s has %zu network namespaces, %zu of them in use", NET_POOL, total + used, used);
+}
 
-  /**
-   * Change the root directory.
-   */
-  info ("Entering container");
-  if (chroot (container.path.root) != 0)
-    fatal ("chroot");
-  if (chdir ("/") != 0)
-    fatal ("chdir /");
+/**
+ * net_create adds a new network namespace to the pool. boxer enters it
+ * only to bind mount it, then returns to its own namespace.
+ */
+static void
+net_create (void)
+{
+  char *path;
+  char *name;
+  int self;
+  int fd;
 
-  /**
-   *  - /dev/fd -> /proc/self/fd
-   *  - /dev/stdin -> /proc/self/fd/0
-   *  - /dev/stdout -> /proc/self/fd/1
-   *  - /dev/stderr -> /proc/self/fd/2
-   */
-  if (symlink ("/proc/self/fd", "/dev/fd") != 0)
-    fatal ("symlink /dev/fd");
-  if (symlink ("/proc/self/fd/0", "/dev/stdin") != 0)
-    fatal ("symlink /dev/fd");
-  if (symlink ("/proc/self/fd/1", "/dev/stdout") != 0)
-    fatal ("symlink /dev/fd");
-  if (symlink ("/proc/self/fd/2", "/dev/stderr") != 0)
-    fatal ("symlink /dev/fd");
+  path_create (NET_POOL);
+  name = str_random ("abcdefghijklmnopqrstuvwxyz0123456789", 20);
+  path = path_join ("%s/%s", NET_POOL, name);
+  free (name);
+  fd = open (path, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+  if (fd < 0)
+    fatal ("open %s", path);
+  close (fd);
 
-  if (!path_exists (container.path.home)) {
-    path_create (container.path.home);
-    if (chown (container.path.home, container.user.uid, container.user.gid) != 0)
-      fatal ("chown %s", container.path.home);
-  }
+  self = open ("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (self < 0)
+    fatal ("open /proc/self/ns/net");
+  if (unshare (CLONE_NEWNET) != 0)
+    fatal ("unshare");
+  if (mount ("/proc/self/ns/net", path, NULL, MS_BIND, NULL) != 0)
+    fatal ("mount /proc/self/ns/net %s", path);
+  if (setns (self, CLONE_NEWNET) != 0)
+    fatal ("setns");
+  close (self);
+  info ("Created network namespace %s", path);
+  free (path);
+}
 
-  if (!path_exists (container.path.work)) {
-    path_create (container.path.work);
-    if (chown (container.path.work, container.user.uid, container.user.gid) != 0)
-      fatal ("chown %s", container.path.work);
-  }
+/**
+ * net_release hands the network namespace back to the pool.
+ */
+static void
+net_release (void)
+{
+  if (net.path == NULL)
+    return;
+  close (net.fd);
+  free (net.path);
+  net.path = NULL;
+}
 
-  info ("Changing working directory to %s", container.path.work);
-  if (chdir (container.path.work) != 0)
-    fatal ("chdir %s", container.path.work);
+/**
+ * net_scan claims the first network namespace of the pool which isn't in
+ * use. Files whose namespace isn't mounted yet are skipped.
+ */
+static bool
+net_scan (void)
+{
+  struct dirent *entry;
+  struct statfs sf;
+  DIR *dir;
+  int fd;
 
-  /**
-   * This should happen after entering the container. Otherwise the user
-   * inside the container sees an empty /sys/fs/cgroups directory.
-   */
-  container_setup_cgroup ();
-  container_setup_rlimit ();
-  umask (0022);
+  dir = opendir (NET_POOL);
+  if (dir == NULL) {
+    errno = 0;
+    return false;
+  }
+  while (net.path == NULL && (entry = readdir (dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    fd = openat (dirfd (dir), entry->d_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (fstatfs (fd, &sf) == 0 && sf.f_type == NSFS_MAGIC && flock (fd, LOCK_EX | LOCK_NB) == 0) {
+      net.fd = fd;
+      net.path = path_join ("%s/%s", NET_POOL, entry->d_name);
+    }
+    else
+      close (fd);
+  }
+  closedir (dir);
+  errno = 0;
+  return net.path != NULL;
 }
 
+/**
+ * net_setup runs in the container process before it sets itself up, so the
+ * threads of the setup and the command share its network namespace. A
+ * namespace of the pool keeps the state of lo from its last container, so
+ * lo is brought up or down either way.
+ */
 static void
-container_setup_cgroup (void)
+net_setup (void)
 {
-  struct container_cgroup *cgroup;
-  size_t i;
-  pid_t pid;
-
-  pid = getpid ();
-  for (i = 0; container.cgroup[i].subsystem != NULL; i++) {
-    cgroup = container.cgroup + i;
-    default_value (cgroup->path.subsystem, path_join ("/sys/fs/cgroup/%s", cgroup->subsystem));
-    default_value (cgroup->path.hierarchy, path_join ("%s/boxer/%s", cgroup->path.subsystem, boxer.id));
-    default_value (cgroup->path.parameter, path_join ("%s/%s.%s", cgroup->path.hierarchy, cgroup->subsystem, cgroup->parameter));
-    default_value (cgroup->path.tasks, path_join ("%s/tasks", cgroup->path.hierarchy));
+  struct ifreq ifr;
+  bool up;
+  int fd;
 
-    if (!path_exists (cgroup->path.subsystem))
-      mount_setup (&(struct mount){
-        .source = "cgroup",
-        .target = cgroup->path.subsystem,
-        .type   = "cgroup",
-        .data   = cgroup->subsystem,
-      });
+  if (net.mode == NET_HOST)
+    return;
+  if (net.path && setns (net.fd, CLONE_NEWNET) != 0)
+    fatal ("setns %s", net.path);
 
-    path_create (cgroup->path.hierarchy);
-    path_write (cgroup->path.parameter, "%s\n", cgroup->value);
-    path_write (cgroup->path.tasks, "%d\n", pid);
+  fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    fatal ("socket");
+  zero (ifr);
+  strcpy (ifr.ifr_name, "lo");
+  if (ioctl (fd, SIOCGIFFLAGS, &ifr) != 0)
+    fatal ("ioctl SIOCGIFFLAGS lo");
+  up = (net.mode == NET_LOOPBACK);
+  if (((ifr.ifr_flags & IFF_UP) != 0) != up) {
+    ifr.ifr_flags ^= IFF_UP;
+    if (ioctl (fd, SIOCSIFFLAGS, &ifr) != 0)
+      fatal ("ioctl SIOCSIFFLAGS lo");
   }
+  close (fd);
 }
 
+/**
+ * console_buffer_copy moves data from the source to the target through the
+ * buffer in user space, for files which can't be spliced. Like splicing, it
+ * goes on until the source is empty or the target is full.
+ */
 static void
-container_setup_rlimit (void)
+console_buffer_copy (struct console_buffer *buffer, int source, int target)
 {
-#define item(name) [RLIMIT_ ## name] = #name
-  static const char *names[] = {
-    item (CPU),
-    item (FSIZE),
-    item (DATA),
-    item (STACK),
-    item (CORE),
-    item (RSS),
-    item (NOFILE),
-    item (AS),
-    item (NPROC),
-    item (MEMLOCK),
-    item (LOCKS),
-    item (SIGPENDING),
-    item (MSGQUEUE),
-    item (NICE),
-    item (RTPRIO),
-    item (RTTIME),
-  };
-#undef item
+  ssize_t ret;
+  bool more;
+
+  do {
+    more = false;
+    if (buffer->len < sizeof (buffer->data)) {
+      ret = read (source, buffer->data + buffer->len, sizeof (buffer->data) - buffer->len);
+      if (ret > 0) {
+        buffer->len += (size_t) ret;
+        more = true;
+      }
+      else if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+        boxer_fd_unpoll (source);
+    }
 
-  size_t i;
-  size_t j;
+    if (buffer->len > 0) {
+      ret = write (target, buffer->data, buffer->len);
+      if (ret > 0) {
+        memmove (buffer->data, buffer->data + ret, buffer->len - ret);
+        buffer->len -= ret;
+        more = true;
+      }
+    }
+  } while (more);
+  errno = 0;
+}
 
-  for (i = 0; container.rlimit[i].name != NULL; i++) {
-    for (j = 0; j < length (names); j++)
-      if (names[j] && strcasecmp (names[j], container.rlimit[i].name) == 0)
-        break;
-    if (j == length (names))
-      fatal ("Unknown rlimit %s", container.rlimit[i].name);
+/**
+ * console_buffer_init creates the kernel pipe which data is spliced
+ * through. Without it, the data is copied.
+ */
+static void
+console_buffer_init (struct console_buffer *buffer)
+{
+  int size;
 
-    struct rlimit rlimit = {
-      .rlim_cur = container.rlimit[i].soft,
-      .rlim_max = container.rlimit[i].hard,
-    };
-    if (setrlimit (j, &rlimit) != 0)
-      fatal ("setrlimit %s", names[j]);
+  if (pipe2 (buffer->pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    warning ("Can't create a pipe for the console, copying its data");
+    buffer->copy = true;
+    return;
   }
+  size = fcntl (buffer->pipe[0], F_GETPIPE_SZ);
+  buffer->size = size > 0 ? (size_t) size : PIPE_BUF;
+  errno = 0;
 }
 
 static void
 console_buffer_pipe (struct console_buffer *buffer, int source, int target)
 {
-  ssize_t ret;
+  if (!buffer->copy && buffer->pipe[0] >= 0)
+    console_buffer_splice (buffer, source, target);
+  if (buffer->copy)
+    console_buffer_copy (buffer, source, target);
+  console_buffer_wait (buffer, target);
+}
 
-  ret = read (source, buffer->data + buffer->len, sizeof (buffer->data) - buffer->len);
-  if (ret <= 0) {
-    if (errno != EAGAIN && errno != EINTR)
-      boxer_fd_unpoll (source);
-  }
-  else
-    buffer->len += (size_t) ret;
+/**
+ * console_buffer_splice moves data from the source to the target through
+ * the kernel pipe of the buffer, so it never passes through boxer. The
+ * file descriptors are edge triggered, so it moves data as long as either
+ * side of the pipe makes progress. If either side turns out not to support
+ * splice, the buffer falls back to copying. Until the target took spliced
+ * data once, the pipe holds no more than the buffer does, so whatever is
+ * left in the pipe fits into the buffer in that case.
+ */
+static void
+console_buffer_splice (struct console_buffer *buffer, int source, int target)
+{
+  size_t size;
+  ssize_t ret;
+  bool more;
+
+  do {
+    more = false;
+    size = (buffer->spliced ? buffer->size : sizeof (buffer->data)) - buffer->pending;
+    if (size > 0) {
+      ret = splice (source, NULL, buffer->pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (ret > 0) {
+        buffer->pending += (size_t) ret;
+        more = true;
+      }
+      else if (ret < 0 && errno == EINVAL && buffer->pending == 0) {
+        debug ("Can't splice from file descriptor %d, copying its data", source);
+        buffer->copy = true;
+      }
+      else if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+        boxer_fd_unpoll (source);
+    }
 
-  if (buffer->len > 0) {
-    ret = write (target, buffer->data, buffer->len);
-    if (ret > 0) {
-      memmove (buffer->data, buffer->data + ret, buffer->len - ret);
-      buffer->len -= ret;
+    if (buffer->pending > 0) {
+      ret = splice (buffer->pipe[0], NULL, target, NULL, buffer->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (ret > 0) {
+        buffer->pending -= (size_t) ret;
+        buffer->spliced = true;
+        more = true;
+      }
+      else if (ret < 0 && errno == EINVAL && !buffer->spliced) {
+        debug ("Can't splice to file descriptor %d, copying its data", target);
+        ret = read (buffer->pipe[0], buffer->data, buffer->pending);
+        if (ret > 0)
+          buffer->len = (size_t) ret;
+        buffer->pending = 0;
+        buffer->copy = true;
+      }
     }
-  }
+  } while (more && !buffer->copy);
   errno = 0;
 }
 
+/**
+ * console_buffer_wait watches the target for room while data is left over.
+ * The source doesn't signal again until it has new data, which a command
+ * blocked on a full terminal never has.
+ */
+static void
+console_buffer_wait (struct console_buffer *buffer, int target)
+{
+  bool waiting;
+
+  waiting = (buffer->pending > 0 || buffer->len > 0);
+  if (waiting == buffer->waiting)
+    return;
+  buffer->waiting = waiting;
+  boxer_fd_events (target, (target == console.master ? EPOLLIN : 0) | (waiting ? EPOLLOUT : 0));
+}
+
 /**
  * console_forward_size sets the window size of the terminal under the target file descriptor
  * to the window size of the terminal under the source file descriptor.
@@ -1268,6 +9180,8 @@ console_init (void)
 {
   console.stdin = STDIN_FILENO;
   console.stdout = STDOUT_FILENO;
+  console.inp = (struct console_buffer){.pipe = {-1, -1}};
+  console.out = (struct console_buffer){.pipe = {-1, -1}};
 }
 
 static void
@@ -1294,7 +9208,22 @@ console_make_raw (int fd, struct termios *attr)
 static void
 console_restore (void)
 {
+  struct pollfd pfd;
+
+  /**
+   * Nothing waits for the output once boxer exits, so write the rest of it
+   * even if that takes a while, unless nobody reads it anymore.
+   */
+  pfd = (struct pollfd){.fd = console.stdout, .events = POLLOUT};
   console_buffer_pipe (&console.out, console.master, console.stdout);
+  while (console.out.pending > 0 || console.out.len > 0) {
+    if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+      break;
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+      break;
+    console_buffer_pipe (&console.out, console.master, console.stdout);
+  }
+  errno = 0;
   if (console.attr.saved.stdout)
     tcsetattr (console.stdout, TCSANOW, &console.attr.stdout);
   if (console.attr.saved.stdin)
@@ -1329,6 +9258,8 @@ console_setup_master (void)
   fd_block (console.stdin, false);
   fd_block (console.stdout, false);
   fd_block (console.master, false);
+  console_buffer_init (&console.inp);
+  console_buffer_init (&console.out);
 
   console_forward_size (console.stdout, console.master);
   console_make_raw (console.stdin, &console.attr.stdin);
@@ -1363,6 +9294,145 @@ console_setup_slave (void)
   fchown (STDERR_FILENO, container.user.uid, container.user.gid);
 }
 
+/**
+ * boxer_cgroup returns the cgroup of a container below the boxer cgroup of a
+ * hierarchy. The containers are spread over shards named by the first
+ * character of their ID, since every operation on a cgroup gets slower with
+ * the number of its children.
+ */
+static char *
+boxer_cgroup (const char *hierarchy, const char *id)
+{
+  return path_join ("%s/boxer/%c/%s", hierarchy, id[0], id);
+}
+
+/**
+ * boxer_child collects the exit status of the container process once its
+ * pidfd becomes readable.
+ */
+static void
+boxer_child (void)
+{
+  siginfo_t info;
+
+  zero (info);
+  if (waitid (P_PIDFD, boxer.fd.child, &info, WEXITED) != 0)
+    fatal ("waitid");
+  boxer_stop (true, info.si_status);
+}
+
+/**
+ * boxer_clone starts the container process in its own namespaces and, if
+ * cgroup is a valid descriptor, in that cgroup, so even its first allocations
+ * are charged to the container. The pidfd of the process is stored in
+ * boxer.fd.child. If the process couldn't be cloned into the cgroup, cgroup
+ * is set to -1. The mount namespace is left out, this process shares it with
+ * the container to look at its root after it exited.
+ */
+static pid_t
+boxer_clone (int *cgroup)
+{
+  struct clone_args args;
+  pid_t pid;
+
+  zero (args);
+  args.flags = CLONE_PIDFD | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS;
+  args.pidfd = (uint64_t) (uintptr_t) &boxer.fd.child;
+  args.exit_signal = SIGCHLD;
+  if (net.mode != NET_HOST && net.path == NULL)
+    args.flags |= CLONE_NEWNET;
+  if (*cgroup >= 0) {
+    args.flags |= CLONE_INTO_CGROUP;
+    args.cgroup = *cgroup;
+  }
+
+  pid = syscall (SYS_clone3, &args, sizeof (args));
+  if (pid < 0 && *cgroup >= 0 && errno != ENOSYS) {
+    warning ("Can't clone into cgroup");
+    close (*cgroup);
+    *cgroup = -1;
+    args.flags &= ~CLONE_INTO_CGROUP;
+    args.cgroup = 0;
+    pid = syscall (SYS_clone3, &args, sizeof (args));
+  }
+  if (pid >= 0 || errno != ENOSYS)
+    return pid;
+
+  /**
+   * Kernels before 5.3 lack clone3, fork and open the pidfd instead.
+   */
+  errno = 0;
+  if (*cgroup >= 0)
+    close (*cgroup);
+  *cgroup = -1;
+  if (unshare ((args.flags & CLONE_NEWNET) | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS) != 0)
+    fatal ("unshare");
+  pid = fork ();
+  if (pid > 0) {
+    boxer.fd.child = pidfd_open (pid, 0);
+    if (boxer.fd.child < 0)
+      fatal ("pidfd_open");
+  }
+  return pid;
+}
+
+/**
+ * boxer_command runs the boxer command named by the first argument, if there
+ * is one, and exits. Container commands are executed with execv and need a
+ * path, so they can't be mistaken for boxer commands.
+ */
+static void
+boxer_command (int argc, char *const argv[])
+{
+  static const struct {
+    char *name;
+    void (*run) (int, char *const[]);
+  } commands[] = {
+    {"batch", batch_command},
+    {"commit", commit_command},
+    {"exec", exec_command},
+    {"index", index_command},
+    {"netns", net_command},
+    {"pool", pool_command},
+    {"serve", exec_serve},
+    {"store", store_command},
+    {"warmup", warmup_command},
+  };
+
+  size_t i;
+
+  if (argc < 2)
+    return;
+  for (i = 0; i < length (commands); i++) {
+    if (str_equals (argv[1], commands[i].name)) {
+      boxer_init ();
+      commands[i].run (argc - 1, argv + 1);
+      exit (EXIT_SUCCESS);
+    }
+  }
+}
+
+/**
+ * boxer_fd_events changes the events watched on a file descriptor, adding
+ * or removing it as needed.
+ */
+static void
+boxer_fd_events (int fd, uint32_t events)
+{
+  struct epoll_event ev;
+
+  zero (ev);
+  ev.events = events | EPOLLET;
+  ev.data.fd = fd;
+  if (events == 0)
+    boxer_fd_unpoll (fd);
+  else if (epoll_ctl (boxer.fd.epoll, EPOLL_CTL_MOD, fd, &ev) != 0
+           && (errno != ENOENT || epoll_ctl (boxer.fd.epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+           && errno != EPERM)
+    fatal ("epoll_ctl");
+  errno = 0;
+}
+
 static void
 boxer_fd_poll (int fd)
 {
@@ -1402,6 +9472,41 @@ boxer_init (void)
    */
   boxer.id = str_random ("abcdefghijklmnopqrstuvwxyz0123456789", 20);
   boxer.tty = isatty (STDOUT_FILENO);
+  errno = 0;
+}
+
+/**
+ * boxer_mount_cgroup mounts a cgroup v1 hierarchy on target unless it's
+ * mounted already. Many boxer processes may start at once, so the check and
+ * the mount are done under a lock shared by all of them.
+ */
+static void
+boxer_mount_cgroup (const char *target, const char *data, unsigned long flags)
+{
+  struct statfs sf;
+  int fd;
+
+  if (statfs (target, &sf) == 0 && sf.f_type == CGROUP_SUPER_MAGIC)
+    return;
+  errno = 0;
+
+  path_create ("/run/boxer");
+  fd = open ("/run/boxer/cgroup.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    fatal ("open /run/boxer/cgroup.lock");
+  if (flock (fd, LOCK_EX) != 0)
+    fatal ("flock /run/boxer/cgroup.lock");
+  if (statfs (target, &sf) != 0 || sf.f_type != CGROUP_SUPER_MAGIC) {
+    errno = 0;
+    mount_setup (&(struct mount){
+      .source = "cgroup",
+      .target = (char *) target,
+      .type   = "cgroup",
+      .data   = (char *) data,
+      .flags  = flags,
+    });
+  }
+  close (fd);
 }
 
 static void
@@ -1410,7 +9515,6 @@ boxer_run (void)
   sigset_t mask;
 
   sigemptyset (&mask);
-  sigaddset (&mask, SIGCHLD);
   sigaddset (&mask, SIGINT);
   sigaddset (&mask, SIGTERM);
   sigaddset (&mask, SIGWINCH);
@@ -1425,9 +9529,16 @@ boxer_run (void)
   if (boxer.fd.epoll < 0)
     fatal ("epoll_create1");
 
+  boxer_fd_poll (boxer.fd.child);
   boxer_fd_poll (boxer.fd.signal);
-  boxer_fd_poll (console.stdin);
-  boxer_fd_poll (console.master);
+  if (container.path.console) {
+    boxer_fd_poll (console.stdin);
+    boxer_fd_poll (console.master);
+  }
+  if (notify.fd >= 0) {
+    boxer_fd_poll (notify.setup[0]);
+    boxer_fd_poll (notify.app[0]);
+  }
 
   for (;;) {
     struct epoll_event events[16];
@@ -1438,13 +9549,21 @@ boxer_run (void)
     if (n == -1)
       fatal ("epoll_wait");
     for (i = 0; i < n; ++i) {
+      if (events[i].data.fd == boxer.fd.child)
+        boxer_child ();
       if (events[i].data.fd == boxer.fd.signal)
         boxer_signal ();
 
       if (events[i].data.fd == console.stdin)
         console_buffer_pipe (&console.inp, console.stdin, console.master);
-      if (events[i].data.fd == console.master)
+      if (events[i].data.fd == console.master && events[i].events & EPOLLOUT)
+        console_buffer_pipe (&console.inp, console.stdin, console.master);
+      if (events[i].data.fd == console.master && events[i].events & ~EPOLLOUT)
         console_buffer_pipe (&console.out, console.master, console.stdout);
+      if (events[i].data.fd == console.stdout)
+        console_buffer_pipe (&console.out, console.master, console.stdout);
+      if (events[i].data.fd == notify.setup[0] || events[i].data.fd == notify.app[0])
+        notify_read (events[i].data.fd);
     }
   }
 }
@@ -1459,30 +9578,111 @@ boxer_setup (void)
    * The cgroup subsystem will be used to keep track of the container processes
    * via the cgroup tasks files.
    */
-  if (!path_exists ("/sys/fs/cgroup/boxer"))
-    mount_setup (&(struct mount){
-      .source = "cgroup",
-      .target = "/sys/fs/cgroup/boxer",
-      .type   = "cgroup",
-      .data   = "none,name=boxer,xattr",
-      .flags  = MS_NOSUID | MS_NOEXEC | MS_NODEV,
-      });
+  if (!boxer.mounted)
+    boxer_mount_cgroup ("/sys/fs/cgroup/boxer", "none,name=boxer,xattr", MS_NOSUID | MS_NOEXEC | MS_NODEV);
+  boxer.mounted = true;
 
-  path = path_join ("/sys/fs/cgroup/boxer/%s", boxer.id);
+  path = boxer_cgroup ("/sys/fs/cgroup", boxer.id);
   path_create (path);
   free (path);
 
-  path = path_join ("/sys/fs/cgroup/boxer/%s/tasks", boxer.id);
+  path = path_join ("/sys/fs/cgroup/boxer/%c/%s/tasks", boxer.id[0], boxer.id);
   path_write (path, "%d\n", getpid ());
   free (path);
 }
 
+/**
+ * boxer_start prepares everything outside of the container and starts the
+ * container process. It returns 0 in the container process once it's part of
+ * all its cgroups, and the PID of the container process in this process. With
+ * terminal set, the container gets a pseudo terminal of its own.
+ */
+static pid_t
+boxer_start (bool terminal)
+{
+  char go;
+  int ready[2];
+  int cgroup;
+  pid_t pid;
+
+  info ("Boxer ID: %s", boxer.id);
+  info ("User: %s (uid=%d, gid=%d)", container.user.name, container.user.uid, container.user.gid);
+  info ("Root: %s", container.path.root);
+  info ("Home: %s", container.path.home);
+
+  boxer_setup ();
+  if (terminal)
+    console_setup ();
+
+  if (container.mode == MODE_STORE)
+    store_setup ();
+  if (container.warmup)
+    warmup_setup ();
+  if (container.path.template)
+    template_prepare ();
+
+  /**
+   * The user namespace for idmapped layers is created while /proc still
+   * shows the PIDs of this PID namespace.
+   */
+  if (idmap.count > 0 && container.mode != MODE_COPY && container.mode != MODE_SYNC)
+    idmap.fd = idmap_userns ();
+  if (container.path.commit)
+    commit_prepare ();
+  if (writable.dir)
+    writable_prepare ();
+
+  /**
+   * Network namespaces of the pool are bind mounted in the mount namespace
+   * of the host, so they outlive the container.
+   */
+  net_claim ();
+
+  /**
+   * The mount namespace is shared with the container process, the other
+   * namespaces are created when it's cloned.
+   */
+  if (unshare (CLONE_NEWNS) != 0)
+    fatal ("unshare");
+
+  /**
+   * The container process waits until it's part of all its cgroups before it
+   * sets itself up.
+   */
+  cgroup = container_prepare_cgroup ();
+  if (pipe2 (ready, O_CLOEXEC) != 0)
+    fatal ("pipe2");
+  notify_init ();
+  pid = boxer_clone (&cgroup);
+  if (pid == -1)
+    fatal ("clone3");
+  if (pid == 0) {
+    notify_child ();
+    close (ready[1]);
+    if (read (ready[0], &go, 1) != 1)
+      fatal ("Container was not started");
+    close (ready[0]);
+    return 0;
+  }
+
+  close (ready[0]);
+  notify_parent ();
+  container_enter_cgroup (pid, cgroup >= 0);
+  exec_register (pid);
+  go = 1;
+  if (write (ready[1], &go, 1) != 1)
+    fatal ("write");
+  close (ready[1]);
+  if (cgroup >= 0)
+    close (cgroup);
+  return pid;
+}
+
 static void
 boxer_signal (void)
 {
   struct signalfd_siginfo sig;
   ssize_t ret;
-  int status = EXIT_FAILURE;
 
   ret = read (boxer.fd.signal, &sig, sizeof (struct signalfd_siginfo));
   if (ret != sizeof (struct signalfd_siginfo))
@@ -1490,60 +9690,72 @@ boxer_signal (void)
 
   switch (sig.ssi_signo) {
     case SIGWINCH:
-      console_forward_size (console.stdout, console.master);
+      if (container.path.console)
+        console_forward_size (console.stdout, console.master);
       break;
-    case SIGCHLD:
-      status = sig.ssi_status; // fallthrough
     case SIGINT:
     case SIGTERM:
-      container_kill ();
-      console_restore ();
-      exit (status);
+      boxer_stop (false, EXIT_FAILURE);
   }
 }
 
+/**
+ * boxer_stop kills what's left of the container, cleans up and exits with
+ * the given status.
+ */
+static void
+boxer_stop (bool exited, int status)
+{
+  if (exec.client)
+    exec_stop (exited, status);
+  container_kill ();
+  if (container.path.console)
+    console_restore ();
+  container_finish (exited, status);
+  notify_stop (status);
+  exit (status);
+}
+
 int
 main (int argc, char *const argv[])
 {
+  struct timespec cpu;
   pid_t pid;
 
   zero (boxer);
   zero (console);
   zero (container);
+  notify = (struct notify){.fd = -1, .setup = {-1, -1}, .app = {-1, -1}};
 
+  /**
+   * The exec of boxer is estimated as the entry of main minus the CPU time
+   * used so far, which went into loading, linking and libc initialization.
+   */
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  boxer.start = pool_now () - ((uint64_t) cpu.tv_sec * 1000000000 + cpu.tv_nsec);
+
+  boxer_command (argc, argv);
   options_parse (argc, argv);
 
   boxer_init ();
+  if (pool.name && notify.fd >= 0)
+    fatal ("Pooled containers can't use --ready-fd");
+  if (pool.name)
+    pool_claim ();
   console_init ();
   container_init ();
 
-  info ("Boxer ID: %s", boxer.id);
-  info ("User: %s (uid=%d, gid=%d)", container.user.name, container.user.uid, container.user.gid);
-  info ("Root: %s", container.path.root);
-  info ("Home: %s", container.path.home);
-
-  boxer_setup ();
-  console_setup ();
-
-  /**
-   * These namespaces will be active in the forked child process.
-   */
-  if (unshare (CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS) != 0)
-    fatal ("unshare");
-
-  pid = fork ();
-  if (pid == -1)
-    fatal ("fork");
+  pid = boxer_start (true);
   if (pid == 0) {
     if (setsid () < 0)
       fatal ("setsid");
     console_setup_slave ();
     container_setup ();
+    notify_setup ();
+    info ("Executing %s %.3f ms after the start of boxer", container.cmd[0], (pool_now () - boxer.start) / 1e6);
     container_run ();
   }
-  else {
-    console_setup_master ();
-    boxer_run ();
-  }
+  console_setup_master ();
+  boxer_run ();
   return 0;
 }